@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Arena.h"
 #include "Boundary.h"
 #include "Augmentation.h"
 #include "DataManager.h"
@@ -7,6 +8,7 @@
 #include "RawManager.h"
 #include "SweepQueue.h"
 #include "DistVec.h"
+#include "TreeConstructor.h"
 #include <hpx/hpx.hpp>
 #include <memory>
 
@@ -17,43 +19,63 @@ enum State{
     inactive = 3
 };
 
+// Id is the type of the block-local vertex ids in swept, see VertexVec
+template <typename Grid, typename Id>
 class ArcBody {
 public:
-    ArcBody(DataManager* data, DistVec<std::uint64_t>* swept)
-        :boundary(data), augmentation(data), queue(swept), state(State::not_start){}
+    // augment: keep the vertices of the arc, false in flat mode
+    ArcBody(Grid* data, VertexVec<Id>* swept, NodePool* nodePool, bool augment)
+        :boundary(data, nodePool), augmentation(data, augment), queue(swept), state(State::not_start){}
 
     /* member */
     State state;
-    Boundary boundary;
-    Augmentation augmentation;
+    Boundary<Grid> boundary;
+    Augmentation<Grid> augmentation;
     std::vector<std::uint64_t> children = std::vector<std::uint64_t>();
-    std::vector<Augmentation> inheritedAugmentations = std::vector<Augmentation>();
-    SweepQueue queue;
+    SweepQueue<Id> queue;
 
-    hpx::lcos::local::mutex remoteCallLock;
+    // protects the members below, children and the start of the sweep
+    hpx::lcos::local::mutex lock;
+
+    /*
+     * An arc can sweep on several localities, each has its own part (ArcBody) of it. The parts form a
+     * Dijkstra-Scholten tree rooted at the locality where the arc started, see SweepEngine.
+     */
+    // a task owns the queue and sweeps
+    bool sweeping = false;
+    // set when the arc has found its saddle, only on the locality where it started
+    bool finished = false;
+    // messages sent for this arc that are not acknowledged yet
+    int64_t deficit = 0;
+    // locality that gets the acknowledgement once this part is idle, -1 if not engaged
+    int32_t engager = -1;
+    uint64_t reportSeq = 0;
+    // latest boundary reports of the parts that were acknowledged to this one
+    std::vector<BoundaryReport> reports;
+    // children by the localities of their parts, handed over when the sweep starts
+    std::vector<std::pair<uint32_t, std::vector<uint64_t>>> handovers;
+    // children whose parts on this locality wait to be handed over by the owner of the queue (remote parts only)
+    std::vector<std::uint64_t> pendingChildren;
+    // linear grid index and value of the saddle of this arc (remote parts only)
+    uint64_t saddleIndex = INVALID_VERTEX;
+    double saddleValue = 0.0;
+
+    // ghost crossings by destination locality, only used by the owner of the queue
+    std::vector<std::pair<uint32_t, std::vector<uint64_t>>> outgoing;
+    // the augmentation of this part has been written to the shard, see SweepEngine::writePart()
+    bool written = false;
 };
 
 
 
+template <typename Grid, typename Id>
 class Arc {
 public:
-    /* 
-     * 现有的方案在 Arc 构造时多了条件判断，需进一步判断是否会影响程序性能
-     */
-    Arc(uint64_t extremum, DataManager* data, DistVec<std::uint64_t>* swept) : extremum(extremum) {
-        body = std::make_unique<ArcBody>(data, swept);
-    }
-
-    
-    void releaseArcBody(){
-        deactivated = true;
-        if(body != nullptr){
-            body.reset();
-        }
+    // arcs and bodies live in the arenas of the SweepEngine and are released together with it
+    Arc(uint64_t extremum, ArcBody<Grid, Id>* body) : extremum(extremum), body(body) {
     }
 
-    bool deactivated = false;
     uint64_t extremum = INVALID_VERTEX;
     uint64_t saddle = INVALID_VERTEX;
-    std::unique_ptr<ArcBody> body;
+    ArcBody<Grid, Id>* body;
 };
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <hpx/hpx.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Allocation counters of one pool: how many objects were handed out and how many bytes were
+ * reserved from the system for them.
+ */
+struct ArenaStats {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> bytes{0};
+};
+
+/**
+ * @brief Chunked arena for objects of type T that live until the end of the construction.
+ * Objects are never freed one by one, release() runs all destructors and frees the chunks at once; reset() runs
+ * them and keeps the chunks for the next construction.
+ */
+template <typename T>
+class ObjectPool {
+public:
+    static const uint64_t OBJECTS_PER_CHUNK = 4096;
+
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    ~ObjectPool(){
+        this->release();
+    }
+
+    template <typename... Args>
+    T* create(Args&&... args){
+        void* slot;
+        {
+            std::lock_guard<hpx::lcos::local::spinlock> lock(this->lock);
+            if (this->used == OBJECTS_PER_CHUNK || this->filled == 0){
+                if (this->filled == this->chunks.size()){
+                    this->chunks.push_back(static_cast<T*>(::operator new(OBJECTS_PER_CHUNK * sizeof(T))));
+                    this->stats.bytes += OBJECTS_PER_CHUNK * sizeof(T);
+                }
+                ++this->filled;
+                this->used = 0;
+            }
+            slot = this->chunks[this->filled - 1] + this->used++;
+        }
+        ++this->stats.allocations;
+        return new (slot) T(std::forward<Args>(args)...);
+    }
+
+    // destroys all objects and frees the chunks
+    void release(){
+        this->reset();
+        for (T* chunk : this->chunks)
+            ::operator delete(chunk);
+        this->chunks.clear();
+    }
+
+    // destroys all objects, the chunks are reused by create()
+    void reset(){
+        for (size_t c = 0; c < this->filled; ++c){
+            const uint64_t count = (c + 1 == this->filled) ? this->used : OBJECTS_PER_CHUNK;
+            for (uint64_t i = 0; i < count; ++i)
+                this->chunks[c][i].~T();
+        }
+        this->filled = 0;
+        this->used = 0;
+        this->stats.allocations = 0;
+    }
+
+    const ArenaStats& getStats() const {
+        return this->stats;
+    }
+
+private:
+    hpx::lcos::local::spinlock lock;
+    std::vector<T*> chunks;
+    // chunks in use, and objects in the last of them
+    size_t filled = 0;
+    uint64_t used = 0;
+    ArenaStats stats;
+};
+
+/**
+ * @brief Free lists of small fixed size blocks (tree nodes) carved from large chunks.
+ * Blocks go back to the free list of their size class, the chunks are only freed with the pool.
+ */
+class NodePool {
+public:
+    static const size_t ALIGNMENT = 16;
+    static const size_t MAX_BLOCK = 128;
+    static const size_t CHUNK_SIZE = 1 << 16;
+
+    NodePool() : freeLists(MAX_BLOCK / ALIGNMENT, nullptr){}
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    ~NodePool(){
+        for (char* chunk : this->chunks)
+            ::operator delete(chunk);
+    }
+
+    void* allocate(size_t size){
+        ++this->stats.allocations;
+        if (size > MAX_BLOCK){
+            this->stats.bytes += size;
+            return ::operator new(size);
+        }
+
+        const size_t sizeClass = (size + ALIGNMENT - 1) / ALIGNMENT - 1;
+        const size_t blockSize = (sizeClass + 1) * ALIGNMENT;
+
+        std::lock_guard<hpx::lcos::local::spinlock> lock(this->lock);
+        FreeBlock* block = this->freeLists[sizeClass];
+        if (block != nullptr){
+            this->freeLists[sizeClass] = block->next;
+            return block;
+        }
+        if (this->filled == 0 || this->chunkUsed + blockSize > CHUNK_SIZE){
+            if (this->filled == this->chunks.size()){
+                this->chunks.push_back(static_cast<char*>(::operator new(CHUNK_SIZE)));
+                this->stats.bytes += CHUNK_SIZE;
+            }
+            ++this->filled;
+            this->chunkUsed = 0;
+        }
+        void* result = this->chunks[this->filled - 1] + this->chunkUsed;
+        this->chunkUsed += blockSize;
+        return result;
+    }
+
+    void deallocate(void* p, size_t size){
+        if (size > MAX_BLOCK){
+            ::operator delete(p);
+            return;
+        }
+
+        const size_t sizeClass = (size + ALIGNMENT - 1) / ALIGNMENT - 1;
+        std::lock_guard<hpx::lcos::local::spinlock> lock(this->lock);
+        this->freeLists[sizeClass] = new (p) FreeBlock{this->freeLists[sizeClass]};
+    }
+
+    // all blocks must have been given back; the chunks are carved again from the start
+    void reset(){
+        std::lock_guard<hpx::lcos::local::spinlock> lock(this->lock);
+        std::fill(this->freeLists.begin(), this->freeLists.end(), nullptr);
+        this->filled = 0;
+        this->chunkUsed = 0;
+        this->stats.allocations = 0;
+    }
+
+    const ArenaStats& getStats() const {
+        return this->stats;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    hpx::lcos::local::spinlock lock;
+    std::vector<FreeBlock*> freeLists;
+    std::vector<char*> chunks;
+    // chunks in use, and bytes handed out from the last of them
+    size_t filled = 0;
+    size_t chunkUsed = 0;
+    ArenaStats stats;
+};
+
+/**
+ * @brief Standard allocator on a NodePool, for node based containers such as the std::set of Boundary.
+ * Two allocators on the same pool compare equal, so nodes can move between containers (swap, splice).
+ */
+template <typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator(NodePool* pool) : pool(pool){}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) : pool(other.pool){}
+
+    T* allocate(size_t n){
+        return static_cast<T*>(this->pool->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n){
+        this->pool->deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>& other) const {
+        return this->pool == other.pool;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>& other) const {
+        return this->pool != other.pool;
+    }
+
+    NodePool* pool;
+};
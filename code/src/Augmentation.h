@@ -1,295 +1,204 @@
 #pragma once
 
 #include "DataManager.h"
-#include "RawManager.h"
 
 #include <cstdint>
+#include <memory>
 #include <sys/types.h>
 #include <vector>
 #include <algorithm>
 
-struct SkipNode {
-    uint64_t key;
-    std::vector<SkipNode*> forward;
-
-    SkipNode(uint64_t k, int level): key(k){
-        forward.resize(level, nullptr);
-    }
-};
-
-class SkipListSet {
+/**
+ * @brief Merges k sorted runs with a loser tree: every output element costs log(k) comparisons
+ * instead of the k comparisons of a linear minimum scan.
+ */
+template <typename Less>
+class LoserTree {
 public:
-    //SkipListSet(): head(nullptr), back(nullptr){}
-
-    SkipListSet(float prob, int maxLevel, DataManager* data)
-        : data(data){
-        this->probability = prob;
-        this->maxLevel = maxLevel;
-        head = new SkipNode(0, maxLevel); // key 任意取值都可以
-        back = new SkipNode(INVALID_VERTEX, maxLevel);
-        for (int i = 0; (i < head->forward.size()); i++) {
-            head->forward[i] = back;
-            back->forward[i] = head;
-        }
-    }
-    
-    void clear(){
-        for (int i = 0; (i < head->forward.size()); i++) {
-            head->forward[i] = back;
-            back->forward[i] = head;
+    typedef std::pair<const uint64_t*, const uint64_t*> Run;
+
+    LoserTree(const std::vector<Run>& runs, Less less)
+        : runs(runs), less(less), k(static_cast<uint32_t>(runs.size())), losers(runs.size()){
+        // leaves are the nodes k..2k-1, node n plays the winners of 2n and 2n+1
+        std::vector<uint32_t> winners(2 * k);
+        for (uint32_t i = 0; i < k; ++i)
+            winners[k + i] = i;
+        for (uint32_t n = k - 1; n >= 1; --n){
+            const uint32_t a = winners[2 * n];
+            const uint32_t b = winners[2 * n + 1];
+            winners[n] = beats(a, b) ? a : b;
+            losers[n] = beats(a, b) ? b : a;
+        }
+        this->winner = (k > 1) ? winners[1] : 0;
+    }
+
+    void mergeInto(std::vector<uint64_t>& out){
+        while (this->runs[this->winner].first != this->runs[this->winner].second){
+            out.push_back(*this->runs[this->winner].first++);
+
+            // replay the matches on the path of the winner's leaf
+            uint32_t current = this->winner;
+            for (uint32_t n = (current + k) / 2; n >= 1; n /= 2){
+                if (beats(this->losers[n], current))
+                    std::swap(this->losers[n], current);
+            }
+            this->winner = current;
         }
     }
 
-    void reclaim(){
-        delete head;
-        delete back;
-    }
-
-    class Iterator {
-        friend class SkipListSet;
-
-    private:
-        Iterator(SkipNode* node): node(node){}
-
-    public:
-        Iterator(): node(nullptr){}
-
-        Iterator& operator++()
-        {
-            node = node->forward[0];
-            return *this;
-        }
-
-        SkipNode* operator*(){
-            return node;
-        }
+private:
+    // an exhausted run loses against everything
+    bool beats(uint32_t a, uint32_t b) const {
+        if (this->runs[a].first == this->runs[a].second)
+            return false;
+        if (this->runs[b].first == this->runs[b].second)
+            return true;
+        return this->less(*this->runs[a].first, *this->runs[b].first);
+    }
+
+    std::vector<Run> runs;
+    Less less;
+    uint32_t k;
+    std::vector<uint32_t> losers;
+    uint32_t winner;
+};
 
-        bool operator!=(const Iterator& other)
-        {
-            return !(this->operator==(other));
-        }
+/*
+ * The augmentation of an arc: the vertices it swept plus those inherited from its children, in ascending order.
+ * It is a list of sorted runs, each a slice of an immutable buffer. Swept vertices are appended unsorted and
+ * become one run when the arc hands its part above the saddle to the parent. Handing over and inheriting only
+ * move slices, the runs are merged with a loser tree once there are more than MAX_RUNS of them.
+ * A disabled augmentation (flat mode) keeps no vertices, the segmentation is rebuilt from swept instead, see
+ * SweepEngine::segmentation().
+ */
+template <typename Grid>
+class Augmentation {
+public:
+    static const uint32_t MAX_RUNS = 16;
 
-        bool operator==(const Iterator& other)
-        {
-            return node == other.node;
-        }
+    struct Run {
+        std::shared_ptr<const std::vector<uint64_t>> buffer;
+        uint64_t begin;
+        uint64_t end;
 
-    protected:
-        SkipNode* node;
+        const uint64_t* first() const { return this->buffer->data() + this->begin; }
+        const uint64_t* last() const { return this->buffer->data() + this->end; }
     };
 
-    Iterator begin() { return Iterator(head->forward[0]); }
-    Iterator end() { return Iterator(back); }
-
-    /* 返回 SkipListSet 加上没有析构函数，会不会出现问题 */
-    SkipListSet split(uint64_t splitKey){
-        SkipNode* x = head;
-        SkipListSet result = SkipListSet(0.5f, 24, this->data);
-
-        for (int i = maxLevel - 1; i >= 0; i--) {
-            while ( this->data->less(x->forward[i]->key, splitKey) ) {
-                x = x->forward[i];
-            }
-            if (x->forward[i] != back) {
-                result.injectRange(x->forward[i], back->forward[i], i);
-                x->forward[i] = back;
-                back->forward[i] = x;
-            }
-        }
+    Augmentation(Grid* data, bool enabled = true) : data(data), enabled(enabled)
+    {}
 
-        return result;
+    void sweep(uint64_t v){
+        if (this->enabled)
+            pending.push_back(v);
     }
 
-    void injectLast(SkipNode* node, int level){
-        for (int i = level; i >= 0; i--) {
-            back->forward[i]->forward[i] = node;
-            node->forward[i] = back;
-            back->forward[i] = node;
-        }
+    // number of vertices held
+    uint64_t size() const {
+        uint64_t size = pending.size();
+        for (const Run& run : runs)
+            size += run.end - run.begin;
+        return size;
     }
 
-    void injectRange(SkipNode* front, SkipNode* last, int level){
-        head->forward[level] = front;
-        last->forward[level] = back;
-        back->forward[level] = last;
+    void clear(){
+        runs.clear();
+        pending.clear();
     }
 
-    void insert(uint64_t searchKey){
-        SkipNode* x = nullptr;
-        x = find(searchKey);
-        if (x) {
+    /*
+     * param heritage: 执行结束后 vector 中的元素会被清空
+     */
+    void inherit(std::vector<Augmentation>& heritage){
+        if (!this->enabled){
+            heritage.clear();
             return;
         }
-
-        // vector of pointers that needs to be updated to account for the new node
-        std::vector<SkipNode*> update(head->forward);
-        int currentMaximum = nodeLevel(head->forward);
-        x = head;
-
-        // search the list
-        for (int i = currentMaximum - 1; i >= 0; i--) {
-            while( this->data->less(x->forward[i]->key, searchKey) ){
-                x = x->forward[i];
-            }
-            update[i] = x;
-        }
-        x = x->forward[0];
-
-        // create new node
-        int newNodeLevel = 1;
-        if (x->key != searchKey) {
-
-            newNodeLevel = randomLevel();
-            int currentLevel = nodeLevel(update);
-
-            if (newNodeLevel > currentLevel) {
-                for (int i = newNodeLevel-1; i >= currentLevel-1; i--) {
-                    update[i] = head;
-                }
-            }
-
-            x = makeNode(searchKey, newNodeLevel);
+        for (Augmentation& current : heritage) {
+            for (Run& run : current.runs)
+                runs.push_back(std::move(run));
         }
+        heritage.clear();
 
-        // connect pointers of predecessors and new node to successors
-        for (int i = 0; i < newNodeLevel; i++) {
-
-            x->forward[i] = update[i]->forward[i];
-            update[i]->forward[i] = x;
-            if (x->forward[i] == back)
-                back->forward[i] = x;
-        }
+        if (runs.size() > MAX_RUNS)
+            this->compact();
     }
 
-    DataManager* getDataManager(){
-        return this->data;
+    // inherit from child to parent: the vertices above the saddle are moved into the result
+    Augmentation heritage(uint64_t saddle){
+        return this->heritage([this, saddle](uint64_t v){ return this->data->lessLocal(v, saddle); });
     }
 
-private:
-    int randomLevel(){
-        int v = 1;
+    // same for a saddle that is not a vertex of this block: below(v) tells if v stays with the child
+    template <typename Below>
+    Augmentation heritage(Below below){
+        Augmentation result(this->data, this->enabled);
+        if (!this->enabled)
+            return result;
 
-        while ((((double) std::rand() / RAND_MAX)) < probability && v < maxLevel) {
-            v += 1;
-        }
-        return v;
-    }
+        this->seal();
 
-    /*
-     * input: head->forward
-     * return: the level number of skip list 
-     */
-    int nodeLevel(const std::vector<SkipNode*>& v){
-        int currentLevel = 0;
-        // last element's key is the largest
-        uint64_t nilKey = INVALID_VERTEX;
-
-        for (size_t i = 0; i < v.size(); i++) {
-            currentLevel++;
-            if (v[i]->key == nilKey) {
-                break;
-            }
+        for (Run& run : runs) {
+            const uint64_t split = std::partition_point(run.first(), run.last(), below) - run.buffer->data();
+            if (split < run.end)
+                result.runs.push_back(Run{run.buffer, split, run.end});
+            run.end = split;
         }
-        return currentLevel;
+        runs.erase(std::remove_if(runs.begin(), runs.end(), [](const Run& run){ return run.begin == run.end; }), runs.end());
+        return result;
     }
 
-    SkipNode* makeNode(uint64_t key, int level){
-        return new SkipNode(key, level);
-    }
+    // turns the vertices swept since the last call into a sorted run
+    void seal(){
+        if (pending.empty())
+            return;
 
-    SkipNode* find(uint64_t searchKey){
-        SkipNode* x = head;
-        int currentMaximum = nodeLevel(head->forward);
+        std::sort(pending.begin(), pending.end(), [this](uint64_t a, uint64_t b){ return this->data->lessLocal(a, b); });
+        const uint64_t size = pending.size();
+        runs.push_back(Run{std::make_shared<const std::vector<uint64_t>>(std::move(pending)), 0, size});
+        pending = std::vector<uint64_t>();
 
-        for (int i = currentMaximum - 1; i >= 0; i--) {
-            while (x->forward[i]->key < searchKey) {
-                x = x->forward[i];
-            }
-        }
-        x = x->forward[0];
-
-        if (x->key == searchKey) {
-            return x;
-        } else {
-            return nullptr;
-        }
+        if (runs.size() > MAX_RUNS)
+            this->compact();
     }
 
-    SkipNode* head;
-    SkipNode* back; // 这个 node 比较特殊，是往回指的
-    
-    float probability;
-    int maxLevel;
-
-    DataManager* data;
-};
-
-/* 一些 while 循环的比较，可以用 x->forward[i] == back 来判断是否到末尾了 */
-/* 用 INVALID_INDEX 来表示无穷大，less() 中需要保证 INVALID_INDEX 返回的值足够大 */
-
-/* skipListSet 的析构函数没有 delete head 和 back 两个节点 */
-
-/* 在 inherit 时，形参 heritage 里面所有的 skipListSet 的 head 和 back 节点会被回收；
- * 那么谁来负责回收当前的 Augmentation 呢？
- */
-
-class Augmentation {
-public:
-
-    Augmentation(DataManager* data) : vertices(0.5f, 24, data)
-    {}
+    // merges all runs into one
+    void compact(){
+        if (runs.size() <= 1)
+            return;
 
-    void sweep(uint64_t v){
-        vertices.insert(v);
-    }
+        auto less = [this](uint64_t a, uint64_t b){ return this->data->lessLocal(a, b); };
 
-    void clear(){
-        vertices.clear();
-    }
-
-    /*
-     * param heritage: 执行结束后 vector 中的元素会被清空
-     */
-    void inherit(std::vector<Augmentation>& heritage){
-        if (heritage.size() == 0)
-            return;
-        if (heritage.size() == 1) {
-            vertices = heritage.at(0).vertices;
-            return;
+        uint64_t size = 0;
+        std::vector<typename LoserTree<decltype(less)>::Run> ranges;
+        for (const Run& run : runs) {
+            size += run.end - run.begin;
+            ranges.emplace_back(run.first(), run.last());
         }
-        DataManager* data = heritage[0].vertices.getDataManager();
 
-        std::vector<SkipListSet::Iterator> iters;
-        for (Augmentation& current : heritage) {
-            iters.push_back(current.vertices.begin());
-        }
-        vertices = SkipListSet(0.5f, 24, data); // 新的 SkipListSet 
-        while (true) {
-            int smallest = 0;
-            for (int i = 1; i < iters.size(); i++) {
-                if ( data->less( (*iters[i])->key,  (*iters[smallest])->key)){ // TODO
-                    smallest = i;
-                }
-            }
-            if ((*iters[smallest])->key == INVALID_VERTEX )
-                break;
-            
-            SkipNode* next = *iters[smallest];
-            ++iters[smallest];
-            vertices.injectLast(next, next->forward.size() - 1);
-        }
-        for (Augmentation& current : heritage) {
-            current.vertices.reclaim();
-        }
-        heritage.clear(); // 会调用 heritage 每个 Augmentation 的析构函数
+        auto merged = std::make_shared<std::vector<uint64_t>>();
+        merged->reserve(size);
+        if (ranges.size() == 2)
+            std::merge(ranges[0].first, ranges[0].second, ranges[1].first, ranges[1].second, std::back_inserter(*merged), less);
+        else
+            LoserTree<decltype(less)>(ranges, less).mergeInto(*merged);
+
+        runs.clear();
+        runs.push_back(Run{merged, 0, size});
     }
 
-    // inherit from child to parent
-    Augmentation heritage(uint64_t saddle){
-        Augmentation result(this->vertices.getDataManager());
-        result.vertices = vertices.split(saddle);
-        return result;
+    // all vertices in ascending order
+    std::vector<uint64_t> getVertices(){
+        this->seal();
+        this->compact();
+        if (runs.empty())
+            return std::vector<uint64_t>();
+        return std::vector<uint64_t>(runs[0].first(), runs[0].last());
     }
 
-    SkipListSet vertices;
-};
\ No newline at end of file
+private:
+    Grid* data;
+    bool enabled;
+    std::vector<Run> runs;
+    std::vector<uint64_t> pending;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <hpx/serialization/access.hpp>
+#include <hpx/serialization/vector.hpp>
+
+/*
+ * Non-uniform decomposition of the grid into blocks by a k-d tree of split planes, planned from a sample of the
+ * volume so that every block gets about the same estimated sweep cost. Without a plan (empty layout) the grid
+ * manager splits the grid uniformly, see RegularGridManager::init().
+ *
+ * The plan works on a grid of sample cells: cell (i, j, k) covers the voxels [i, j, k] * stride up to the next
+ * sample (clipped to the grid) and is represented by its first voxel. Split planes lie on sample cell borders.
+ */
+
+// children of a KdNode with this bit set are the block index in the remaining bits
+const uint32_t KD_LEAF = 0x80000000u;
+
+class KdNode{
+public:
+    uint32_t axis;
+    // first voxel coordinate along axis of the upper child
+    uint32_t plane;
+    uint32_t children[2];
+
+private:
+    friend class hpx::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive& ar, const unsigned int version){
+        ar & axis & plane & children[0] & children[1];
+    }
+};
+
+class BlockLayout{
+public:
+    bool empty() const {
+        return this->offsets.empty();
+    }
+
+    uint32_t numBlocks() const {
+        return static_cast<uint32_t>(this->offsets.size() / 3);
+    }
+
+    // block without ghost layer
+    glm::uvec3 offset(uint32_t block) const {
+        return glm::uvec3(this->offsets[3 * block], this->offsets[3 * block + 1], this->offsets[3 * block + 2]);
+    }
+
+    glm::uvec3 size(uint32_t block) const {
+        return glm::uvec3(this->sizes[3 * block], this->sizes[3 * block + 1], this->sizes[3 * block + 2]);
+    }
+
+    // block of the voxel (x, y, z)
+    uint32_t owner(uint32_t x, uint32_t y, uint32_t z) const {
+        if (this->nodes.empty())
+            return 0;
+        const uint32_t p[3] = {x, y, z};
+        uint32_t n = 0;
+        for (;;){
+            const KdNode& node = this->nodes[n];
+            n = node.children[p[node.axis] >= node.plane];
+            if (n & KD_LEAF)
+                return n & ~KD_LEAF;
+        }
+    }
+
+    // estimated cost of every block, in voxels
+    std::vector<double> costs;
+
+    // x, y, z of every block
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> sizes;
+    // nodes[0] is the root, no nodes for a single block
+    std::vector<KdNode> nodes;
+
+private:
+    friend class hpx::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive& ar, const unsigned int version){
+        ar & costs;
+        ar & offsets;
+        ar & sizes;
+        ar & nodes;
+    }
+};
+
+inline uint32_t numSamples(uint32_t gridSize, uint32_t stride){
+    return (gridSize + stride - 1) / stride;
+}
+
+/**
+ * @brief Splits the grid into numBlocks blocks of about equal cost. The box of a node is split across its longest
+ * axis, for k blocks at the plane where the lower side holds k / 2 blocks worth of cost; the blocks are numbered
+ * in depth-first order, so consecutive blocks are neighbors.
+ * @param costs of the sample cells, x fastest
+ */
+inline BlockLayout planBlockLayout(const glm::uvec3& gridSize, uint32_t stride, const std::vector<float>& costs, uint32_t numBlocks){
+    const glm::uvec3 samples(numSamples(gridSize.x, stride), numSamples(gridSize.y, stride), numSamples(gridSize.z, stride));
+    BlockLayout layout;
+
+    auto voxel = [&](uint32_t d, uint32_t s){
+        return std::min(s * stride, gridSize[d]);
+    };
+
+    // lo, hi: box in sample cells; returns the node or leaf of the box
+    auto split = [&](auto& self, glm::uvec3 lo, glm::uvec3 hi, uint32_t k) -> uint32_t {
+        if (k == 1){
+            const uint32_t block = layout.numBlocks();
+            double cost = 0;
+            for (uint32_t z = lo.z; z < hi.z; ++z)
+                for (uint32_t y = lo.y; y < hi.y; ++y)
+                    for (uint32_t x = lo.x; x < hi.x; ++x)
+                        cost += costs[(static_cast<uint64_t>(z) * samples.y + y) * samples.x + x];
+            for (uint32_t d = 0; d < 3; ++d){
+                layout.offsets.push_back(voxel(d, lo[d]));
+                layout.sizes.push_back(voxel(d, hi[d]) - voxel(d, lo[d]));
+            }
+            layout.costs.push_back(cost);
+            return block | KD_LEAF;
+        }
+
+        // the longest axis that still has two sample cells
+        uint32_t axis = 3;
+        for (uint32_t d = 0; d < 3; ++d)
+            if (hi[d] - lo[d] > 1 && (axis == 3 || voxel(d, hi[d]) - voxel(d, lo[d]) > voxel(axis, hi[axis]) - voxel(axis, lo[axis])))
+                axis = d;
+        if (axis == 3)
+            throw std::runtime_error("Too many blocks for the sampling stride");
+
+        // cost of the slabs of the box across axis
+        std::vector<double> slabs(hi[axis] - lo[axis], 0.0);
+        for (uint32_t z = lo.z; z < hi.z; ++z)
+            for (uint32_t y = lo.y; y < hi.y; ++y)
+                for (uint32_t x = lo.x; x < hi.x; ++x){
+                    const glm::uvec3 c(x, y, z);
+                    slabs[c[axis] - lo[axis]] += costs[(static_cast<uint64_t>(z) * samples.y + y) * samples.x + x];
+                }
+
+        double total = 0;
+        for (double s : slabs)
+            total += s;
+
+        // every side must keep a sample cell per block
+        const uint32_t k0 = k / 2;
+        const uint64_t cellsPerSlab = static_cast<uint64_t>(hi.x - lo.x) * (hi.y - lo.y) * (hi.z - lo.z) / slabs.size();
+        const double target = total * k0 / k;
+        uint32_t plane = 0;
+        double best = 0;
+        double below = 0;
+        for (uint32_t p = 1; p < slabs.size(); ++p){
+            below += slabs[p - 1];
+            if (p * cellsPerSlab < k0 || (slabs.size() - p) * cellsPerSlab < k - k0)
+                continue;
+            if (plane == 0 || std::abs(below - target) < best){
+                plane = p;
+                best = std::abs(below - target);
+            }
+        }
+        if (plane == 0)
+            throw std::runtime_error("Too many blocks for the sampling stride");
+
+        const uint32_t n = static_cast<uint32_t>(layout.nodes.size());
+        layout.nodes.push_back(KdNode{axis, voxel(axis, lo[axis] + plane), {0, 0}});
+
+        glm::uvec3 mid = hi;
+        mid[axis] = lo[axis] + plane;
+        const uint32_t lower = self(self, lo, mid, k0);
+        mid = lo;
+        mid[axis] = lo[axis] + plane;
+        const uint32_t upper = self(self, mid, hi, k - k0);
+        layout.nodes[n].children[0] = lower;
+        layout.nodes[n].children[1] = upper;
+        return n;
+    };
+
+    split(split, glm::uvec3(0, 0, 0), samples, numBlocks);
+    return layout;
+}
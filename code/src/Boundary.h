@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Arena.h"
 #include "DataManager.h"
 
 #include <hpx/hpx.hpp>
@@ -7,30 +8,34 @@
 #include <set>
 #include <vector>
 
+// Grid is the concrete grid type, so the comparison is inlined into the set operations
+template <typename Grid>
 class DataComparator {
 public:
-    DataComparator(DataManager* d)
+    DataComparator(Grid* d)
         : data(d)
     {
     }
 
     bool operator()(uint64_t n1, uint64_t n2) const
     {
-        return this->data->less(n1, n2);
+        return this->data->lessLocal(n1, n2);
         // return this->data->getValue(n1) > this->data->getValue(n2);
     }
 
 private:
-    DataManager* data;
+    Grid* data;
 };
 
+template <typename Grid>
 class Boundary {
 public:
-    Boundary(DataManager* data):vertices(DataComparator(data)){
+    // the set nodes come from the node pool of the locality
+    Boundary(Grid* data, NodePool* pool):vertices(DataComparator<Grid>(data), PoolAllocator<uint64_t>(pool)){
 
     }
 
-    typedef std::set<uint64_t, DataComparator> set_type;
+    typedef std::set<uint64_t, DataComparator<Grid>, PoolAllocator<uint64_t>> set_type;
 
     void add(uint64_t t)
     {
@@ -84,5 +89,5 @@ public:
         return vertices.empty();
     }
 private:
-    std::set<uint64_t, DataComparator> vertices;
+    set_type vertices;
 };
\ No newline at end of file
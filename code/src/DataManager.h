@@ -2,10 +2,19 @@
 
 
 #include <glm/glm.hpp>
+#include <hpx/algorithm.hpp>
 #include <hpx/hpx.hpp>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#include "BlockLayout.h"
+#include "ResultCache.h"
 #include "Value.h"
+#include "VertexStore.h"
 #include "Log.h"
 
 const uint64_t INVALID_VERTEX = std::numeric_limits<uint64_t>::max();
@@ -14,6 +23,11 @@ const uint64_t BLOCK_INDEX_SHIFT = 54;
 const uint64_t BLOCK_INDEX_MASK = 0xFFC0000000000000ull;
 const uint64_t VERTEX_INDEX_MASK = ~BLOCK_INDEX_MASK;
 const uint64_t INVALID_BLOCK = 0xFFC0000000000000ull;
+// the last block index is INVALID_BLOCK
+const uint32_t MAX_BLOCKS = (1u << (64 - BLOCK_INDEX_SHIFT)) - 1;
+// bricked layout: bricks of 8^3 vertices, see RegularGridManager::localIndex()
+const uint32_t BRICK_SHIFT = 3;
+const uint32_t BRICK_MASK = (1u << BRICK_SHIFT) - 1;
 
 class DataManager {
 public:
@@ -21,7 +35,13 @@ public:
     virtual ~DataManager() = default;
 
     virtual uint64_t getNumVertices() const = 0;
+    virtual const glm::uvec3& getGridSize() const = 0;
+    // offset and size of the block of this locality, without ghost layer
+    virtual const glm::uvec3& getBlockOffset() const = 0;
+    virtual const glm::uvec3& getBlockSize() const = 0;
     virtual uint64_t getNumVerticesLocal(bool withGhost = false) const = 0;
+    // size of the per-vertex arrays of the block: getNumVerticesLocal(true), plus the padding of the bricks
+    virtual uint64_t getLocalIndexSize() const = 0;
 
     // return the index of all minima in local data
     virtual std::vector<uint64_t> getLocalMinima() const = 0;
@@ -36,10 +56,42 @@ public:
     virtual bool isGhost(uint64_t v) const = 0;
     virtual bool isLocal(uint64_t v) const = 0;
 
+    // index of the block that owns the vertex with linear grid index g
+    virtual uint32_t getOwnerBlock(uint64_t g) const = 0;
+
     virtual uint64_t getNeighbor(uint64_t v, int i) const = 0;
     virtual uint32_t getNeighbors(uint64_t v, uint64_t* neighborsOut) const = 0;
 
-    virtual void init(uint32_t blockIndex, uint32_t numBlocks) = 0;
+    // layout: the blocks planned by planBlockLayout(), empty for a uniform split; without readGhost only the
+    // interior of the block is read and the ghost layer is filled by the halo exchange below; bricked: vertex ids
+    // of all blocks run over bricks instead of rows
+    // scratch not empty: the per-vertex arrays are kept out of core in a file there, with about memoryBudget bytes
+    // in memory, see VertexStore.h
+    virtual void init(uint32_t blockIndex, uint32_t numBlocks, const BlockLayout& layout, bool readGhost, bool bricked,
+                      const std::string& scratch, uint64_t memoryBudget) = 0;
+    // size of the input, known before init()
+    virtual glm::uvec3 getSize() = 0;
+    // estimated sweep cost of the sample cells of the sample planes [zBegin, zEnd), see BlockLayout.h; before init()
+    virtual std::vector<float> sampleCosts(uint32_t stride, float weight, uint32_t zBegin, uint32_t zEnd) = 0;
+    // hash of the value type and the values of the planes [zBegin, zEnd) of the input, see ResultCache.h; before init()
+    virtual uint64_t hashPlanes(uint32_t zBegin, uint32_t zEnd) = 0;
+    // optional: precompute the rank of every vertex of the block in the order of less()
+    virtual void computeRanks() = 0;
+    // timesteps: reads the values of the input path, of the size and type of the first, into the block of init();
+    // readGhost as for init()
+    virtual void loadTimestep(const std::string& path, bool readGhost) = 0;
+    // timesteps: one hash per row (y, z) of the values of the block with ghost layer, z major; an unchanged block
+    // keeps its minima and ranks, a changed one its minima away from the changed rows
+    virtual std::vector<uint64_t> hashRows() const = 0;
+    // timesteps: the local minima after the rows flagged in changedRows (as in hashRows()) have changed, from those before
+    virtual std::vector<uint64_t> updateLocalMinima(const std::vector<uint64_t>& minima, const std::vector<uint8_t>& changedRows) const = 0;
+
+    // halo exchange: the values of this block in the ghost layer of every other block, packed x fastest
+    virtual std::vector<std::pair<uint32_t, std::vector<uint8_t>>> collectHalo() const = 0;
+    // fills the part of the ghost layer that lies in block from with its values from collectHalo()
+    virtual void insertHalo(uint32_t from, const std::vector<uint8_t>& values) = 0;
+    // number of blocks that send a part of the ghost layer
+    virtual uint32_t countHaloSources() const = 0;
 
 private:
     // uncopyable object
@@ -51,12 +103,12 @@ private:
 template<typename T>
 class RegularGridManager : public DataManager {
 public:
+    // readBox(): bytes read per call, and the row length from which rows are read as they are
+    static const uint64_t READ_BYTES = 64ull << 20;
+    static const uint64_t ROW_READ_BYTES = 1ull << 20;
 
-    virtual ~ RegularGridManager(){
-        if (this->blockData){
-            delete[] this->blockData;
-        }
-    }
+    // the block data, mask and ranks are freed with the store
+    virtual ~ RegularGridManager() = default;
 
         /**
      * @brief Returns the value of the vertex with given id.
@@ -72,44 +124,326 @@ public:
         assert((v & BLOCK_INDEX_MASK) == this->blockIndex);
 
         const uint64_t i = v & VERTEX_INDEX_MASK;
-        return Value<T>(this->blockData[i], v);
+        return Value<T>(this->blockData[i], this->orderKey(v));
     }
 
-    bool less(uint64_t v1, uint64_t v2) const{
-        return getValue(v1) < getValue(v2);
+    bool less(uint64_t v1, uint64_t v2) const final{
+        // INVALID_VERTEX is larger than every vertex
+        if (v2 == INVALID_VERTEX)
+            return v1 != INVALID_VERTEX;
+        if (v1 == INVALID_VERTEX)
+            return false;
+        // same order as getValue(v1) < getValue(v2), the order key is only needed for equal values
+        return this->lessLocal(v1, v2);
     }
 
-protected:
-    RegularGridManager():blockData(nullptr){}
+    /**
+     * @brief Same order as less() for two valid vertices of this block, without the INVALID_VERTEX check.
+     */
+    bool lessLocal(uint64_t v1, uint64_t v2) const{
+        if (this->blockRank)
+            return this->blockRank[v1 & VERTEX_INDEX_MASK] < this->blockRank[v2 & VERTEX_INDEX_MASK];
+        const T value1 = this->blockData[v1 & VERTEX_INDEX_MASK];
+        const T value2 = this->blockData[v2 & VERTEX_INDEX_MASK];
+        return (value1 < value2) || (value1 == value2 && this->orderKey(v1) < this->orderKey(v2));
+    }
+
+    // equal values are ordered by the row-major index of the vertices, in both layouts; in the row-major layout
+    // that is the id itself
+    uint64_t orderKey(uint64_t v) const {
+        if (!this->bricked)
+            return v;
+        const uint64_t i = v & VERTEX_INDEX_MASK;
+        const glm::uvec3& size = this->blockSizeWithGhost;
+        const uint64_t inBrick = ((i >> (2 * BRICK_SHIFT)) & BRICK_MASK) * size.y * size.x + ((i >> BRICK_SHIFT) & BRICK_MASK) * size.x + (i & BRICK_MASK);
+        return (this->brickOrigins[i >> (3 * BRICK_SHIFT)] + inBrick) | (v & BLOCK_INDEX_MASK);
+    }
+
+    /**
+     * @brief Index of the vertex (x, y, z) of a block with ghost layer of the given size. Row-major, or bricked:
+     * bricks of 8^3 vertices in row-major order, the vertices of a brick in row-major order, so that the 6
+     * neighbors of most vertices are in the same few cache lines. Bricks at the upper faces are padded.
+     */
+    uint64_t localIndex(uint32_t x, uint32_t y, uint32_t z, const glm::uvec3& size) const {
+        if (!this->bricked)
+            return (static_cast<uint64_t>(z) * size.y + y) * size.x + x;
+        const uint64_t bricksX = (size.x + BRICK_MASK) >> BRICK_SHIFT;
+        const uint64_t bricksY = (size.y + BRICK_MASK) >> BRICK_SHIFT;
+        const uint64_t brick = ((z >> BRICK_SHIFT) * bricksY + (y >> BRICK_SHIFT)) * bricksX + (x >> BRICK_SHIFT);
+        return (brick << (3 * BRICK_SHIFT)) | ((z & BRICK_MASK) << (2 * BRICK_SHIFT)) | ((y & BRICK_MASK) << BRICK_SHIFT) | (x & BRICK_MASK);
+    }
+
+    // inverse of localIndex()
+    glm::uvec3 localCoords(uint64_t i, const glm::uvec3& size) const {
+        if (!this->bricked)
+            return glm::uvec3(i % size.x, (i / size.x) % size.y, i / (static_cast<uint64_t>(size.x) * size.y));
+        const uint64_t bricksX = (size.x + BRICK_MASK) >> BRICK_SHIFT;
+        const uint64_t bricksY = (size.y + BRICK_MASK) >> BRICK_SHIFT;
+        const uint64_t brick = i >> (3 * BRICK_SHIFT);
+        return glm::uvec3(static_cast<uint32_t>((brick % bricksX) << BRICK_SHIFT) | (i & BRICK_MASK),
+                          static_cast<uint32_t>(((brick / bricksX) % bricksY) << BRICK_SHIFT) | ((i >> BRICK_SHIFT) & BRICK_MASK),
+                          static_cast<uint32_t>((brick / (bricksX * bricksY)) << BRICK_SHIFT) | ((i >> (2 * BRICK_SHIFT)) & BRICK_MASK));
+    }
+
+    // block index in the msb of a vertex id
+    uint64_t getBlockIndex() const {
+        return this->blockIndex;
+    }
+
+    // memory of the per-vertex arrays, see VertexStore.h
+    VertexStore* getVertexStore() const {
+        return this->store.get();
+    }
+
+    /**
+     * @brief Linear index of a vertex of this block (ghost layer included) in the whole grid.
+     * Vertex ids are only meaningful on their own block, messages between localities carry this index instead.
+     */
+    uint64_t toGlobalIndex(uint64_t v) const {
+        const glm::uvec3 c = this->localCoords(v & VERTEX_INDEX_MASK, this->blockSizeWithGhost);
+        const uint64_t x = c.x + this->blockOffsetWithGhost.x;
+        const uint64_t y = c.y + this->blockOffsetWithGhost.y;
+        const uint64_t z = c.z + this->blockOffsetWithGhost.z;
+        return (z * this->gridSize.y + y) * this->gridSize.x + x;
+    }
+
+    // inverse of toGlobalIndex(), g must lie in this block or its ghost layer
+    uint64_t fromGlobalIndex(uint64_t g) const {
+        const uint64_t x = g % this->gridSize.x - this->blockOffsetWithGhost.x;
+        const uint64_t y = (g / this->gridSize.x) % this->gridSize.y - this->blockOffsetWithGhost.y;
+        const uint64_t z = g / (static_cast<uint64_t>(this->gridSize.x) * this->gridSize.y) - this->blockOffsetWithGhost.z;
+        return this->localIndex(x, y, z, this->blockSizeWithGhost) | this->blockIndex;
+    }
+
+    // index of the block whose non-ghost part contains the vertex with linear index g
+    uint32_t getOwnerBlock(uint64_t g) const final{
+        const uint32_t gx = g % this->gridSize.x;
+        const uint32_t gy = (g / this->gridSize.x) % this->gridSize.y;
+        const uint32_t gz = g / (static_cast<uint64_t>(this->gridSize.x) * this->gridSize.y);
+        if (!this->layout.empty())
+            return this->layout.owner(gx, gy, gz);
+
+        const uint32_t x = std::min<uint32_t>(gx / this->baseBlockSize.x, this->numBlocks.x - 1);
+        const uint32_t y = std::min<uint32_t>(gy / this->baseBlockSize.y, this->numBlocks.y - 1);
+        const uint32_t z = std::min<uint32_t>(gz / this->baseBlockSize.z, this->numBlocks.z - 1);
+        return (z * this->numBlocks.y + y) * this->numBlocks.x + x;
+    }
+
+    // id of the vertex with linear index g on the block that owns it
+    uint64_t toVertexId(uint64_t g) const {
+        const uint32_t block = this->getOwnerBlock(g);
+        glm::uvec3 offset;
+        glm::uvec3 size;
+        this->getBlockLayout(block, offset, size);
+
+        const uint64_t x = g % this->gridSize.x - offset.x;
+        const uint64_t y = (g / this->gridSize.x) % this->gridSize.y - offset.y;
+        const uint64_t z = g / (static_cast<uint64_t>(this->gridSize.x) * this->gridSize.y) - offset.z;
+        return this->localIndex(x, y, z, size) | (static_cast<uint64_t>(block) << BLOCK_INDEX_SHIFT);
+    }
+
+    // linear index of the vertex with id v of any block, the inverse of toVertexId()
+    uint64_t toGlobalIndexOf(uint64_t v) const {
+        if ((v & BLOCK_INDEX_MASK) == this->blockIndex)
+            return this->toGlobalIndex(v);
+
+        glm::uvec3 offset;
+        glm::uvec3 size;
+        this->getBlockLayout(static_cast<uint32_t>(v >> BLOCK_INDEX_SHIFT), offset, size);
+
+        const glm::uvec3 c = this->localCoords(v & VERTEX_INDEX_MASK, size);
+        const uint64_t x = c.x + offset.x;
+        const uint64_t y = c.y + offset.y;
+        const uint64_t z = c.z + offset.z;
+        return (z * this->gridSize.y + y) * this->gridSize.x + x;
+    }
+
+    const glm::uvec3& getGridSize() const final{
+        return this->gridSize;
+    }
+
+    const glm::uvec3& getBlockOffset() const final{
+        return this->blockOffset;
+    }
+
+    const glm::uvec3& getBlockSize() const final{
+        return this->blockSize;
+    }
+
+    // id of the vertex (x, y, z) of the block without ghost layer
+    uint64_t toLocalVertex(uint32_t x, uint32_t y, uint32_t z) const {
+        return this->localIndex(x + this->beginNonGhost.x, y + this->beginNonGhost.y, z + this->beginNonGhost.z, this->blockSizeWithGhost) | this->blockIndex;
+    }
+
+    // value of a vertex of this block, exact for all supported value types; with toGlobalIndex() it orders
+    // vertices of different blocks the same way lessLocal() orders vertices of one block
+    double getValueAsDouble(uint64_t v) const {
+        return static_cast<double>(this->blockData[v & VERTEX_INDEX_MASK]);
+    }
 
     uint64_t getNumVertices() const {
-        return this->gridSize.x * this->gridSize.y * this->gridSize.z;
+        return static_cast<uint64_t>(this->gridSize.x) * this->gridSize.y * this->gridSize.z;
     }
 
 
     uint64_t getNumVerticesLocal(bool withGhost) const {
         if (withGhost)
-            return this->blockSizeWithGhost.x * this->blockSizeWithGhost.y * this->blockSizeWithGhost.z;
+            return static_cast<uint64_t>(this->blockSizeWithGhost.x) * this->blockSizeWithGhost.y * this->blockSizeWithGhost.z;
+
+        return static_cast<uint64_t>(this->blockSize.x) * this->blockSize.y * this->blockSize.z;
+    }
+
+    uint64_t getLocalIndexSize() const final{
+        if (!this->bricked)
+            return this->getNumVerticesLocal(true);
+        const glm::uvec3& size = this->blockSizeWithGhost;
+        return this->localIndex(size.x - 1, size.y - 1, size.z - 1, size) + 1;
+    }
+
+    /**
+     * @brief Computes the rank of every vertex of the block (with ghost) in the order (value, vertex id), so that
+     * less() and lessLocal() compare one integer. Local index order equals global vertex id order inside a block,
+     * so the ranks are consistent with the order on the other blocks.
+     * 8 and 16 bit values are ranked by a counting sort, all other types by a parallel sort of the vertex indices.
+     */
+    void computeRanks(){
+        const uint64_t numVerticesWithGhost = this->getLocalIndexSize();
+        if (numVerticesWithGhost > std::numeric_limits<uint32_t>::max()){
+            LogWarning().tag(std::to_string(this->blockIndex >> BLOCK_INDEX_SHIFT)) << "Block too large for 32 bit ranks, comparing values";
+            return;
+        }
 
-        return this->blockSize.x * this->blockSize.y * this->blockSize.z;
+        if (this->rank == nullptr){
+            this->rank = this->store->template allocate<uint32_t>();
+            std::fill_n(this->rank, numVerticesWithGhost, 0u);
+        }
+        if constexpr (std::is_integral<T>::value && sizeof(T) <= 2)
+            this->countingSortRanks();
+        else
+            this->sortRanks();
+        this->blockRank = this->rank;
+        this->store->evictAll();
+
+        Log().tag(std::to_string(this->blockIndex >> BLOCK_INDEX_SHIFT)) << "Ranks: " << byteString(numVerticesWithGhost * sizeof(uint32_t));
     }
 
     
+    /**
+     * @brief Collects the local minima of the non-ghost part of the block, in ascending vertex order.
+     * Each z slab is scanned by its own task and rows are tested with findRowMinima.
+     */
     virtual std::vector<uint64_t> getLocalMinima() const {
-        std::vector<uint64_t> localMinima;
-        // with ghost
-        uint64_t numLocalVertices = this->getNumVerticesLocal(true);
-        for(uint64_t v = 0;v < numLocalVertices; v++){
-            uint64_t vv = v | this->blockIndex;
-            if(isMinimum(vv) && !isGhost(vv)){
-                localMinima.push_back(vv);
-            }
+        return this->scanMinima([](uint32_t, uint32_t){ return true; });
+    }
+
+    /**
+     * @brief Whether a vertex is a minimum depends on its row and the four rows next to it. Only the non-ghost rows
+     * with a changed one among them are scanned again, the minima of the other rows are kept.
+     */
+    std::vector<uint64_t> updateLocalMinima(const std::vector<uint64_t>& minima, const std::vector<uint8_t>& changedRows) const final{
+        const glm::uvec3& size = this->blockSizeWithGhost;
+        auto changed = [&](uint32_t y, uint32_t z){
+            return changedRows[static_cast<uint64_t>(z) * size.y + y] != 0;
+        };
+        auto affected = [&](uint32_t y, uint32_t z){
+            return changed(y, z) || (y > 0 && changed(y - 1, z)) || (y + 1 < size.y && changed(y + 1, z))
+                || (z > 0 && changed(y, z - 1)) || (z + 1 < size.z && changed(y, z + 1));
+        };
+
+        std::vector<uint64_t> result = this->scanMinima(affected);
+        for (uint64_t m : minima){
+            const glm::uvec3 c = this->localCoords(m & VERTEX_INDEX_MASK, size);
+            if (!affected(c.y, c.z))
+                result.push_back(m);
         }
+        hpx::sort(hpx::execution::par, result.begin(), result.end());
+        return result;
+    }
+
+    /**
+     * @brief Minima of the non-ghost rows (y, z) with scan(y, z), by slab as getLocalMinima().
+     */
+    template <typename F>
+    std::vector<uint64_t> scanMinima(F scan) const {
+        const uint32_t numSlabs = this->endNonGhost.z - this->beginNonGhost.z;
+        std::vector<std::vector<uint64_t>> slabMinima(numSlabs);
+
+        hpx::for_loop(hpx::execution::par, 0u, numSlabs, [&](uint32_t s){
+            const uint32_t z = this->beginNonGhost.z + s;
+            std::vector<uint8_t> flags(this->blockSizeWithGhost.x);
+
+            // the rows are not contiguous in the bricked layout
+            if (this->bricked){
+                for (uint32_t y = this->beginNonGhost.y; y < this->endNonGhost.y; ++y){
+                    if (!scan(y, z))
+                        continue;
+                    for (uint32_t x = this->beginNonGhost.x; x < this->endNonGhost.x; ++x){
+                        const uint64_t v = this->localIndex(x, y, z, this->blockSizeWithGhost) | this->blockIndex;
+                        if (this->isMinimum(v))
+                            slabMinima[s].push_back(v);
+                    }
+                }
+                return;
+            }
+
+            for (uint32_t y = this->beginNonGhost.y; y < this->endNonGhost.y; ++y){
+                if (!scan(y, z))
+                    continue;
+                const uint64_t row = (static_cast<uint64_t>(z) * this->blockSizeWithGhost.y + y) * this->blockSizeWithGhost.x;
+                this->findRowMinima(y, z, flags.data());
+
+                for (uint32_t x = this->beginNonGhost.x; x < this->endNonGhost.x; ++x){
+                    if (flags[x])
+                        slabMinima[s].push_back((row + x) | this->blockIndex);
+                }
+            }
+        });
+
+        std::vector<uint64_t> localMinima;
+        for (const std::vector<uint64_t>& minima : slabMinima)
+            localMinima.insert(localMinima.end(), minima.begin(), minima.end());
         return localMinima;
     }
-    
 
-    bool isGhost(uint64_t v) const{
+    /**
+     * @brief Marks the minima among the non-ghost vertices of row (y, z) in flagsOut (indexed by x).
+     * Same order as Value<T>::operator<: a neighbor with a smaller index (-x, -y, -z) is below on equal values,
+     * one with a larger index is not. Missing y/z neighbor rows are replaced by the row itself and masked out,
+     * so the loop over the row interior has no branches and can be vectorized.
+     */
+    void findRowMinima(uint32_t y, uint32_t z, uint8_t* flagsOut) const {
+        const glm::uvec3& size = this->blockSizeWithGhost;
+        const uint64_t sliceSize = static_cast<uint64_t>(size.x) * size.y;
+        const T* row = this->blockData + z * sliceSize + static_cast<uint64_t>(y) * size.x;
+
+        const bool noYm = (y == 0);
+        const bool noYp = (y == size.y - 1);
+        const bool noZm = (z == 0);
+        const bool noZp = (z == size.z - 1);
+        const T* ym = noYm ? row : row - size.x;
+        const T* yp = noYp ? row : row + size.x;
+        const T* zm = noZm ? row : row - sliceSize;
+        const T* zp = noZp ? row : row + sliceSize;
+
+        // vertices with both x neighbors
+        const uint32_t begin = std::max(this->beginNonGhost.x, 1u);
+        const uint32_t end = std::max(begin, std::min(this->endNonGhost.x, size.x - 1));
+        for (uint32_t x = begin; x < end; ++x){
+            const T c = row[x];
+            flagsOut[x] = !(row[x - 1] <= c) & !(row[x + 1] < c)
+                        & (noYm | !(ym[x] <= c)) & (noYp | !(yp[x] < c))
+                        & (noZm | !(zm[x] <= c)) & (noZp | !(zp[x] < c));
+        }
+
+        // first and last vertex of the grid along x
+        const uint64_t rowIndex = (static_cast<uint64_t>(z) * size.y + y) * size.x;
+        for (uint32_t x = this->beginNonGhost.x; x < begin; ++x)
+            flagsOut[x] = this->isMinimum((rowIndex + x) | this->blockIndex);
+        for (uint32_t x = end; x < this->endNonGhost.x; ++x)
+            flagsOut[x] = this->isMinimum((rowIndex + x) | this->blockIndex);
+    }
+
+    bool isGhost(uint64_t v) const final{
         if (v == INVALID_VERTEX)
             return false;
         const uint8_t mask = this->blockMask[v & VERTEX_INDEX_MASK];
@@ -123,30 +457,172 @@ protected:
      * @param v
      * @return
      */
-    bool isMinimum(uint64_t v) const{
+    bool isMinimum(uint64_t v) const final{
         uint64_t neighbors[6];
         this->getNeighbors(v, neighbors);
 
-        const Value<T> value = this->getValue(v);
-
         for (uint32_t i = 0; i < 6; ++i) {
             const uint64_t neighbor = neighbors[i];
 
-            if (neighbor != INVALID_VERTEX && this->getValue(neighbor) < value)
+            if (neighbor != INVALID_VERTEX && this->lessLocal(neighbor, v))
                 return false;
         }
 
         return true;
     }
 
-    bool isLocal(uint64_t v) const{
+    bool isLocal(uint64_t v) const final{
         return (this->blockIndex == (v & BLOCK_INDEX_MASK));
     }
 
-    virtual void init(uint32_t blockIndex, uint32_t numBlocks){
-        this->gridSize = this->getSize();
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> collectHalo() const final{
+        std::vector<std::pair<uint32_t, std::vector<uint8_t>>> parts;
+        const uint32_t self = static_cast<uint32_t>(this->blockIndex >> BLOCK_INDEX_SHIFT);
+        for (uint32_t b = 0; b < this->numBlocks.x * this->numBlocks.y * this->numBlocks.z; ++b) {
+            glm::uvec3 offset, size;
+            this->getBlockLayout(b, offset, size);
+            if (b == self || !intersectBoxes(offset, size, this->blockOffset, this->blockSize, offset, size))
+                continue;
+
+            std::vector<uint8_t> values(static_cast<uint64_t>(size.x) * size.y * size.z * sizeof(T));
+            this->forEachRun(offset, size, [&](uint64_t local, uint64_t packed, uint32_t length){
+                std::memcpy(values.data() + packed * sizeof(T), this->blockData + local, length * sizeof(T));
+            });
+            parts.emplace_back(b, std::move(values));
+        }
+        return parts;
+    }
+
+    void insertHalo(uint32_t from, const std::vector<uint8_t>& values) final{
+        glm::uvec3 offset, size;
+        this->getBlockInterior(from, offset, size);
+        if (!intersectBoxes(offset, size, this->blockOffsetWithGhost, this->blockSizeWithGhost, offset, size)
+            || values.size() != static_cast<uint64_t>(size.x) * size.y * size.z * sizeof(T))
+            throw std::runtime_error("Halo of block " + std::to_string(from) + " does not match the ghost layer");
+
+        this->forEachRun(offset, size, [&](uint64_t local, uint64_t packed, uint32_t length){
+            std::memcpy(this->blockData + local, values.data() + packed * sizeof(T), length * sizeof(T));
+        });
+    }
+
+    uint32_t countHaloSources() const final{
+        const uint32_t self = static_cast<uint32_t>(this->blockIndex >> BLOCK_INDEX_SHIFT);
+        uint32_t count = 0;
+        for (uint32_t b = 0; b < this->numBlocks.x * this->numBlocks.y * this->numBlocks.z; ++b) {
+            glm::uvec3 offset, size;
+            this->getBlockInterior(b, offset, size);
+            if (b != self && intersectBoxes(offset, size, this->blockOffsetWithGhost, this->blockSizeWithGhost, offset, size))
+                ++count;
+        }
+        return count;
+    }
+
+protected:
+    // offset and size (ghost layer included) of a block, same layout as init(): one ghost layer towards every
+    // neighboring block
+    void getBlockLayout(uint32_t block, glm::uvec3& offset, glm::uvec3& size) const {
+        this->getBlockInterior(block, offset, size);
+        for (uint32_t d = 0; d < 3; ++d) {
+            if (offset[d] + size[d] < this->gridSize[d])
+                ++size[d];
+            if (offset[d] > 0) {
+                --offset[d];
+                ++size[d];
+            }
+        }
+    }
 
-        if (numBlocks > 1) {
+    // offset and size of a block without ghost layer
+    void getBlockInterior(uint32_t block, glm::uvec3& offset, glm::uvec3& size) const {
+        if (!this->layout.empty()) {
+            offset = this->layout.offset(block);
+            size = this->layout.size(block);
+        } else {
+            const glm::uvec3 blockCoord(block % this->numBlocks.x, (block / this->numBlocks.x) % this->numBlocks.y, block / (this->numBlocks.x * this->numBlocks.y));
+            offset = blockCoord * this->baseBlockSize;
+            size = this->baseBlockSize;
+            for (uint32_t d = 0; d < 3; ++d)
+                if (blockCoord[d] == this->numBlocks[d] - 1)
+                    size[d] = this->gridSize[d] - (this->numBlocks[d] - 1) * this->baseBlockSize[d];
+        }
+    }
+
+    // intersection of two boxes in grid coordinates, false if it is empty; the result may alias an input
+    static bool intersectBoxes(const glm::uvec3& offsetA, const glm::uvec3& sizeA, const glm::uvec3& offsetB, const glm::uvec3& sizeB,
+                               glm::uvec3& offset, glm::uvec3& size){
+        for (uint32_t d = 0; d < 3; ++d) {
+            const uint32_t begin = std::max(offsetA[d], offsetB[d]);
+            const uint32_t end = std::min(offsetA[d] + sizeA[d], offsetB[d] + sizeB[d]);
+            if (begin >= end)
+                return false;
+            offset[d] = begin;
+            size[d] = end - begin;
+        }
+        return true;
+    }
+
+    // f(index in blockData, index in the packed box, length) for the runs of a box (grid coordinates) of this
+    // block that are contiguous in blockData: its rows, in the bricked layout the parts of the rows in one brick
+    template <typename F>
+    void forEachRun(const glm::uvec3& offset, const glm::uvec3& size, F f) const {
+        const glm::uvec3 local(offset.x - this->blockOffsetWithGhost.x, offset.y - this->blockOffsetWithGhost.y, offset.z - this->blockOffsetWithGhost.z);
+        for (uint32_t z = 0; z < size.z; ++z) {
+            for (uint32_t y = 0; y < size.y; ++y) {
+                const uint64_t packed = (static_cast<uint64_t>(z) * size.y + y) * size.x;
+                for (uint32_t x = 0; x < size.x;) {
+                    const uint32_t length = this->bricked ? std::min(size.x - x, BRICK_MASK + 1 - ((local.x + x) & BRICK_MASK)) : size.x;
+                    f(this->localIndex(local.x + x, local.y + y, local.z + z, this->blockSizeWithGhost), packed + x, length);
+                    x += length;
+                }
+            }
+        }
+    }
+
+    // reads a box (grid coordinates) of this block from the input into blockData. The input is read in whole rows
+    // of the grid, slices of up to READ_BYTES per call, so a block that is cut along x or y takes one read per slice
+    // and not one per row (see RawManager::readBlock()); the rows of the box are copied out. Rows of the box of at
+    // least ROW_READ_BYTES are read as they are, reading the whole rows would cost more than the calls.
+    void readBox(const glm::uvec3& offset, const glm::uvec3& size){
+        if (!this->bricked && size.x == this->gridSize.x && size.x == this->blockSizeWithGhost.x && size.y == this->blockSizeWithGhost.y) {
+            // whole slices of the grid and the block: one contiguous slab of blockData
+            const uint64_t sliceSize = static_cast<uint64_t>(size.x) * size.y;
+            this->readBlock(offset, size, this->blockData + (offset.z - this->blockOffsetWithGhost.z) * sliceSize);
+            return;
+        }
+
+        const bool wholeRows = size.x * sizeof(T) < ROW_READ_BYTES;
+        const uint32_t readX = wholeRows ? 0 : offset.x;
+        const uint32_t readWidth = wholeRows ? this->gridSize.x : size.x;
+        const uint64_t readSlice = static_cast<uint64_t>(readWidth) * size.y;
+        const uint32_t slices = static_cast<uint32_t>(std::max<uint64_t>(1, std::min<uint64_t>(size.z, READ_BYTES / (readSlice * sizeof(T)))));
+        std::vector<T> rows(slices * readSlice);
+        for (uint32_t z = 0; z < size.z; z += slices) {
+            const uint32_t count = std::min(slices, size.z - z);
+            const glm::uvec3 boxOffset(offset.x, offset.y, offset.z + z);
+            this->readBlock(glm::uvec3(readX, offset.y, offset.z + z), glm::uvec3(readWidth, size.y, count), rows.data());
+            this->forEachRun(boxOffset, glm::uvec3(size.x, size.y, count), [&](uint64_t local, uint64_t packed, uint32_t length){
+                const T* row = rows.data() + packed / size.x * readWidth + (offset.x - readX);
+                std::memcpy(this->blockData + local, row + packed % size.x, length * sizeof(T));
+            });
+        }
+    }
+
+    RegularGridManager():blockData(nullptr), blockRank(nullptr), rank(nullptr), blockMask(nullptr), bricked(false){}
+
+    virtual void init(uint32_t blockIndex, uint32_t numBlocks, const BlockLayout& layout, bool readGhost, bool bricked,
+                      const std::string& scratch, uint64_t memoryBudget){
+        this->gridSize = this->getSize();
+        this->layout = layout;
+        this->bricked = bricked;
+
+        if (!this->layout.empty()) {
+            // planned blocks: numBlocks and blockIndex3D only describe the uniform split
+            this->blockOffset = this->layout.offset(blockIndex);
+            this->blockSize = this->layout.size(blockIndex);
+            this->numBlocks = glm::uvec3(numBlocks, 1, 1);
+            this->baseBlockSize = this->gridSize;
+            this->blockIndex3D = glm::uvec3(blockIndex, 0, 0);
+        } else if (numBlocks > 1) {
             // Compute block size based on prime factorization of block count
             std::vector<uint32_t> primeFactors;
             uint32_t z = 2;
@@ -162,17 +638,21 @@ protected:
             if (n > 1)
                 primeFactors.push_back(n);
 
+            // the blocks along an axis are counted, not derived from gridSize / baseBlockSize: with a factor that
+            // does not divide the axis that quotient is larger, and there would be more blocks than numBlocks
             this->baseBlockSize = this->gridSize;
+            this->numBlocks = glm::uvec3(1, 1, 1);
             for (uint32_t f : primeFactors) {
                 uint32_t maxDim = 0;
                 for (uint32_t d = 1; d < 3; ++d)
                     if (this->baseBlockSize[d] > this->baseBlockSize[maxDim])
                         maxDim = d;
+                if (this->baseBlockSize[maxDim] / f == 0)
+                    throw std::runtime_error("Too many blocks for the grid size");
                 this->baseBlockSize[maxDim] /= f;
+                this->numBlocks[maxDim] *= f;
             }
 
-            this->numBlocks = this->gridSize / this->baseBlockSize;
-
             // Compute index of local block
             n = blockIndex;
             this->blockIndex3D.z = n / (this->numBlocks.x * this->numBlocks.y);
@@ -200,30 +680,50 @@ protected:
         this->blockOffsetWithGhost = this->blockOffset;
         this->blockSizeWithGhost = this->blockSize;
 
-        glm::uvec3 beginNonGhost = glm::uvec3(0, 0, 0);
-        glm::uvec3 endNonGhost = this->blockSize;
+        this->beginNonGhost = glm::uvec3(0, 0, 0);
+        this->endNonGhost = this->blockSize;
 
         for (uint32_t d = 0; d < 3; ++d) {
-            if (this->blockIndex3D[d] > 0) {
+            if (this->blockOffset[d] > 0) {
                 --this->blockOffsetWithGhost[d];
                 ++this->blockSizeWithGhost[d];
 
-                ++beginNonGhost[d];
-                ++endNonGhost[d];
+                ++this->beginNonGhost[d];
+                ++this->endNonGhost[d];
             }
 
-            if (this->blockIndex3D[d] < this->numBlocks[d] - 1) {
+            if (this->blockOffset[d] + this->blockSize[d] < this->gridSize[d]) {
                 ++this->blockSizeWithGhost[d];
             }
         }
 
         //Store global index of block origin and local (negative) index of global origin
-        this->blockOffsetIndex = this->blockOffsetWithGhost.x + this->blockOffsetWithGhost.y * this->gridSize.x + this->blockOffsetWithGhost.z * this->gridSize.x * this->gridSize.y;
-        this->blockCoordGlobalOrigin = this->blockOffsetWithGhost.x + this->blockOffsetWithGhost.y * this->blockSizeWithGhost.x + this->blockOffsetWithGhost.z * this->blockSizeWithGhost.x * this->blockSizeWithGhost.y;
+        this->blockOffsetIndex = this->blockOffsetWithGhost.x + static_cast<uint64_t>(this->blockOffsetWithGhost.y) * this->gridSize.x + static_cast<uint64_t>(this->blockOffsetWithGhost.z) * this->gridSize.x * this->gridSize.y;
+        this->blockCoordGlobalOrigin = this->blockOffsetWithGhost.x + static_cast<uint64_t>(this->blockOffsetWithGhost.y) * this->blockSizeWithGhost.x + static_cast<uint64_t>(this->blockOffsetWithGhost.z) * this->blockSizeWithGhost.x * this->blockSizeWithGhost.y;
+
+        // steps between neighboring bricks along x, y, z
+        const uint64_t brickSize = 1ull << (3 * BRICK_SHIFT);
+        this->brickStep[0] = brickSize;
+        this->brickStep[1] = brickSize * ((this->blockSizeWithGhost.x + BRICK_MASK) >> BRICK_SHIFT);
+        this->brickStep[2] = this->brickStep[1] * ((this->blockSizeWithGhost.y + BRICK_MASK) >> BRICK_SHIFT);
+
+        // row-major index of the first vertex of every brick, for orderKey()
+        if (this->bricked) {
+            this->brickOrigins.resize((this->getLocalIndexSize() + (1u << (3 * BRICK_SHIFT)) - 1) >> (3 * BRICK_SHIFT));
+            for (uint64_t b = 0; b < this->brickOrigins.size(); ++b) {
+                const glm::uvec3 c = this->localCoords(b << (3 * BRICK_SHIFT), this->blockSizeWithGhost);
+                this->brickOrigins[b] = (static_cast<uint64_t>(c.z) * this->blockSizeWithGhost.y + c.y) * this->blockSizeWithGhost.x + c.x;
+            }
+        }
 
-        // Compute block mask
-        uint64_t numVerticesWithGhost = this->getNumVerticesLocal(true);
-        this->blockMask.resize(numVerticesWithGhost, 0);
+        // Compute block mask; the padding of the bricks counts as ghost
+        uint64_t numVerticesWithGhost = this->getLocalIndexSize();
+        if (scratch.empty())
+            this->store.reset(new VertexStore(numVerticesWithGhost));
+        else
+            this->store.reset(new VertexStore(numVerticesWithGhost, scratch, memoryBudget, blockIndex));
+        this->blockMask = this->store->template allocate<uint8_t>();
+        std::fill_n(this->blockMask, numVerticesWithGhost, this->bricked ? 0x80 : 0);
 
         for (uint32_t z = 0; z < this->blockSizeWithGhost.z; ++z) {
             for (uint32_t y = 0; y < this->blockSizeWithGhost.y; ++y) {
@@ -231,7 +731,7 @@ protected:
                     uint8_t mask = 0;
 
                     // Check if ghost
-                    if (x < beginNonGhost.x || x >= endNonGhost.x || y < beginNonGhost.y || y >= endNonGhost.y || z < beginNonGhost.z || z >= endNonGhost.z)
+                    if (x < this->beginNonGhost.x || x >= this->endNonGhost.x || y < this->beginNonGhost.y || y >= this->endNonGhost.y || z < this->beginNonGhost.z || z >= this->endNonGhost.z)
                         mask |= 0x80;
 
                     // Has -x neighbor
@@ -258,20 +758,19 @@ protected:
                     if (z < this->blockSizeWithGhost.z - 1)
                         mask |= 0x1;
 
-                    this->blockMask[z * this->blockSizeWithGhost.x * this->blockSizeWithGhost.y + y * this->blockSizeWithGhost.x + x] = mask;
+                    this->blockMask[this->localIndex(x, y, z, this->blockSizeWithGhost)] = mask;
                 }
             }
         }
 
         // Read data and release internal reader memory
-        this->blockData = new T[numVerticesWithGhost];
-        if (this->blockData == nullptr) {
-            // LogError().tag(std::to_string(blockIndex)) << "Failed to allocate block memory";
-            return;
-        }
-
-        this->readBlock(this->blockOffsetWithGhost, this->blockSizeWithGhost, this->blockData);
+        this->blockData = this->store->template allocate<T>();
+        if (readGhost)
+            this->readBox(this->blockOffsetWithGhost, this->blockSizeWithGhost);
+        else
+            this->readBox(this->blockOffset, this->blockSize);
         this->release();
+        this->store->evictAll();
 
 
         // Store block index in msb
@@ -281,23 +780,191 @@ protected:
         // Print info
         if (blockIndex == 0) {
             Log() << "Grid size: (" << this->gridSize.x << ", " << this->gridSize.y << ", " << this->gridSize.z << ")";
-            Log() << "Num blocks: (" << this->numBlocks.x << ", " << this->numBlocks.y << ", " << this->numBlocks.z << ")";;
+            if (!this->layout.empty())
+                Log() << "Num blocks: " << this->layout.numBlocks() << " (planned)";
+            else
+                Log() << "Num blocks: (" << this->numBlocks.x << ", " << this->numBlocks.y << ", " << this->numBlocks.z << ")";
             Log() << "Vertices: " << this->getNumVertices();
         }
-        Log().tag(std::to_string(blockIndex)) << "Block index: (" << this->blockIndex3D.x << ", " << this->blockIndex3D.y << ", " << this->blockIndex3D.z << ")";
+        if (!this->layout.empty())
+            Log().tag(std::to_string(blockIndex)) << "Estimated cost: " << this->layout.costs[blockIndex];
+        else
+            Log().tag(std::to_string(blockIndex)) << "Block index: (" << this->blockIndex3D.x << ", " << this->blockIndex3D.y << ", " << this->blockIndex3D.z << ")";
         Log().tag(std::to_string(blockIndex)) << "Block offset: (" << this->blockOffsetWithGhost.x << ", " << this->blockOffsetWithGhost.y << ", " << this->blockOffsetWithGhost.z << ")";
         Log().tag(std::to_string(blockIndex)) << "Block size: (" << this->blockSizeWithGhost.x << ", " << this->blockSizeWithGhost.y << ", " << this->blockSizeWithGhost.z << ")";
         Log().tag(std::to_string(blockIndex)) << "Vertices (local): " << this->getNumVerticesLocal(false);
         Log().tag(std::to_string(blockIndex)) << "Vertices (ghost): " << this->getNumVerticesLocal(true) - this->getNumVerticesLocal(false);
 
-        Log().tag(std::to_string(blockIndex)) << "Values: " << byteString(numVerticesWithGhost * sizeof(float));
+        Log().tag(std::to_string(blockIndex)) << "Values: " << byteString(numVerticesWithGhost * sizeof(T));
         Log().tag(std::to_string(blockIndex)) << "Mask: " << byteString(numVerticesWithGhost * sizeof(uint8_t));
+        if (this->store->outOfCore())
+            Log().tag(std::to_string(blockIndex)) << "Out of core: " << scratch << ", budget " << byteString(memoryBudget);
+    }
+
+    /**
+     * @brief A sample cell costs its voxels, and 1 + weight times that if its sample is lower than its six sampled
+     * neighbors in the order of lessLocal(). Only every stride-th row of the sample planes is read.
+     */
+    std::vector<float> sampleCosts(uint32_t stride, float weight, uint32_t zBegin, uint32_t zEnd) final{
+        const glm::uvec3 size = this->getSize();
+        const glm::uvec3 samples(numSamples(size.x, stride), numSamples(size.y, stride), numSamples(size.z, stride));
+        if (zBegin >= zEnd)
+            return std::vector<float>();
+
+        // the planes next to the range are only read for the neighbors
+        const uint32_t first = (zBegin > 0) ? zBegin - 1 : 0;
+        const uint32_t last = std::min(zEnd + 1, samples.z);
+        std::vector<T> values(static_cast<uint64_t>(last - first) * samples.y * samples.x);
+        std::vector<T> row(size.x);
+        for (uint32_t z = first; z < last; ++z) {
+            for (uint32_t y = 0; y < samples.y; ++y) {
+                this->readBlock(glm::uvec3(0, y * stride, z * stride), glm::uvec3(size.x, 1, 1), row.data());
+                for (uint32_t x = 0; x < samples.x; ++x)
+                    values[(static_cast<uint64_t>(z - first) * samples.y + y) * samples.x + x] = row[x * stride];
+            }
+        }
+
+        std::vector<float> costs(static_cast<uint64_t>(zEnd - zBegin) * samples.y * samples.x);
+        hpx::for_loop(hpx::execution::par, zBegin, zEnd, [&](uint32_t z){
+            // sample indices are ordered as the grid indices of their voxels
+            auto lower = [&](uint64_t a, uint64_t b){
+                return (values[a] < values[b]) || (values[a] == values[b] && a < b);
+            };
+            const uint64_t planeSize = static_cast<uint64_t>(samples.y) * samples.x;
+            for (uint32_t y = 0; y < samples.y; ++y) {
+                for (uint32_t x = 0; x < samples.x; ++x) {
+                    const uint64_t i = (z - first) * planeSize + static_cast<uint64_t>(y) * samples.x + x;
+                    const bool minimum = (x == 0 || lower(i, i - 1)) && (x + 1 == samples.x || lower(i, i + 1))
+                        && (y == 0 || lower(i, i - samples.x)) && (y + 1 == samples.y || lower(i, i + samples.x))
+                        && (z == 0 || lower(i, i - planeSize)) && (z + 1 == samples.z || lower(i, i + planeSize));
+
+                    const uint64_t voxels = static_cast<uint64_t>(std::min((x + 1) * stride, size.x) - x * stride)
+                        * (std::min((y + 1) * stride, size.y) - y * stride) * (std::min((z + 1) * stride, size.z) - z * stride);
+                    costs[(z - zBegin) * planeSize + static_cast<uint64_t>(y) * samples.x + x] = voxels * (minimum ? 1.0f + weight : 1.0f);
+                }
+            }
+        });
+        return costs;
+    }
+
+    void loadTimestep(const std::string& path, bool readGhost) final{
+        this->reopen(path);
+        if (readGhost)
+            this->readBox(this->blockOffsetWithGhost, this->blockSizeWithGhost);
+        else
+            this->readBox(this->blockOffset, this->blockSize);
+        this->release();
+        this->store->evictAll();
+    }
+
+    // the planes in parallel; the padding of the bricks is skipped
+    std::vector<uint64_t> hashRows() const final{
+        const glm::uvec3& offset = this->blockOffsetWithGhost;
+        const glm::uvec3& size = this->blockSizeWithGhost;
+        std::vector<uint64_t> rows(static_cast<uint64_t>(size.y) * size.z);
+        hpx::for_loop(hpx::execution::par, 0u, size.z, [&](uint32_t z){
+            for (uint32_t y = 0; y < size.y; ++y){
+                uint64_t hash = 0;
+                this->forEachRun(glm::uvec3(offset.x, offset.y + y, offset.z + z), glm::uvec3(size.x, 1, 1), [&](uint64_t local, uint64_t, uint32_t length){
+                    hash = hashBytes(this->blockData + local, length * sizeof(T), hash);
+                });
+                rows[static_cast<uint64_t>(z) * size.y + y] = hash;
+            }
+        });
+        return rows;
+    }
+
+    uint64_t hashPlanes(uint32_t zBegin, uint32_t zEnd) final{
+        const glm::uvec3 size = this->getSize();
+        const uint32_t type[3] = {sizeof(T), std::is_signed<T>::value, std::is_floating_point<T>::value};
+        uint64_t hash = hashValue(type, hashValue(size, hashValue(zBegin, 0)));
+
+        std::vector<T> plane(static_cast<uint64_t>(size.x) * size.y);
+        for (uint32_t z = zBegin; z < zEnd; ++z) {
+            this->readBlock(glm::uvec3(0, 0, z), glm::uvec3(size.x, size.y, 1), plane.data());
+            hash = hashBytes(plane.data(), plane.size() * sizeof(T), hash);
+        }
+        return hash;
     }
 
-    virtual glm::uvec3 getSize() = 0;
     virtual void readBlock(const glm::uvec3& offset, const glm::uvec3& size, T* dataOut) = 0;
     virtual void release() = 0;
+    // readBlock() from now on reads the input path, see loadTimestep()
+    virtual void reopen(const std::string& path) = 0;
 
+private:
+    // bin of a value in the counting sort, in ascending value order
+    static uint32_t rankKey(T value){
+        return static_cast<uint32_t>(static_cast<int64_t>(value) - std::numeric_limits<T>::min());
+    }
+
+    // local index of the vertex at row-major position p of the block with ghost layer
+    uint64_t rowMajorIndex(uint64_t p) const {
+        if (!this->bricked)
+            return p;
+        const glm::uvec3& size = this->blockSizeWithGhost;
+        return this->localIndex(p % size.x, (p / size.x) % size.y, p / (static_cast<uint64_t>(size.x) * size.y), size);
+    }
+
+    // both rank sorts run over the vertices in row-major order, so equal values are ranked as orderKey() orders them
+    void countingSortRanks(){
+        const uint64_t n = this->getNumVerticesLocal(true);
+        const uint32_t numBins = 1u << (8 * sizeof(T));
+        const uint32_t numChunks = static_cast<uint32_t>(std::max<uint64_t>(1, std::min<uint64_t>(hpx::get_num_worker_threads(), n / numBins)));
+        const uint64_t chunkSize = (n + numChunks - 1) / numChunks;
+
+        // histogram per chunk
+        std::vector<std::vector<uint32_t>> offsets(numChunks, std::vector<uint32_t>(numBins, 0));
+        hpx::for_loop(hpx::execution::par, 0u, numChunks, [&](uint32_t c){
+            const uint64_t end = std::min(n, (c + 1) * chunkSize);
+            for (uint64_t i = c * chunkSize; i < end; ++i)
+                ++offsets[c][rankKey(this->blockData[this->rowMajorIndex(i)])];
+        });
+
+        // exclusive prefix sum over (bin, chunk): equal values keep their index order
+        uint32_t sum = 0;
+        for (uint32_t b = 0; b < numBins; ++b){
+            for (uint32_t c = 0; c < numChunks; ++c){
+                const uint32_t count = offsets[c][b];
+                offsets[c][b] = sum;
+                sum += count;
+            }
+        }
+
+        hpx::for_loop(hpx::execution::par, 0u, numChunks, [&](uint32_t c){
+            const uint64_t end = std::min(n, (c + 1) * chunkSize);
+            for (uint64_t i = c * chunkSize; i < end; ++i){
+                const uint64_t j = this->rowMajorIndex(i);
+                this->rank[j] = offsets[c][rankKey(this->blockData[j])]++;
+            }
+        });
+    }
+
+    void sortRanks(){
+        const uint64_t n = this->getNumVerticesLocal(true);
+        std::vector<uint32_t> order(n);
+        std::iota(order.begin(), order.end(), 0u);
+
+        // bricked: the values in row-major order
+        std::vector<T> rowMajor;
+        if (this->bricked){
+            rowMajor.resize(n);
+            hpx::for_loop(hpx::execution::par, static_cast<uint64_t>(0), n, [&](uint64_t p){
+                rowMajor[p] = this->blockData[this->rowMajorIndex(p)];
+            });
+        }
+
+        const T* values = this->bricked ? rowMajor.data() : this->blockData;
+        hpx::sort(hpx::execution::par, order.begin(), order.end(), [values](uint32_t a, uint32_t b){
+            return (values[a] < values[b]) || (values[a] == values[b] && a < b);
+        });
+
+        hpx::for_loop(hpx::execution::par, static_cast<uint64_t>(0), n, [&](uint64_t i){
+            this->rank[this->rowMajorIndex(order[i])] = static_cast<uint32_t>(i);
+        });
+    }
+
+public:
 
     /**
      * @brief Returns the neighbors of the vertex with given id.
@@ -305,12 +972,18 @@ protected:
      * @param neighborsOut Can contain invalid indices
      * @return (Maximum) Number of neighbors
      */
-    uint32_t getNeighbors(uint64_t v, uint64_t* neighborsOut) const
+    uint32_t getNeighbors(uint64_t v, uint64_t* neighborsOut) const final
     {
         assert((v & BLOCK_INDEX_MASK) == this->blockIndex);
 
         const uint8_t mask = this->blockMask[v & VERTEX_INDEX_MASK];
 
+        if (this->bricked) {
+            for (int i = 0; i < 6; ++i)
+                neighborsOut[i] = (mask & (0x20 >> i)) ? this->brickNeighbor(v, i) : INVALID_VERTEX;
+            return 6;
+        }
+
         neighborsOut[0] = (mask & 0x20) ? (v - 1) : INVALID_VERTEX;
         neighborsOut[1] = (mask & 0x10) ? (v + 1) : INVALID_VERTEX;
         neighborsOut[2] = (mask & 0x8) ? (v - this->blockSizeWithGhost.x) : INVALID_VERTEX;
@@ -321,8 +994,10 @@ protected:
         return 6;
     }
 
-    uint64_t getNeighbor(uint64_t v, int i) const
+    uint64_t getNeighbor(uint64_t v, int i) const final
     {
+        if (this->bricked)
+            return (i >= 0 && i < 6 && (this->blockMask[v & VERTEX_INDEX_MASK] & (0x20 >> i))) ? this->brickNeighbor(v, i) : INVALID_VERTEX;
         if (i == 0) return (this->blockMask[v & VERTEX_INDEX_MASK] & 0x20) ? (v - 1) : INVALID_VERTEX;
         if (i == 1) return (this->blockMask[v & VERTEX_INDEX_MASK] & 0x10) ? (v + 1) : INVALID_VERTEX;
         if (i == 2) return (this->blockMask[v & VERTEX_INDEX_MASK] & 0x8) ? (v - this->blockSizeWithGhost.x) : INVALID_VERTEX;
@@ -334,12 +1009,25 @@ protected:
 
 private:
 
+    // neighbor i (order of getNeighbors()) of a vertex that has it, in the bricked layout: the next or previous
+    // vertex along the axis in the brick, or across the brick face in the neighboring brick
+    uint64_t brickNeighbor(uint64_t v, int i) const {
+        const uint32_t shift = BRICK_SHIFT * (i >> 1);
+        const uint64_t coord = (v >> shift) & BRICK_MASK;
+        const uint64_t wrap = static_cast<uint64_t>(BRICK_MASK) << shift;
+        if (i & 1)
+            return (coord != BRICK_MASK) ? v + (1ull << shift) : v + this->brickStep[i >> 1] - wrap;
+        return (coord != 0) ? v - (1ull << shift) : v - this->brickStep[i >> 1] + wrap;
+    }
+
     uint64_t blockIndex;
 
     glm::uvec3 gridSize;
     glm::uvec3 numBlocks;
     glm::uvec3 blockIndex3D;
     glm::uvec3 baseBlockSize;
+    // planned blocks, empty for the uniform split
+    BlockLayout layout;
 
     // Exact block of this locality
     glm::uvec3 blockOffset;
@@ -350,7 +1038,20 @@ private:
     // Block including ghost layer
     glm::uvec3 blockOffsetWithGhost;
     glm::uvec3 blockSizeWithGhost;
+    // Non-ghost range inside the block including ghost layer
+    glm::uvec3 beginNonGhost;
+    glm::uvec3 endNonGhost;
 
     T* blockData;
-    std::vector<uint8_t> blockMask; // msb to lsb: [ghost cell, unused, -x, +x, -y, +y, -z, +z]
+    // rank of each vertex in the order of less(), nullptr if computeRanks() was not called
+    const uint32_t* blockRank;
+    uint32_t* rank;
+    uint8_t* blockMask; // msb to lsb: [ghost cell, unused, -x, +x, -y, +y, -z, +z]
+    // memory of blockData, rank and blockMask, and of the per-vertex arrays of the sweeps
+    std::unique_ptr<VertexStore> store;
+
+    // bricks of 8^3 vertices instead of row-major order, see localIndex()
+    bool bricked;
+    uint64_t brickStep[3];
+    std::vector<uint64_t> brickOrigins;
 };
\ No newline at end of file
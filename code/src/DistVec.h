@@ -1,62 +1,363 @@
 #pragma once
 
-#include <vector>
-#include <map>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <unordered_map>
 #include "DataManager.h"
 #include <hpx/hpx.hpp>
 
-//Stores data associated with vertices, local vertices in array, remote vertices in map
+/*
+ * Sparse map from vertex ids to T, split into shards that each have their own lock.
+ * The map is node based, so the address of an entry is stable while other entries are inserted.
+ */
+template <typename T>
+class SparseVec {
+public:
+    static const uint64_t SHARDS = 64;
+
+    SparseVec(const T& emptyValue = T()) : empty(emptyValue){}
+
+    void setEmpty(const T& emptyValue){
+        empty = emptyValue;
+    }
+
+    // an id that was never stored reads as the empty value, nothing is inserted
+    T load(uint64_t idx, std::memory_order order = std::memory_order_acquire){
+        Shard& shard = this->shard(idx);
+        std::lock_guard<hpx::lcos::local::spinlock> lock(shard.lock);
+        auto it = shard.entries.find(idx);
+        return (it == shard.entries.end()) ? empty : it->second.load(order);
+    }
+
+    bool contains(uint64_t idx){
+        Shard& shard = this->shard(idx);
+        std::lock_guard<hpx::lcos::local::spinlock> lock(shard.lock);
+        return shard.entries.count(idx);
+    }
+
+    bool compareExchange(uint64_t idx, T& expected, const T& desired){
+        return slot(idx).compare_exchange_strong(expected, desired, std::memory_order_acq_rel, std::memory_order_acquire);
+    }
+
+    // the entry of idx, inserted with the empty value if missing
+    std::atomic<T>& slot(uint64_t idx){
+        Shard& shard = this->shard(idx);
+        std::lock_guard<hpx::lcos::local::spinlock> lock(shard.lock);
+        return shard.entries.try_emplace(idx, empty).first->second;
+    }
+
+    // removes all entries, the buckets are kept; must not run concurrently with other calls
+    void clear(){
+        for (Shard& shard : this->shards)
+            shard.entries.clear();
+    }
+
+    // calls f(id, value) for every entry, must not run concurrently with insertions
+    template <typename F>
+    void forEach(F f){
+        for (Shard& shard : this->shards){
+            for (auto& entry : shard.entries)
+                f(entry.first, entry.second.load(std::memory_order_acquire));
+        }
+    }
+
+private:
+    struct Shard {
+        hpx::lcos::local::spinlock lock;
+        std::unordered_map<std::uint64_t, std::atomic<T>> entries;
+    };
+
+    Shard& shard(uint64_t idx){
+        return shards[(idx ^ (idx >> 17)) % SHARDS];
+    }
+
+    Shard shards[SHARDS];
+    T empty;
+};
+
+// Stores data associated with vertices, local vertices in an array, remote vertices in a sharded hash table.
+// Every slot is atomic, so concurrent sweeps read and publish entries without a global lock.
 template <typename T>
 class DistVec {
 
 public:
     DistVec(){
-        data = nullptr;
+        blockIndex = 0;
     }
 
-    DistVec(std::uint64_t size, const T& emptyValue = T(), DataManager* data = nullptr){
-        local.resize(size, emptyValue);
-        empty = emptyValue;
-        this->data = data;
+    // blockIndex: block index in the msb of the vertex ids, see DataManager.h
+    DistVec(std::uint64_t size, const T& emptyValue = T(), uint64_t blockIndex = 0){
+        this->init(size, emptyValue, blockIndex);
     }
 
-    void init(std::uint64_t size, const T& emptyValue = T(), DataManager* data = nullptr){
-        local.resize(size, emptyValue);
+    // store: the local array is allocated there (out of core if it is), see VertexStore.h
+    void init(std::uint64_t size, const T& emptyValue = T(), uint64_t blockIndex = 0, VertexStore* store = nullptr){
+        if (store != nullptr){
+            owned.reset();
+            local = store->allocate<std::atomic<T>>();
+        } else {
+            owned.reset(new std::atomic<T>[size]);
+            local = owned.get();
+        }
+        for (std::uint64_t i = 0; i < size; ++i)
+            new (&local[i]) std::atomic<T>(emptyValue);
+        localSize = size;
         empty = emptyValue;
-        this->data = data;
+        remote.setEmpty(emptyValue);
+        this->blockIndex = blockIndex;
     }
 
-    T& operator [](uint64_t idx){
-        if (data->isLocal(idx)){
-            return local[idx & VERTEX_INDEX_MASK];
-        } else {
-            std::lock_guard<hpx::lcos::local::mutex> lock(mapLock);
-            if (!remote.count(idx))
-                remote[idx] = empty;
-            return remote[idx];
-        }
+    // every slot back to the empty value, the local array is kept
+    void reset(){
+        hpx::for_loop(hpx::execution::par, static_cast<std::uint64_t>(0), localSize, [this](std::uint64_t i){
+            local[i].store(empty, std::memory_order_relaxed);
+        });
+        remote.clear();
+    }
+
+    bool isLocal(uint64_t idx) const {
+        return (idx & BLOCK_INDEX_MASK) == blockIndex;
+    }
+
+    // a remote id that was never stored reads as the empty value, nothing is inserted
+    T load(uint64_t idx, std::memory_order order = std::memory_order_acquire){
+        if (isLocal(idx))
+            return local[idx & VERTEX_INDEX_MASK].load(order);
+        return remote.load(idx, order);
+    }
+
+    void store(uint64_t idx, const T& value, std::memory_order order = std::memory_order_release){
+        slot(idx).store(value, order);
+    }
+
+    /*
+     * Publishes desired if the entry still holds expected.
+     * On failure expected is set to the value that won.
+     */
+    bool compareExchange(uint64_t idx, T& expected, const T& desired){
+        return slot(idx).compare_exchange_strong(expected, desired, std::memory_order_acq_rel, std::memory_order_acquire);
     }
 
     bool contains(uint64_t idx){
-        if (data->isLocal(idx)){
-            return true;
-        } else {
-            return remote.count(idx);
-        }
+        return isLocal(idx) || remote.contains(idx);
+    }
+
+    // fast path for ids known to be in this block (ghost layer included): no test, no remote lookup
+    T loadLocal(uint64_t idx, std::memory_order order = std::memory_order_acquire) const {
+        return local[idx & VERTEX_INDEX_MASK].load(order);
+    }
+
+    bool compareExchangeLocal(uint64_t idx, T& expected, const T& desired){
+        return local[idx & VERTEX_INDEX_MASK].compare_exchange_strong(expected, desired, std::memory_order_acq_rel, std::memory_order_acquire);
     }
 
-    auto begin(){
-        return local.begin();
+    std::atomic<T>* begin(){
+        return local;
     }
 
-    auto end(){
-        return local.end();
+    std::atomic<T>* end(){
+        return local + localSize;
     }
 
-    DataManager* data;
-    std::vector<T> local;
-    std::map<std::uint64_t, T>  remote;
+    uint64_t blockIndex;
     T empty;
 
-    hpx::lcos::local::mutex mapLock;
+private:
+    std::atomic<T>& slot(uint64_t idx){
+        if (isLocal(idx))
+            return local[idx & VERTEX_INDEX_MASK];
+        return remote.slot(idx);
+    }
+
+    std::atomic<T>* local = nullptr;
+    // the local array if it is not in a VertexStore
+    std::unique_ptr<std::atomic<T>[]> owned;
+    std::uint64_t localSize = 0;
+    SparseVec<T> remote;
+};
+
+/*
+ * Dense codes for the ids of arcs that started on other localities, so that they fit next to the block-local
+ * vertex indices in a VertexVec. Codes are handed out from first upwards and never reused. The ids are kept in
+ * chunks that double in size, chunk c holds the offsets [CHUNK_SIZE * (2^c - 1), CHUNK_SIZE * (2^(c+1) - 1)) from
+ * first; the table covers every offset and a published chunk never moves.
+ */
+class ForeignIds {
+public:
+    static const uint64_t LOG_CHUNK_SIZE = 12;
+    static const uint64_t CHUNK_SIZE = 1 << LOG_CHUNK_SIZE;
+    static const uint64_t MAX_CHUNKS = 64 - LOG_CHUNK_SIZE;
+
+    ForeignIds() : first(0), next(0), chunks(new std::atomic<uint64_t*>[MAX_CHUNKS]){
+        for (uint64_t i = 0; i < MAX_CHUNKS; ++i)
+            chunks[i].store(nullptr, std::memory_order_relaxed);
+        codes.setEmpty(INVALID_VERTEX);
+    }
+
+    ~ForeignIds(){
+        for (uint64_t i = 0; i < MAX_CHUNKS; ++i)
+            delete[] chunks[i].load(std::memory_order_relaxed);
+    }
+
+    void init(uint64_t first){
+        this->first = first;
+        this->next.store(first, std::memory_order_relaxed);
+    }
+
+    // forgets all codes, the chunks are filled again from first
+    void reset(){
+        this->codes.clear();
+        this->next.store(this->first, std::memory_order_relaxed);
+    }
+
+    bool isForeign(uint64_t code) const {
+        return code >= this->first;
+    }
+
+    // code of a foreign id, assigned on first use
+    uint64_t code(uint64_t id){
+        uint64_t result = this->codes.load(id);
+        if (result != INVALID_VERTEX)
+            return result;
+
+        // the id is written before the code is published, a code that loses the race stays unused
+        const uint64_t created = this->next.fetch_add(1, std::memory_order_relaxed);
+        const uint64_t offset = created - this->first;
+        const uint64_t c = chunkOf(offset);
+        this->chunk(c)[offset - chunkBegin(c)] = id;
+
+        if (this->codes.compareExchange(id, result, created))
+            return created;
+        return result;
+    }
+
+    uint64_t id(uint64_t code) const {
+        const uint64_t offset = code - this->first;
+        const uint64_t c = chunkOf(offset);
+        return this->chunks[c].load(std::memory_order_acquire)[offset - chunkBegin(c)];
+    }
+
+private:
+    static uint64_t chunkOf(uint64_t offset){
+        return 63 - __builtin_clzll((offset >> LOG_CHUNK_SIZE) + 1);
+    }
+
+    static uint64_t chunkBegin(uint64_t c){
+        return (CHUNK_SIZE << c) - CHUNK_SIZE;
+    }
+
+    uint64_t* chunk(uint64_t c){
+        uint64_t* result = this->chunks[c].load(std::memory_order_acquire);
+        if (result != nullptr)
+            return result;
+
+        std::lock_guard<hpx::lcos::local::spinlock> lock(this->chunkLock);
+        result = this->chunks[c].load(std::memory_order_relaxed);
+        if (result == nullptr){
+            result = new uint64_t[CHUNK_SIZE << c];
+            this->chunks[c].store(result, std::memory_order_release);
+        }
+        return result;
+    }
+
+    uint64_t first;
+    std::atomic<uint64_t> next;
+    SparseVec<uint64_t> codes;
+    std::unique_ptr<std::atomic<uint64_t*>[]> chunks;
+    hpx::lcos::local::spinlock chunkLock;
+};
+
+/*
+ * Maps vertices to arcs (swept, UF). The values are stored as block-local indices of type Id, so with
+ * Id = uint32_t a slot takes 4 bytes; load() returns the global id again. Arcs that started on another
+ * locality are stored as codes above the block-local indices, see ForeignIds.
+ */
+template <typename Id>
+class VertexVec {
+public:
+    static constexpr Id INVALID_ID = std::numeric_limits<Id>::max();
+
+    void init(std::uint64_t size, uint64_t blockIndex, VertexStore* store = nullptr){
+        values.init(size, INVALID_ID, blockIndex, store);
+        foreign.init(size);
+    }
+
+    void reset(){
+        values.reset();
+        foreign.reset();
+    }
+
+    uint64_t load(uint64_t idx, std::memory_order order = std::memory_order_acquire){
+        return decode(values.load(idx, order));
+    }
+
+    void store(uint64_t idx, uint64_t v, std::memory_order order = std::memory_order_release){
+        values.store(idx, encode(v), order);
+    }
+
+    bool compareExchange(uint64_t idx, uint64_t expected, uint64_t desired){
+        Id encoded = encode(expected);
+        return values.compareExchange(idx, encoded, encode(desired));
+    }
+
+    // idx must be a vertex of this block, see DistVec::loadLocal
+    uint64_t loadLocal(uint64_t idx, std::memory_order order = std::memory_order_acquire){
+        return decode(values.loadLocal(idx, order));
+    }
+
+    /*
+     * Union-find of the sweeps (UF): is goal an ancestor of start (or start itself)? goal is an actively running
+     * sweep, so it is a root. Path halving: every visited vertex is moved up to its grandparent with a CAS.
+     * Parents only ever move up towards the root, so a failed CAS means another sweep has already shortened the
+     * path and is ignored. Arcs that started on other localities are keys of the remote table.
+     */
+    bool reaches(uint64_t start, uint64_t goal){
+        if (start == INVALID_VERTEX)
+            return false;
+
+        uint64_t c = start;
+        while (c != goal) {
+            const uint64_t parent = this->load(c);
+            if (parent == INVALID_VERTEX)
+                return false;
+            if (parent == goal)
+                return true;
+
+            const uint64_t grandparent = this->load(parent);
+            if (grandparent == INVALID_VERTEX)
+                return false;
+
+            this->compareExchange(c, parent, grandparent);
+            c = grandparent;
+        }
+        return true;
+    }
+
+private:
+    Id encode(uint64_t v){
+        if (v == INVALID_VERTEX)
+            return INVALID_ID;
+        if (values.isLocal(v))
+            return static_cast<Id>(v & VERTEX_INDEX_MASK);
+
+        const uint64_t code = foreign.code(v);
+        if (code >= static_cast<uint64_t>(INVALID_ID))
+            throw std::runtime_error("Too many arcs from other localities for the id type");
+        return static_cast<Id>(code);
+    }
+
+    uint64_t decode(Id id) const {
+        if (id == INVALID_ID)
+            return INVALID_VERTEX;
+        if (foreign.isForeign(id))
+            return foreign.id(id);
+        return static_cast<uint64_t>(id) | values.blockIndex;
+    }
+
+    DistVec<Id> values;
+    ForeignIds foreign;
 };
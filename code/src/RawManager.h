@@ -1,47 +1,226 @@
 #pragma once
 #include "DataManager.h"
 #include "Value.h"
-#include "vtkImageAlgorithm.h"
 
-#include <vtkImageData.h>
-#include <vtkMetaImageReader.h>
-#include <vtkPointData.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+/**
+ * @brief The fields of a MetaImage (.mhd) header that are needed to locate the raw voxel data.
+ */
+class MetaImageHeader {
+public:
+    glm::uvec3 dimSize;
+    std::string elementType;
+    // path of the raw data; for ElementDataFile = LOCAL this is the header itself
+    std::string dataFile;
+    // byte offset of the first voxel in dataFile, -1 means "the last voxels of the file"
+    int64_t headerSize = 0;
+    bool msb = false;
+
+    static MetaImageHeader parse(const std::string& path){
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            throw std::runtime_error("Cannot open " + path);
+
+        MetaImageHeader header;
+        int nDims = 3;
+        int numChannels = 1;
+        bool compressed = false;
+        bool local = false;
+
+        std::string line;
+        while (std::getline(in, line)){
+            std::string::size_type eq = line.find('=');
+            if (eq == std::string::npos)
+                continue;
+
+            std::string key = trim(line.substr(0, eq));
+            std::string value = trim(line.substr(eq + 1));
+            std::istringstream values(value);
+
+            if (key == "NDims")
+                values >> nDims;
+            else if (key == "DimSize")
+                values >> header.dimSize.x >> header.dimSize.y >> header.dimSize.z;
+            else if (key == "ElementType")
+                header.elementType = value;
+            else if (key == "ElementNumberOfChannels")
+                values >> numChannels;
+            else if (key == "HeaderSize")
+                values >> header.headerSize;
+            else if (key == "BinaryDataByteOrderMSB" || key == "ElementByteOrderMSB")
+                header.msb = (value == "True" || value == "true");
+            else if (key == "CompressedData")
+                compressed = (value == "True" || value == "true");
+            else if (key == "ElementDataFile"){
+                // ElementDataFile is always the last entry of the header
+                if (value == "LOCAL"){
+                    local = true;
+                    header.dataFile = path;
+                    header.headerSize = in.tellg();
+                } else if (value.find(' ') != std::string::npos || value.find('%') != std::string::npos){
+                    throw std::runtime_error("Multi-file MetaImage data is not supported: " + value);
+                } else if (value[0] == '/'){
+                    header.dataFile = value;
+                } else {
+                    std::string::size_type slash = path.find_last_of('/');
+                    header.dataFile = (slash == std::string::npos) ? value : path.substr(0, slash + 1) + value;
+                }
+                break;
+            }
+        }
+
+        if (header.dataFile.empty())
+            throw std::runtime_error("No ElementDataFile in " + path);
+        if (nDims != 3 || numChannels != 1)
+            throw std::runtime_error("Only scalar 3D MetaImages are supported: " + path);
+        if (compressed)
+            throw std::runtime_error("Compressed MetaImage data is not supported: " + path);
+        if (local && header.headerSize < 0)
+            throw std::runtime_error("Invalid header size in " + path);
+
+        return header;
+    }
+
+private:
+    static std::string trim(const std::string& s){
+        const char* ws = " \t\r\n";
+        std::string::size_type begin = s.find_first_not_of(ws);
+        if (begin == std::string::npos)
+            return std::string();
+        return s.substr(begin, s.find_last_not_of(ws) - begin + 1);
+    }
+};
+
+/**
+ * @brief Reads the block of a locality straight from the raw file of a MetaImage. Only the rows of the block
+ * (with ghost layer) are read, so memory and I/O of a locality scale with its block and not with the grid.
+ */
 template<typename T>
 class RawManager : public RegularGridManager<T>{
 public:
-    RawManager(const std::string& path){
-        this->reader = vtkMetaImageReader::New();
-
-        this->reader->SetFileName(path.c_str());
+    RawManager(const std::string& path)
+        : header(MetaImageHeader::parse(path)){
+        this->openData();
+    }
 
-        this->reader->Update();
+    virtual ~RawManager(){
+        this->release();
     }
 
-    virtual ~RawManager() = default;
-    
     glm::uvec3 getSize(){
-        int dims[3];
-        this->reader->GetOutput()->GetDimensions(dims);
-        return glm::uvec3(dims[0], dims[1], dims[2]);
+        return this->header.dimSize;
     }
 
     void readBlock(const glm::uvec3& offset, const glm::uvec3& size, T* blockOut){
         const glm::uvec3 dataSize = this->getSize();
-        reader->GetOutput()->GetPointData()->SetScalars(reader->GetOutput()->GetPointData()->GetArray(0));
-    
-        const T* data = static_cast<T*>(this->reader->GetOutput()->GetScalarPointer());
-        for (uint32_t z = 0; z < size.z; ++z)
-            for (uint32_t y = 0; y < size.y; ++y){
-                memcpy(blockOut + z * size.y * size.x + y * size.x, 
-                    data + (offset.z + z) * dataSize.y * dataSize.x + (offset.y + y) * dataSize.x + offset.x,
-                    size.x * sizeof(T));
+        const uint64_t rowBytes = static_cast<uint64_t>(size.x) * sizeof(T);
+
+        auto fileOffset = [&](uint32_t y, uint32_t z){
+            return this->header.headerSize
+                + static_cast<int64_t>((((static_cast<uint64_t>(offset.z) + z) * dataSize.y + offset.y + y) * dataSize.x + offset.x) * sizeof(T));
+        };
+
+        if (size.x == dataSize.x && size.y == dataSize.y){
+            // the block spans whole slices: one read
+            this->readFully(blockOut, rowBytes * size.y * size.z, fileOffset(0, 0));
+        } else if (size.x == dataSize.x){
+            // the block spans whole rows: one read per slice
+            for (uint32_t z = 0; z < size.z; ++z)
+                this->readFully(blockOut + static_cast<uint64_t>(z) * size.y * size.x, rowBytes * size.y, fileOffset(0, z));
+        } else {
+            for (uint32_t z = 0; z < size.z; ++z)
+                for (uint32_t y = 0; y < size.y; ++y)
+                    this->readFully(blockOut + (static_cast<uint64_t>(z) * size.y + y) * size.x, rowBytes, fileOffset(y, z));
+        }
+
+        if (this->header.msb && sizeof(T) > 1){
+            const uint64_t n = static_cast<uint64_t>(size.x) * size.y * size.z;
+            for (uint64_t i = 0; i < n; ++i){
+                char* bytes = reinterpret_cast<char*>(blockOut + i);
+                std::reverse(bytes, bytes + sizeof(T));
             }
+        }
     }
 
     void release(){
-        if (this->reader)this->reader->Delete();
+        if (this->file >= 0){
+            close(this->file);
+            this->file = -1;
+        }
     }
+
+    // the next timestep must have the size and element type of the first
+    void reopen(const std::string& path){
+        const MetaImageHeader next = MetaImageHeader::parse(path);
+        if (next.dimSize != this->header.dimSize || next.elementType != this->header.elementType)
+            throw std::runtime_error("Size or element type of " + path + " differs from the first timestep");
+        this->release();
+        this->header = next;
+        this->openData();
+    }
+
 private:
-    vtkMetaImageReader* reader = nullptr;
-};
\ No newline at end of file
+    void openData(){
+        this->file = open(this->header.dataFile.c_str(), O_RDONLY);
+        if (this->file < 0)
+            throw std::runtime_error("Cannot open " + this->header.dataFile + ": " + std::strerror(errno));
+
+        if (this->header.headerSize < 0){
+            const uint64_t numBytes = static_cast<uint64_t>(this->header.dimSize.x) * this->header.dimSize.y * this->header.dimSize.z * sizeof(T);
+            this->header.headerSize = lseek(this->file, 0, SEEK_END) - numBytes;
+        }
+    }
+
+    void readFully(T* out, uint64_t numBytes, int64_t fileOffset){
+        char* dst = reinterpret_cast<char*>(out);
+        while (numBytes > 0){
+            ssize_t n = pread(this->file, dst, numBytes, fileOffset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw std::runtime_error("Failed to read " + this->header.dataFile + (n < 0 ? std::string(": ") + std::strerror(errno) : std::string(": unexpected end of file")));
+            dst += n;
+            fileOffset += n;
+            numBytes -= n;
+        }
+    }
+
+    MetaImageHeader header;
+    int file = -1;
+};
+
+/**
+ * @brief Creates the RawManager whose value type matches the ElementType of the MetaImage header.
+ * @return nullptr for element types that are not supported
+ */
+inline DataManager* createRawManager(const std::string& path){
+    const std::string elementType = MetaImageHeader::parse(path).elementType;
+
+    if (elementType == "MET_CHAR")
+        return new RawManager<int8_t>(path);
+    if (elementType == "MET_UCHAR")
+        return new RawManager<uint8_t>(path);
+    if (elementType == "MET_SHORT")
+        return new RawManager<int16_t>(path);
+    if (elementType == "MET_USHORT")
+        return new RawManager<uint16_t>(path);
+    if (elementType == "MET_INT")
+        return new RawManager<int32_t>(path);
+    if (elementType == "MET_UINT")
+        return new RawManager<uint32_t>(path);
+    if (elementType == "MET_FLOAT")
+        return new RawManager<float>(path);
+    if (elementType == "MET_DOUBLE")
+        return new RawManager<double>(path);
+
+    return nullptr;
+}
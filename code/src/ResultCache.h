@@ -0,0 +1,267 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "TreeWriter.h"
+
+/*
+ * Results of earlier runs, one entry per block, keyed by a hash of the input values and element type, the
+ * decomposition and the options (see Options::resultHash()). The files of an entry in the cache directory:
+ *
+ *   <key>.<block>.mts   the shard of the block as written to --output, parents resolved, see TreeWriter.h
+ *   <key>.<block>.mtc   CacheHeader, then the arc of every vertex of the block without ghost layer (uint64_t,
+ *                       x fastest)
+ *
+ * Both files are written under <key>.tmp.<block>.* and renamed once complete, the .mtc last, so an entry exists
+ * as soon as its .mtc does. An entry is only used if its header matches the key, block and format version, the
+ * shard matches the size and the hash of its tables recorded in the header, and the labels fill the .mtc; any
+ * other entry is a miss and is overwritten by the run.
+ */
+
+const uint32_t CACHE_FORMAT_VERSION = 1;
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block;
+    uint64_t key;
+    uint32_t numBlocks;
+    uint32_t flags;
+    uint32_t gridSize[3];
+    uint32_t blockOffset[3];
+    uint32_t blockSize[3];
+    uint32_t reserved;
+    uint64_t minima;
+    // number of labels, the vertices of the block without ghost layer
+    uint64_t vertices;
+    uint64_t shardBytes;
+    // hash of the header and the tables of the shard
+    uint64_t shardHash;
+};
+
+static_assert(sizeof(CacheHeader) == 104, "CacheHeader must not be padded");
+
+inline uint64_t mixHash(uint64_t x){
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// non-cryptographic 64 bit hash, 8 bytes per step
+inline uint64_t hashBytes(const void* data, uint64_t size, uint64_t seed){
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = mixHash(seed ^ size);
+    uint64_t i = 0;
+    for (; i + 8 <= size; i += 8){
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        hash = (hash ^ mixHash(word)) * 0x9e3779b97f4a7c15ull;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes + i, size - i);
+    return mixHash(hash ^ tail);
+}
+
+template <typename T>
+inline uint64_t hashValue(const T& value, uint64_t seed){
+    return hashBytes(&value, sizeof(T), seed);
+}
+
+template <typename T>
+inline uint64_t hashValues(const std::vector<T>& values, uint64_t seed){
+    return hashBytes(values.data(), values.size() * sizeof(T), hashValue(values.size(), seed));
+}
+
+inline std::string cachePrefix(const std::string& dir, uint64_t key){
+    std::ostringstream name;
+    name << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << key;
+    return name.str();
+}
+
+inline std::string cacheFileName(const std::string& prefix, uint32_t block){
+    return prefix + "." + std::to_string(block) + ".mtc";
+}
+
+inline void copyFile(const std::string& from, const std::string& to){
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    if (!in || !out || !(out << in.rdbuf()))
+        throw std::runtime_error("Can not copy " + from + " to " + to);
+}
+
+/**
+ * @brief A whole file mapped read-only, empty if it can not be opened.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& name){
+        const int file = open(name.c_str(), O_RDONLY);
+        if (file < 0)
+            return;
+        struct stat status;
+        if (fstat(file, &status) == 0 && status.st_size > 0){
+            void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (data != MAP_FAILED){
+                this->bytes = static_cast<const uint8_t*>(data);
+                this->length = status.st_size;
+            }
+        }
+        close(file);
+    }
+
+    ~MappedFile(){
+        if (this->bytes != nullptr)
+            munmap(const_cast<uint8_t*>(this->bytes), this->length);
+    }
+
+    MappedFile(const MappedFile& ) = delete;
+    MappedFile& operator=(const MappedFile& ) = delete;
+
+    const uint8_t* data() const {
+        return this->bytes;
+    }
+
+    uint64_t size() const {
+        return this->length;
+    }
+
+private:
+    const uint8_t* bytes = nullptr;
+    uint64_t length = 0;
+};
+
+/*
+ * Hash of the header and the tables of a mapped shard, 0 if the file is no complete shard of the block.
+ */
+inline uint64_t hashShard(const MappedFile& file, uint32_t block){
+    if (file.size() < sizeof(ShardHeader))
+        return 0;
+    const ShardHeader& header = *reinterpret_cast<const ShardHeader*>(file.data());
+    if (std::memcmp(header.magic, "MTSHARD", 8) != 0 || header.version != TREE_FORMAT_VERSION || header.locality != block
+        || header.partTable % 8 != 0 || header.partTable > file.size()
+        || header.arcTable != header.partTable + header.numParts * sizeof(PartRecord)
+        || header.arcTable + header.numArcs * sizeof(ArcRecord) != file.size())
+        return 0;
+
+    const uint64_t hash = hashBytes(&header, sizeof(header), CACHE_FORMAT_VERSION);
+    return hashBytes(file.data() + header.partTable, file.size() - header.partTable, hash) | 1;
+}
+
+/**
+ * @brief The mapped entry of one block. open() returns nullptr if there is no valid entry, see above.
+ */
+class CacheEntry {
+public:
+    static std::unique_ptr<CacheEntry> open(const std::string& dir, uint64_t key, uint32_t block, uint32_t numBlocks){
+        const std::string prefix = cachePrefix(dir, key);
+        std::unique_ptr<CacheEntry> entry(new CacheEntry(prefix, block));
+
+        const MappedFile& labels = entry->labelFile;
+        if (labels.size() < sizeof(CacheHeader))
+            return nullptr;
+        const CacheHeader& header = entry->header();
+        if (std::memcmp(header.magic, "MTCACHE", 8) != 0 || header.version != CACHE_FORMAT_VERSION || header.key != key
+            || header.block != block || header.numBlocks != numBlocks
+            || labels.size() != sizeof(CacheHeader) + header.vertices * sizeof(uint64_t))
+            return nullptr;
+
+        if (entry->shardFile.size() != header.shardBytes || hashShard(entry->shardFile, block) != header.shardHash)
+            return nullptr;
+        return entry;
+    }
+
+    const CacheHeader& header() const {
+        return *reinterpret_cast<const CacheHeader*>(this->labelFile.data());
+    }
+
+    const ShardHeader& shard() const {
+        return *reinterpret_cast<const ShardHeader*>(this->shardFile.data());
+    }
+
+    // the arcs that started on the block, sorted by extremum
+    std::vector<ArcRecord> arcs() const {
+        const ArcRecord* arcs = reinterpret_cast<const ArcRecord*>(this->shardFile.data() + this->shard().arcTable);
+        return std::vector<ArcRecord>(arcs, arcs + this->shard().numArcs);
+    }
+
+    const uint64_t* labels() const {
+        return reinterpret_cast<const uint64_t*>(this->labelFile.data() + sizeof(CacheHeader));
+    }
+
+    ShardInfo shardInfo() const {
+        const ShardHeader& header = this->shard();
+        const PartRecord* parts = reinterpret_cast<const PartRecord*>(this->shardFile.data() + header.partTable);
+
+        ShardInfo info;
+        info.arcRow = header.arcRow;
+        info.numArcs = header.numArcs;
+        info.numParts = header.numParts;
+        for (uint64_t i = 0; i < header.numParts; ++i)
+            info.numVertices += parts[i].count;
+        info.bytes = this->shardFile.size();
+        std::copy(header.gridSize, header.gridSize + 3, info.gridSize);
+        info.flags = header.flags;
+        return info;
+    }
+
+    const std::string shardName;
+
+private:
+    CacheEntry(const std::string& prefix, uint32_t block)
+        : shardName(shardFileName(prefix, block))
+        , labelFile(cacheFileName(prefix, block))
+        , shardFile(shardFileName(prefix, block)){}
+
+    MappedFile labelFile;
+    MappedFile shardFile;
+};
+
+/**
+ * @brief Completes the entry of a block whose shard has been closed as shardFileName(prefix + ".tmp", block):
+ * fills in the shard fields of header, writes the labels and renames both files.
+ * writeLabels(out) streams the numLabels labels into out.
+ */
+template <typename WriteLabels>
+inline void storeCacheEntry(const std::string& prefix, uint32_t block, CacheHeader header, uint64_t numLabels, WriteLabels writeLabels){
+    const std::string shardTmp = shardFileName(prefix + ".tmp", block);
+    const std::string labelTmp = cacheFileName(prefix + ".tmp", block);
+    {
+        const MappedFile shard(shardTmp);
+        header.shardBytes = shard.size();
+        header.shardHash = hashShard(shard, block);
+        if (header.shardHash == 0)
+            throw std::runtime_error("No complete shard in " + shardTmp);
+    }
+
+    std::memcpy(header.magic, "MTCACHE", 8);
+    header.version = CACHE_FORMAT_VERSION;
+    header.block = block;
+    header.vertices = numLabels;
+
+    std::ofstream file(labelTmp, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writeLabels(file);
+    file.close();
+    if (!file)
+        throw std::runtime_error("Can not write " + labelTmp);
+
+    if (std::rename(shardTmp.c_str(), shardFileName(prefix, block).c_str()) != 0
+        || std::rename(labelTmp.c_str(), cacheFileName(prefix, block).c_str()) != 0)
+        throw std::runtime_error("Can not store the cache entry " + cacheFileName(prefix, block));
+}
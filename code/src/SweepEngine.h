@@ -0,0 +1,883 @@
+#pragma once
+
+#include "Arc.h"
+#include "Arena.h"
+#include "DataManager.h"
+#include "DistVec.h"
+#include "Log.h"
+#include "TreeConstructor.h"
+#include "TreeWriter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Interface of the sweep state of one locality. TreeConstructor only talks to this interface, the
+ * implementation is SweepEngine<Grid> for the concrete grid type of the input.
+ */
+class SweepEngineBase {
+public:
+    virtual ~SweepEngineBase(){}
+
+    // marks the minima as swept by themselves before any sweep is launched
+    virtual void markSwept(const std::vector<uint64_t>& minima) = 0;
+    virtual void startSweep(uint64_t v, bool leaf) = 0;
+    virtual void continueLocalSweep(uint64_t v) = 0;
+    // messages of the sweeps that cross localities, see TreeConstructor
+    virtual void continueSweep(uint64_t arc, uint32_t from, const std::vector<uint64_t>& vertices) = 0;
+    virtual void acknowledge(uint64_t arc, const std::vector<BoundaryReport>& reports) = 0;
+    virtual void finishChild(uint64_t saddle, uint64_t child, const std::vector<uint32_t>& parts) = 0;
+    virtual void startPart(uint64_t arc, uint64_t saddleIndex, double saddleValue, const std::vector<uint64_t>& children) = 0;
+    // trunk skip: the sweeps stop, the arc that is still sweeping becomes the lowest arc of the trunk
+    virtual void startTrunk() = 0;
+    // arcs that started on this locality and have no saddle after the sweeps
+    virtual std::vector<TrunkArc> collectTrunk() = 0;
+    // chains the arcs without saddle of all localities, in ascending order, and assigns the vertices not swept
+    virtual void buildTrunk(const std::vector<TrunkArc>& trunk) = 0;
+    // number of arcs of the local part of the tree
+    virtual uint64_t countArcs() = 0;
+    // output: writes the parts that are not written yet, and returns the arcs that started on this locality,
+    // sorted by extremum, with the parent left to the caller
+    virtual void writeParts() = 0;
+    virtual std::vector<ArcRecord> collectArcs() = 0;
+    // the arc of every vertex of a box of the block without ghost layer (block coordinates), x fastest, as the linear
+    // grid index of its extremum; computed a slab of z-planes at a time, out(labels, count) gets the slabs in order
+    virtual void segmentation(const glm::uvec3& begin, const glm::uvec3& size, const std::function<void(const uint64_t*, uint64_t)>& out) = 0;
+    // logs the allocation counts and bytes of the arenas of this locality
+    virtual void reportAllocations(uint32_t index) = 0;
+    // timesteps: forgets the tree for the next construction on new values, the arenas and arrays are kept
+    virtual void reset(ShardWriter* writer) = 0;
+};
+
+/**
+ * @brief Sweeps of one locality on the grid type Grid. The hot methods of RegularGridManager are final, so
+ * all calls to the grid in the sweep loop (neighbors, ghost test, comparison) are direct and can be inlined.
+ * Id is the type of the block-local vertex ids stored in swept and UF: uint32_t in compact mode, else uint64_t.
+ *
+ * A sweep that reaches the ghost layer continues on the locality that owns the ghost vertex. The swept vertices
+ * next to the ghost layer are collected per destination and sent in batches of up to BATCH_SIZE, the rest is sent
+ * when the queue of the arc runs empty. The receiver sweeps on in its own part of the arc. Every message is
+ * acknowledged (Dijkstra-Scholten): the first message engages a part, its acknowledgement is held back until the
+ * part is idle and all its own messages are acknowledged, and carries the boundary minima of the parts below.
+ * When the part on the locality where the arc started becomes idle, all parts are, and the smallest boundary
+ * vertex of all parts is the saddle. Its owner starts the saddle sweep and tells every locality with a part of
+ * a child to hand that part over to the saddle's arc.
+ */
+template <typename Grid, typename Id>
+class SweepEngine : public SweepEngineBase {
+public:
+    static const uint64_t BATCH_SIZE = 4096;
+    // bytes of labels per slab of segmentation()
+    static const uint64_t SLAB_BYTES = 64ull << 20;
+
+    // writer: the shard the parts are streamed to, nullptr if the tree is not written
+    // flat: keep no augmentation, the segmentation is rebuilt from swept
+    SweepEngine(TreeConstructor* owner, Grid* grid, ShardWriter* writer, bool flat)
+        : owner(owner)
+        , grid(grid)
+        , writer(writer)
+        , flat(flat){
+        this->numVertices = grid->getLocalIndexSize();
+        this->locality = static_cast<uint32_t>(grid->getBlockIndex() >> BLOCK_INDEX_SHIFT);
+        this->arcMap.setEmpty(nullptr);
+        VertexStore* store = grid->getVertexStore();
+        this->swept.init(this->numVertices, grid->getBlockIndex(), store);
+        this->UF.init(this->numVertices, grid->getBlockIndex(), store);
+        this->residency = store->outOfCore() ? store : nullptr;
+        store->evictAll();
+    }
+
+    // the arcs and bodies are released in bulk, the boundary nodes go back to nodePool before it is freed
+    ~SweepEngine(){
+        this->arcPool.release();
+        this->bodyPool.release();
+    }
+
+    // the arcs before the bodies, as in the destructor; then all boundary nodes are back in nodePool
+    void reset(ShardWriter* writer){
+        this->writer = writer;
+        this->arcMap.clear();
+        this->arcPool.reset();
+        this->bodyPool.reset();
+        this->nodePool.reset();
+        this->swept.reset();
+        this->UF.reset();
+        this->trunk.store(false);
+        if (this->residency != nullptr)
+            this->residency->evictAll();
+    }
+
+    void markSwept(const std::vector<uint64_t>& minima){
+        for (uint64_t m : minima)
+            this->swept.store(m, m);
+    }
+
+    void startSweep(uint64_t v, bool leaf){
+        // Fetch Arc
+        Arc<Grid, Id>* arc;
+        fetchCreateArc(arc, v);
+
+        std::vector<std::pair<uint32_t, std::vector<uint64_t>>> handovers;
+        {
+            std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+            arc->body->sweeping = true;
+            handovers.swap(arc->body->handovers);
+            for (const std::pair<uint32_t, std::vector<uint64_t>>& handover : handovers){
+                if (handover.first != this->locality)
+                    ++arc->body->deficit;
+            }
+        }
+
+        this->swept.store(v, v);
+
+        // the parts of the children on this locality are merged here, the other localities are told to do the same
+        const uint64_t saddleIndex = this->grid->toGlobalIndex(v);
+        const double saddleValue = this->grid->getValueAsDouble(v);
+        for (const std::pair<uint32_t, std::vector<uint64_t>>& handover : handovers){
+            if (handover.first == this->locality)
+                handOver(arc, handover.second, [this, v](uint64_t c){ return this->grid->lessLocal(c, v); });
+            else
+                this->owner->sendStartPart(handover.first, v, saddleIndex, saddleValue, handover.second);
+        }
+
+        arc->body->boundary.remove(v); // a saddle is part of the boundary of its children
+        arc->body->augmentation.sweep(v); // also add saddle/local minimum to augmentation
+
+        arc->body->state = State::active;
+
+        for (int i = 0; (i < 6); i++){
+            const uint64_t n = this->grid->getNeighbor(v, i);
+            // 如果邻居在其他 locality 上，且 no be swept
+            if (this->grid->isGhost(n) && (this->swept.load(n) == INVALID_VERTEX)){
+                sendLater(arc, v, v, n);
+            }
+            // 否则直接将邻居放入 queue 中
+            else if (n != INVALID_VERTEX) {
+                arc->body->queue.push(n);
+            }
+        }
+
+        // 正式开始处理本地的 sweep
+        runPart(arc, v);
+    }
+
+    void continueLocalSweep(uint64_t v){
+        Arc<Grid, Id>* arc;
+        fetchCreateArc(arc, v);
+        {
+            std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+            if (arc->body->sweeping)
+                return;
+            arc->body->sweeping = true;
+        }
+        runPart(arc, v);
+    }
+
+    void continueSweep(uint64_t arcId, uint32_t from, const std::vector<uint64_t>& vertices){
+        Arc<Grid, Id>* arc;
+        fetchCreateArc(arc, arcId);
+
+        std::vector<uint64_t> local(vertices.size());
+        for (size_t i = 0; i < vertices.size(); ++i)
+            local[i] = this->grid->fromGlobalIndex(vertices[i]);
+
+        bool acknowledgeNow;
+        bool run;
+        {
+            std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+            acknowledgeNow = !engage(arc, arcId, from);
+            arc->body->queue.post(std::move(local));
+            run = !arc->body->sweeping;
+            arc->body->sweeping = true;
+        }
+        if (acknowledgeNow)
+            this->owner->sendAcknowledge(from, arcId, std::vector<BoundaryReport>());
+        if (run)
+            runPart(arc, arcId);
+    }
+
+    void acknowledge(uint64_t arcId, const std::vector<BoundaryReport>& reports){
+        Arc<Grid, Id>* arc = this->arcMap.load(arcId);
+        {
+            std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+            --arc->body->deficit;
+            mergeReports(arc->body->reports, reports);
+        }
+        onIdle(arc, arcId);
+    }
+
+    /*
+     * Hands the arc child over to its saddle: child becomes a child of the saddle's arc. The child that completes
+     * the lower neighborhood of the saddle starts its sweep.
+     */
+    void finishChild(uint64_t saddle, uint64_t child, const std::vector<uint32_t>& parts){
+        Arc<Grid, Id>* parent;
+        fetchCreateArc(parent, saddle);
+
+        bool ready = false;
+        {
+            std::lock_guard<hpx::lcos::local::mutex> lock(parent->body->lock);
+            this->UF.store(child, saddle);
+            parent->body->children.push_back(child);
+            for (uint32_t part : parts)
+                handoverList(parent->body->handovers, part).push_back(child);
+
+            if (parent->body->state == State::not_start && this->touch(saddle, saddle)){
+                parent->body->state = State::active;
+                ready = true;
+            }
+        }
+
+        if (ready){
+            // count the saddle sweep before the child is released so the counter never drops to zero in between
+            this->owner->countSweeps(1);
+            this->owner->launchSaddleSweep(saddle);
+        }
+    }
+
+    void startPart(uint64_t arcId, uint64_t saddleIndex, double saddleValue, const std::vector<uint64_t>& children){
+        Arc<Grid, Id>* arc;
+        fetchCreateArc(arc, arcId);
+
+        const uint32_t from = static_cast<uint32_t>(arcId >> BLOCK_INDEX_SHIFT);
+        bool acknowledgeNow;
+        bool run;
+        {
+            std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+            acknowledgeNow = !engage(arc, arcId, from);
+            arc->body->saddleIndex = saddleIndex;
+            arc->body->saddleValue = saddleValue;
+            for (uint64_t child : children){
+                this->UF.store(child, arcId);
+                arc->body->pendingChildren.push_back(child);
+            }
+            run = !arc->body->sweeping;
+            arc->body->sweeping = true;
+        }
+        if (acknowledgeNow)
+            this->owner->sendAcknowledge(from, arcId, std::vector<BoundaryReport>());
+        if (run)
+            runPart(arc, arcId);
+    }
+
+    void startTrunk(){
+        this->trunk.store(true);
+    }
+
+    // the dangling saddles, whose sweeps would have waited for the trunk, and the lowest arc of the trunk
+    std::vector<TrunkArc> collectTrunk(){
+        std::vector<TrunkArc> result;
+        this->arcMap.forEach([this, &result](uint64_t id, Arc<Grid, Id>* arc){
+            if (arc != nullptr && this->grid->isLocal(id) && arc->saddle == INVALID_VERTEX)
+                result.push_back(TrunkArc{id, this->grid->toGlobalIndex(id), this->grid->getValueAsDouble(id), arc->body->children});
+        });
+        return result;
+    }
+
+    /*
+     * Above the last saddle that a sweep has reached, the merge tree is a single path: every arc i of the trunk
+     * ends at arc i + 1. The vertices above a saddle move up the path as in handOver(), the vertices that no
+     * sweep has reached go to the highest arc of the trunk that starts below them.
+     */
+    void buildTrunk(const std::vector<TrunkArc>& trunk){
+        if (trunk.empty())
+            return;
+
+        std::vector<Arc<Grid, Id>*> parts(trunk.size());
+        for (uint64_t i = 0; i < trunk.size(); ++i){
+            fetchCreateArc(parts[i], trunk[i].arc);
+            parts[i]->saddle = (i + 1 < trunk.size()) ? trunk[i + 1].arc : INVALID_VERTEX;
+            if (this->grid->isLocal(trunk[i].arc))
+                parts[i]->body->state = State::inactive;
+            else {
+                parts[i]->body->saddleIndex = trunk[i].vertex;
+                parts[i]->body->saddleValue = trunk[i].value;
+            }
+        }
+
+        for (uint64_t i = 0; i < trunk.size(); ++i){
+            const TrunkArc& start = trunk[i];
+            auto below = [this, &start](uint64_t c){ return this->belowTrunk(c, start); };
+
+            std::vector<Augmentation<Grid>> inherited;
+            for (uint64_t c : start.children){
+                Arc<Grid, Id>* child = this->arcMap.load(c);
+                if (child == nullptr)
+                    continue;
+                child->saddle = start.arc;
+                inherited.push_back(child->body->augmentation.heritage(below));
+                writePart(child, c);
+            }
+            if (i > 0)
+                inherited.push_back(parts[i - 1]->body->augmentation.heritage(below));
+            parts[i]->body->augmentation.inherit(inherited);
+        }
+
+        const uint64_t numChunks = std::max<uint64_t>(1, hpx::get_num_worker_threads());
+        const uint64_t chunkSize = (this->numVertices + numChunks - 1) / numChunks;
+        hpx::for_loop(hpx::execution::par, static_cast<uint64_t>(0), numChunks, [&](uint64_t c){
+            // (index in trunk, vertex)
+            std::vector<std::pair<uint64_t, uint64_t>> found;
+            const uint64_t end = std::min(this->numVertices, (c + 1) * chunkSize);
+            for (uint64_t i = c * chunkSize; i < end; ++i){
+                const uint64_t v = i | this->grid->getBlockIndex();
+                if (this->grid->isGhost(v) || this->swept.loadLocal(v) != INVALID_VERTEX)
+                    continue;
+
+                // the first arc of the trunk that starts above v, v belongs to the one before
+                const auto above = std::partition_point(trunk.begin(), trunk.end(), [this, v](const TrunkArc& t){ return !this->belowTrunk(v, t); });
+                const uint64_t t = (above == trunk.begin()) ? 0 : (above - trunk.begin() - 1);
+                this->swept.store(v, trunk[t].arc);
+                found.emplace_back(t, v);
+            }
+
+            std::sort(found.begin(), found.end());
+            for (uint64_t j = 0; j < found.size();){
+                Arc<Grid, Id>* part = parts[found[j].first];
+                std::lock_guard<hpx::lcos::local::mutex> lock(part->body->lock);
+                const uint64_t t = found[j].first;
+                for (; j < found.size() && found[j].first == t; ++j)
+                    part->body->augmentation.sweep(found[j].second);
+            }
+        });
+    }
+
+    // arcs that started on this locality
+    uint64_t countArcs(){
+        uint64_t numArcs = 0;
+        this->arcMap.forEach([this, &numArcs](uint64_t id, Arc<Grid, Id>* arc){
+            if (arc != nullptr && this->grid->isLocal(id))
+                ++numArcs;
+        });
+        return numArcs;
+    }
+
+    // the parts of the root, of the trunk and of arcs that never got a parent
+    void writeParts(){
+        if (this->writer == nullptr)
+            return;
+        this->arcMap.forEach([this](uint64_t id, Arc<Grid, Id>* arc){
+            if (arc != nullptr)
+                writePart(arc, id);
+        });
+    }
+
+    std::vector<ArcRecord> collectArcs(){
+        std::vector<ArcRecord> result;
+        this->arcMap.forEach([this, &result](uint64_t id, Arc<Grid, Id>* arc){
+            if (arc != nullptr && this->grid->isLocal(id)){
+                const uint64_t saddle = (arc->saddle == INVALID_VERTEX) ? INVALID_VERTEX : this->grid->toGlobalIndexOf(arc->saddle);
+                result.push_back(ArcRecord{this->grid->toGlobalIndex(id), saddle, INVALID_VERTEX});
+            }
+        });
+        std::sort(result.begin(), result.end(), [](const ArcRecord& a, const ArcRecord& b){ return a.extremum < b.extremum; });
+        return result;
+    }
+
+    /*
+     * A vertex belongs to the arc that swept it unless it lies above the saddle of that arc, then it belongs to the
+     * parent, and so on up: the same vertices that handOver() moves up the augmentation. The saddle of the part of
+     * an arc on this locality is the extremum of the part of its parent here, whose start is known locally (for
+     * remote parts from startPart() or buildTrunk()).
+     * Only one slab of about SLAB_BYTES of labels is held at a time, at least one plane.
+     */
+    void segmentation(const glm::uvec3& begin, const glm::uvec3& size, const std::function<void(const uint64_t*, uint64_t)>& out){
+        struct Node {
+            uint64_t label;
+            // start of the arc, as in belowTrunk()
+            double value;
+            uint64_t index;
+            int64_t parent;
+        };
+
+        std::vector<Node> nodes;
+        std::unordered_map<uint64_t, int64_t> nodeOf;
+        std::vector<uint64_t> saddles;
+        this->arcMap.forEach([&](uint64_t id, Arc<Grid, Id>* arc){
+            if (arc == nullptr)
+                return;
+            Node node;
+            node.label = this->grid->toGlobalIndexOf(id);
+            node.value = this->grid->isLocal(id) ? this->grid->getValueAsDouble(id) : arc->body->saddleValue;
+            node.index = this->grid->isLocal(id) ? node.label : arc->body->saddleIndex;
+            node.parent = -1;
+            nodeOf[id] = nodes.size();
+            nodes.push_back(node);
+            saddles.push_back(arc->saddle);
+        });
+        for (uint64_t n = 0; n < nodes.size(); ++n){
+            auto it = nodeOf.find(saddles[n]);
+            if (it != nodeOf.end())
+                nodes[n].parent = it->second;
+        }
+
+        const uint64_t planeSize = static_cast<uint64_t>(size.x) * size.y;
+        const uint32_t slabPlanes = static_cast<uint32_t>(std::max<uint64_t>(1, std::min<uint64_t>(size.z, SLAB_BYTES / (planeSize * sizeof(uint64_t)))));
+        std::vector<uint64_t> labels(slabPlanes * planeSize);
+        for (uint32_t zBegin = 0; zBegin < size.z; zBegin += slabPlanes){
+            const uint32_t planes = std::min(slabPlanes, size.z - zBegin);
+            std::fill(labels.begin(), labels.begin() + planes * planeSize, INVALID_VERTEX);
+            // one task per row
+            hpx::for_loop(hpx::execution::par, static_cast<uint64_t>(0), static_cast<uint64_t>(planes) * size.y, [&](uint64_t row){
+                const uint32_t z = begin.z + zBegin + static_cast<uint32_t>(row / size.y);
+                const uint32_t y = begin.y + static_cast<uint32_t>(row % size.y);
+                // neighboring vertices are mostly swept by the same arc
+                uint64_t lastArc = INVALID_VERTEX;
+                int64_t lastNode = -1;
+                for (uint32_t x = 0; x < size.x; ++x){
+                    const uint64_t v = this->grid->toLocalVertex(begin.x + x, y, z);
+                    const uint64_t arc = this->swept.loadLocal(v);
+                    if (arc != lastArc){
+                        auto it = nodeOf.find(arc);
+                        lastArc = arc;
+                        lastNode = (it == nodeOf.end()) ? -1 : it->second;
+                    }
+                    if (lastNode < 0)
+                        continue;
+
+                    const double value = this->grid->getValueAsDouble(v);
+                    const uint64_t index = this->grid->toGlobalIndex(v);
+                    int64_t n = lastNode;
+                    while (nodes[n].parent >= 0){
+                        const Node& parent = nodes[nodes[n].parent];
+                        if (value < parent.value || (value == parent.value && index < parent.index))
+                            break;
+                        n = nodes[n].parent;
+                    }
+                    labels[row * size.x + x] = nodes[n].label;
+                }
+            });
+            out(labels.data(), planes * planeSize);
+        }
+        // a pass over the whole block
+        if (this->residency != nullptr && size == this->grid->getBlockSize())
+            this->residency->evictAll();
+    }
+
+    void reportAllocations(uint32_t index){
+        const std::string tag = std::to_string(index);
+        Log().tag(tag) << "Arcs: " << this->arcPool.getStats().allocations.load() << " allocations, "
+            << this->arcPool.getStats().bytes.load() << " bytes";
+        Log().tag(tag) << "Arc bodies: " << this->bodyPool.getStats().allocations.load() << " allocations, "
+            << this->bodyPool.getStats().bytes.load() << " bytes";
+        Log().tag(tag) << "Boundary nodes: " << this->nodePool.getStats().allocations.load() << " allocations, "
+            << this->nodePool.getStats().bytes.load() << " bytes";
+
+        uint64_t augmented = 0;
+        this->arcMap.forEach([&augmented](uint64_t id, Arc<Grid, Id>* arc){
+            if (arc != nullptr)
+                augmented += arc->body->augmentation.size();
+        });
+        Log().tag(tag) << "Augmentation: " << augmented << " vertices, " << byteString(augmented * sizeof(uint64_t));
+        if (this->residency != nullptr)
+            Log().tag(tag) << "Out of core: " << byteString(this->residency->getFileSize()) << " file, "
+                << this->residency->getLoads() << " groups loaded, " << this->residency->getEvictions() << " evicted";
+    }
+
+private:
+    // tests/touch_bench.cpp prepares swept and UF and times touch()
+    template <typename G, typename I>
+    friend struct TouchBenchmark;
+
+    /*
+     * Sweeps the part of arc v on this locality until its queue and inbox are empty, then sends the remaining
+     * batches. The caller has set sweeping and so owns the queue.
+     */
+    void runPart(Arc<Grid, Id>* arc, uint64_t v){
+        while (true) {
+            std::vector<uint64_t> children;
+            {
+                std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+                children.swap(arc->body->pendingChildren);
+            }
+            if (!children.empty()){
+                const uint64_t saddleIndex = arc->body->saddleIndex;
+                const double saddleValue = arc->body->saddleValue;
+                handOver(arc, children, [this, saddleIndex, saddleValue](uint64_t c){
+                    const double value = this->grid->getValueAsDouble(c);
+                    return value < saddleValue || (value == saddleValue && this->grid->toGlobalIndex(c) < saddleIndex);
+                });
+            }
+
+            sweepLocal(arc, v);
+            flush(arc, v);
+
+            std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+            // children handed over after the trunk has started still leave their vertices above the saddle here
+            if ((this->trunk.load(std::memory_order_relaxed) || arc->body->queue.empty()) && arc->body->pendingChildren.empty()){
+                arc->body->sweeping = false;
+                break;
+            }
+        }
+        onIdle(arc, v);
+    }
+
+    /* sweep loop */
+    void sweepLocal(Arc<Grid, Id>* arc, uint64_t v){
+        // out of core: the group of the vertices swept last
+        uint64_t group = INVALID_VERTEX;
+        while(!arc->body->queue.empty()){
+            // trunk skip: the rest of this arc is left to buildTrunk()
+            if (this->trunk.load(std::memory_order_relaxed))
+                break;
+
+            uint64_t c = arc->body->queue.pop();
+            if(c == INVALID_VERTEX)break;
+
+            if (this->residency != nullptr && ((c & VERTEX_INDEX_MASK) >> VertexStore::GROUP_SHIFT) != group){
+                group = (c & VERTEX_INDEX_MASK) >> VertexStore::GROUP_SHIFT;
+                this->residency->touch(c & VERTEX_INDEX_MASK);
+            }
+
+            // swept by v on the locality that owns c
+            if(this->grid->isGhost(c)){
+                arc->body->boundary.remove(c);
+                this->swept.store(c, v);
+
+                uint64_t neighbors[6];
+                uint32_t numNeighbors = this->grid->getNeighbors(c, neighbors);
+
+                for (uint64_t i = 0; (i < numNeighbors); i++){
+                    if (neighbors[i] != INVALID_VERTEX && !this->grid->isGhost(neighbors[i]) && (this->swept.load(neighbors[i]) == INVALID_VERTEX)){
+                        this->prefetch(neighbors[i]);
+                        arc->body->queue.push(neighbors[i]);
+                    }
+                }
+                continue;
+            }
+
+            // if can be swept
+            if(this->touch(c, v)){
+                arc->body->boundary.remove(c); // remove from boundary
+                this->swept.store(c, v);     // put into our augmentation and mark as swept
+                arc->body->augmentation.sweep(c);
+
+                uint64_t neighbors[6];
+                uint32_t numNeighbors = this->grid->getNeighbors(c, neighbors);
+
+                for (uint64_t i = 0; (i < numNeighbors); i++){
+                    if (this->grid->isGhost(neighbors[i]) && (this->swept.load(neighbors[i]) == INVALID_VERTEX)){
+                        sendLater(arc, v, c, neighbors[i]);
+                    } else if (neighbors[i] != INVALID_VERTEX) {
+                        this->prefetch(neighbors[i]);
+                        arc->body->queue.push(neighbors[i]);
+                    }
+                }
+            }
+            // else can not be swept now
+            else{
+                arc->body->boundary.add(c);
+            }
+        } /* end sweep loop */
+    }
+
+    // out of core: the groups of the frontier are loaded before the sweep gets there
+    void prefetch(uint64_t n){
+        if (this->residency != nullptr)
+            this->residency->prefetch(n & VERTEX_INDEX_MASK);
+    }
+
+    /*
+     * Queues c, swept by arc v, for the locality that owns the ghost vertex n next to it.
+     * A vertex next to two ghost vertices of the same block is queued once.
+     */
+    void sendLater(Arc<Grid, Id>* arc, uint64_t v, uint64_t c, uint64_t n){
+        const uint32_t destination = this->grid->getOwnerBlock(this->grid->toGlobalIndex(n));
+        const uint64_t index = this->grid->toGlobalIndex(c);
+
+        std::vector<uint64_t>& batch = handoverList(arc->body->outgoing, destination);
+        if (!batch.empty() && batch.back() == index)
+            return;
+        batch.push_back(index);
+
+        if (batch.size() >= BATCH_SIZE){
+            {
+                std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+                ++arc->body->deficit;
+            }
+            this->owner->sendContinueSweep(destination, v, std::move(batch));
+            batch = std::vector<uint64_t>();
+        }
+    }
+
+    // sends all queued batches of arc v
+    void flush(Arc<Grid, Id>* arc, uint64_t v){
+        std::vector<std::pair<uint32_t, std::vector<uint64_t>>> outgoing;
+        for (std::pair<uint32_t, std::vector<uint64_t>>& batch : arc->body->outgoing){
+            if (!batch.second.empty())
+                outgoing.emplace_back(batch.first, std::move(batch.second));
+            batch.second = std::vector<uint64_t>();
+        }
+        if (outgoing.empty())
+            return;
+
+        {
+            std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+            arc->body->deficit += outgoing.size();
+        }
+        for (std::pair<uint32_t, std::vector<uint64_t>>& batch : outgoing)
+            this->owner->sendContinueSweep(batch.first, v, std::move(batch.second));
+    }
+
+    /*
+     * Called with the lock of the arc held when a message for the part arrives.
+     * @return false if the message has to be acknowledged right away, true if it engaged the part
+     */
+    bool engage(Arc<Grid, Id>* arc, uint64_t arcId, uint32_t from){
+        if (this->grid->isLocal(arcId) || arc->body->engager >= 0)
+            return false;
+        arc->body->engager = static_cast<int32_t>(from);
+        return true;
+    }
+
+    /*
+     * The part of arc v is idle once it does not sweep and all its messages are acknowledged. A remote part then
+     * acknowledges the message that engaged it; on the locality where v started the arc is complete.
+     */
+    void onIdle(Arc<Grid, Id>* arc, uint64_t v){
+        std::vector<BoundaryReport> reports;
+        int32_t engager = -1;
+        {
+            std::lock_guard<hpx::lcos::local::mutex> lock(arc->body->lock);
+            if (arc->body->sweeping || arc->body->deficit != 0)
+                return;
+
+            if (this->grid->isLocal(v)){
+                if (arc->body->finished)
+                    return;
+                arc->body->finished = true;
+                arc->body->state = State::finalizing;
+                reports.swap(arc->body->reports);
+            } else {
+                if (arc->body->engager < 0)
+                    return;
+                engager = arc->body->engager;
+                arc->body->engager = -1;
+                reports.swap(arc->body->reports);
+                reports.push_back(boundaryReport(arc));
+            }
+        }
+
+        if (engager >= 0)
+            this->owner->sendAcknowledge(static_cast<uint32_t>(engager), v, std::move(reports));
+        else
+            finishSweep(arc, v, reports);
+    }
+
+    /*
+     * The saddle of arc v is the smallest boundary vertex over all its parts. Each part on another locality
+     * has reported its boundary minimum. The saddle's locality gets v as a child.
+     */
+    void finishSweep(Arc<Grid, Id>* arc, uint64_t v, const std::vector<BoundaryReport>& reports){
+        BoundaryReport minimum = boundaryReport(arc);
+        std::vector<uint32_t> parts(1, this->locality);
+        for (const BoundaryReport& report : reports){
+            parts.push_back(report.locality);
+            if (report.vertex != INVALID_VERTEX && (minimum.vertex == INVALID_VERTEX || report.value < minimum.value
+                    || (report.value == minimum.value && report.vertex < minimum.vertex)))
+                minimum = report;
+        }
+
+        // the sweep reached the global maximum: v is the root arc
+        if (minimum.vertex == INVALID_VERTEX){
+            arc->body->state = State::inactive;
+            this->owner->countSweeps(-1);
+            return;
+        }
+
+        // the trunk has started: the sweep of v was the last one, its saddle is found by buildTrunk()
+        if (this->trunk.load()){
+            arc->body->state = State::inactive;
+            this->owner->countSweeps(-1);
+            return;
+        }
+
+        const uint64_t saddle = this->grid->toVertexId(minimum.vertex);
+        arc->saddle = saddle;
+        arc->body->state = State::inactive;
+
+        if (this->grid->isLocal(saddle))
+            finishChild(saddle, v, parts);
+        else
+            this->owner->sendFinishChild(static_cast<uint32_t>(saddle >> BLOCK_INDEX_SHIFT), saddle, v, std::move(parts));
+        this->owner->countSweeps(-1);
+    }
+
+    // boundary minimum of the part of an arc on this locality; the lock of the arc or the queue must be held
+    BoundaryReport boundaryReport(Arc<Grid, Id>* arc){
+        BoundaryReport report;
+        report.locality = this->locality;
+        report.seq = ++arc->body->reportSeq;
+        report.vertex = INVALID_VERTEX;
+        report.value = 0.0;
+        if (!arc->body->boundary.empty()){
+            const uint64_t min = arc->body->boundary.min();
+            report.vertex = this->grid->toGlobalIndex(min);
+            report.value = this->grid->getValueAsDouble(min);
+        }
+        return report;
+    }
+
+    // keeps the latest report of every locality
+    static void mergeReports(std::vector<BoundaryReport>& into, const std::vector<BoundaryReport>& from){
+        for (const BoundaryReport& report : from){
+            auto it = std::find_if(into.begin(), into.end(), [&report](const BoundaryReport& r){ return r.locality == report.locality; });
+            if (it == into.end())
+                into.push_back(report);
+            else if (it->seq < report.seq)
+                *it = report;
+        }
+    }
+
+    static std::vector<uint64_t>& handoverList(std::vector<std::pair<uint32_t, std::vector<uint64_t>>>& lists, uint32_t locality){
+        for (std::pair<uint32_t, std::vector<uint64_t>>& list : lists){
+            if (list.first == locality)
+                return list.second;
+        }
+        lists.emplace_back(locality, std::vector<uint64_t>());
+        return lists.back().second;
+    }
+
+    /*
+     * Merges the parts of the children on this locality into arc: their boundaries, with the vertices on two
+     * boundaries queued again, and the vertices of their augmentations above the saddle (below(c) is false).
+     */
+    template <typename Below>
+    void handOver(Arc<Grid, Id>* arc, const std::vector<uint64_t>& children, Below below){
+        std::vector<Augmentation<Grid>> inherited;
+        for (uint64_t c : children){
+            Arc<Grid, Id>* child = this->arcMap.load(c);
+            if (child == nullptr)
+                continue;
+            child->saddle = arc->extremum;
+            arc->body->queue.push(arc->body->boundary.intersect(child->body->boundary));
+            arc->body->boundary.unite(child->body->boundary);
+            inherited.push_back(child->body->augmentation.heritage(below));
+            writePart(child, c);
+        }
+        arc->body->augmentation.inherit(inherited);
+    }
+
+    /*
+     * Streams the augmentation of the part of arc v on this locality to the shard. Called once the part is final:
+     * its vertices above the saddle have been handed over to the parent.
+     */
+    void writePart(Arc<Grid, Id>* arc, uint64_t v){
+        if (this->writer == nullptr || !this->writer->writesAugmentation() || arc->body->written)
+            return;
+        arc->body->written = true;
+
+        std::vector<uint64_t> vertices = arc->body->augmentation.getVertices();
+        for (uint64_t& c : vertices)
+            c = this->grid->toGlobalIndex(c);
+        this->writer->writePart(this->grid->toGlobalIndexOf(v), std::move(vertices));
+    }
+
+    bool fetchCreateArc(Arc<Grid, Id>*& arc, uint64_t v){
+        arc = this->arcMap.load(v);
+        if (arc != nullptr)
+            return false;
+
+        // several sweeps may create the arc at the same time, the first one published wins; the others stay unused
+        // in the arena until it is released
+        Arc<Grid, Id>* created = this->arcPool.create(v, this->bodyPool.create(this->grid, &this->swept, &this->nodePool, !this->flat));
+        if (this->arcMap.compareExchange(v, arc, created)){
+            arc = created;
+            return true;
+        }
+        return false;
+    }
+
+    // is c below the start of the trunk arc t? the order of vertices of different blocks, see TrunkArc
+    bool belowTrunk(uint64_t c, const TrunkArc& t) const {
+        const double value = this->grid->getValueAsDouble(c);
+        return value < t.value || (value == t.value && this->grid->toGlobalIndex(c) < t.vertex);
+    }
+
+    /*
+     * Sweep reaches vertex and checks if it can be swept by going through *all* its smaller neighbors and check if they *all* have already been swept by us
+     */
+    bool touch(uint64_t c, uint64_t v){
+        uint64_t neighbors[6];
+        this->grid->getNeighbors(c, neighbors);
+
+        for (uint64_t& n: neighbors) {
+            if (n != INVALID_VERTEX) {
+                if(this->grid->lessLocal(n, c)){
+                    if(!this->UF.reaches(this->swept.loadLocal(n), v)){
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    TreeConstructor* owner;
+    Grid* grid;
+    ShardWriter* writer;
+    bool flat;
+    // the number of vertices (with ghost) in this locality
+    uint64_t numVertices;
+    // index of this locality, equal to the index of its block
+    uint32_t locality;
+
+    // arenas of the arcs, declared first so that they outlive arcMap; nodePool holds the boundary set nodes
+    NodePool nodePool;
+    ObjectPool<ArcBody<Grid, Id>> bodyPool;
+    ObjectPool<Arc<Grid, Id>> arcPool;
+
+    // Map for each vertex to ID of arc extremum
+    VertexVec<Id> swept; // what vertex has been swept by which saddle/local minimum
+    // Map for starting minima(or saddle) to Arc pointer, only extrema, saddles and parts of remote arcs have an entry
+    SparseVec<Arc<Grid, Id>*> arcMap;
+
+    // Union-find-structure containing child-parent relations
+    VertexVec<Id> UF;
+
+    // trunk skip: set when the last sweep is left, see TreeConstructor::startTrunk
+    std::atomic<bool> trunk{false};
+
+    // the store of swept, UF and the block data if it is out of core, nullptr in core
+    VertexStore* residency = nullptr;
+};
+
+/*
+ * compact: store swept and UF as 32 bit block-local ids. The codes of arcs from other localities follow the
+ * block-local indices (see ForeignIds): at most one per ghost vertex for the arcs that enter the block and one per
+ * saddle above them. Blocks where these do not fit below 2^32 - 1 keep 64 bit ids, the largest 32 bit value marks
+ * an empty slot.
+ */
+template <typename Grid>
+SweepEngineBase* createSweepEngineFor(TreeConstructor* owner, DataManager* data, ShardWriter* writer, const Options& options){
+    Grid* grid = dynamic_cast<Grid*>(data);
+    if (grid == nullptr)
+        return nullptr;
+
+    if (options.compact){
+        const uint64_t ghost = grid->getNumVerticesLocal(true) - grid->getNumVerticesLocal(false);
+        if (grid->getLocalIndexSize() + 2 * ghost < std::numeric_limits<uint32_t>::max())
+            return new SweepEngine<Grid, uint32_t>(owner, grid, writer, options.flat);
+        LogWarning().tag(std::to_string(grid->getBlockIndex() >> BLOCK_INDEX_SHIFT)) << "Block too large for 32 bit vertex ids, using 64 bit";
+    }
+    return new SweepEngine<Grid, uint64_t>(owner, grid, writer, options.flat);
+}
+
+/**
+ * @brief Creates the sweep engine for the value type of the data manager.
+ * @return nullptr if the data manager is no RegularGridManager of one of the value types T, Ts...
+ */
+template <typename T, typename... Ts>
+SweepEngineBase* createSweepEngine(TreeConstructor* owner, DataManager* data, ShardWriter* writer, const Options& options){
+    SweepEngineBase* engine = createSweepEngineFor<RegularGridManager<T>>(owner, data, writer, options);
+    if constexpr (sizeof...(Ts) > 0){
+        if (engine == nullptr)
+            engine = createSweepEngine<Ts...>(owner, data, writer, options);
+    }
+    return engine;
+}
@@ -2,49 +2,89 @@
 
 #include "DistVec.h"
 #include "DataManager.h"
-#include <deque>
 
-#include <hpx/hpx.hpp>
+#include <atomic>
+#include <vector>
 
-/* 可能尝试其他数据结构 #include <boost/heap/fibonacci_heap.hpp> */
+/*
+ * Vertices waiting to be swept by one arc, last in first out.
+ * Only the task that owns the arc calls push(), pop() and empty(), so the stack needs no lock. Other tasks hand
+ * vertices over with post(), which links a batch into a lock-free inbox; the owner moves the inbox onto the stack
+ * once the stack runs empty.
+ */
+template <typename Id>
 class SweepQueue{
 public:
-    SweepQueue(DistVec<uint64_t>* swept):swept(swept), queue(6){
+    SweepQueue(VertexVec<Id>* swept):swept(swept), inbox(nullptr){
 
     }
 
-    // 是否需要加锁保护呢
+    SweepQueue(const SweepQueue&) = delete;
+    SweepQueue& operator=(const SweepQueue&) = delete;
+
+    ~SweepQueue(){
+        Batch* batch = this->inbox.exchange(nullptr, std::memory_order_acquire);
+        while (batch != nullptr) {
+            Batch* next = batch->next;
+            delete batch;
+            batch = next;
+        }
+    }
+
     void push(const uint64_t & target){
-        std::lock_guard<hpx::lcos::local::mutex> lock_(lock);
-        this->queue.push_front(target);
+        this->stack.push_back(target);
     }
 
     void push(const std::vector<uint64_t>& boundaryVertices){
-        std::lock_guard<hpx::lcos::local::mutex> tmplock(lock);
-        for (const uint64_t& c : boundaryVertices) {
-            this->queue.push_front(c);
-        }
+        this->stack.insert(this->stack.end(), boundaryVertices.begin(), boundaryVertices.end());
+    }
+
+    // may be called from any task
+    void post(std::vector<uint64_t> vertices){
+        Batch* batch = new Batch{std::move(vertices), this->inbox.load(std::memory_order_relaxed)};
+        while (!this->inbox.compare_exchange_weak(batch->next, batch, std::memory_order_release, std::memory_order_relaxed))
+            ;
     }
 
-    // TODO: 单纯查询操作是否需要加锁保护
     bool empty() const {
-        // std::lock_guard<hpx::lcos::local::mutex> lock_(lock);
-        return this->queue.empty();
+        return this->stack.empty() && this->inbox.load(std::memory_order_acquire) == nullptr;
     }
 
-    // TODO
+    // the next vertex that is not swept yet, INVALID_VERTEX if there is none
     uint64_t pop(){
-        std::lock_guard<hpx::lcos::local::mutex> tmplock(lock);
-        while (!this->queue.empty()) {
-            uint64_t result = this->queue.front();
-            this->queue.pop_front();
-            if (swept->operator [](result) == INVALID_VERTEX)
-                return result;
+        while (true) {
+            while (!this->stack.empty()) {
+                uint64_t result = this->stack.back();
+                this->stack.pop_back();
+                if (swept->loadLocal(result) == INVALID_VERTEX)
+                    return result;
+            }
+            if (!this->drainInbox())
+                return INVALID_VERTEX;
         }
-        return INVALID_VERTEX;
     }
 private:
-    mutable hpx::lcos::local::mutex lock;
-    DistVec<uint64_t>* swept;
-    std::deque<uint64_t> queue;
-};
\ No newline at end of file
+    struct Batch {
+        std::vector<uint64_t> vertices;
+        Batch* next;
+    };
+
+    // moves all posted batches onto the stack, false if the inbox was empty
+    bool drainInbox(){
+        Batch* batch = this->inbox.exchange(nullptr, std::memory_order_acquire);
+        if (batch == nullptr)
+            return false;
+        while (batch != nullptr) {
+            this->push(batch->vertices);
+            Batch* next = batch->next;
+            delete batch;
+            batch = next;
+        }
+        return true;
+    }
+
+    VertexVec<Id>* swept;
+    // contiguous storage, the top of the stack is the back
+    std::vector<uint64_t> stack;
+    std::atomic<Batch*> inbox;
+};
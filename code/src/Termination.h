@@ -0,0 +1,307 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <hpx/hpx.hpp>
+
+class TreeConstructor;
+
+/**
+ * @brief Detects that the sweeps of all localities have finished, without a central counter.
+ *
+ * Every locality counts the sweep messages it has sent and received, and is active while one of its sweeps runs
+ * or a message is handled. Locality 0 runs waves down a tree of fan-out FANOUT over the localities. A locality
+ * answers a wave once it and its subtree have answered and it is passive, with the sums of the counters of its
+ * subtree. All sweeps are finished when two waves in a row return the same sums and sent equals received:
+ * no message was in flight and no locality was activated between the two waves.
+ * Only the wave messages reach locality 0, a locality that is busy just holds the wave back.
+ *
+ * For trunk skipping locality 0 also runs census waves over the same tree, answered right away, that sum the
+ * arcs that have started and not finished yet. An arc whose saddle is on another locality stays counted until the
+ * saddle's locality has registered it, so every counter only drops once its arc is gone and a census never counts
+ * too few. When a census finds at most one arc and every locality has launched its minima, the remaining sweep is
+ * the trunk, see TreeConstructor::startTrunk. The pause before the next census grows with the arcs still counted,
+ * so the census waves are rare while the trunk is far off and frequent once few arcs are left.
+ *
+ * The components are reused for the timesteps of a series, one round of waves per construction. The wave numbers of
+ * round r start at r << 32, so a census or trunk message of the previous round that arrives late is ignored.
+ */
+class TerminationDetector {
+public:
+    static const uint32_t FANOUT = 8;
+    // pause between two census waves per arc above the trunk, and at most
+    static const uint32_t CENSUS_INTERVAL_US = 1000;
+    static const uint32_t CENSUS_MAX_INTERVAL_US = 64000;
+
+    // sends the wave messages through owner, see TreeConstructor::sendProbe
+    TerminationDetector(TreeConstructor* owner) : owner(owner){}
+
+    // a locality is active from init() until its minima sweeps are launched, so an early wave waits for it
+    void init(uint32_t index, uint32_t numLocalities){
+        this->index = index;
+        this->numLocalities = numLocalities;
+        this->restart(0);
+    }
+
+    // next construction on the same localities, before any of them starts it
+    void restart(uint32_t round){
+        std::lock_guard<hpx::lcos::local::spinlock> lock(this->waveLock);
+        this->firstWave.store(static_cast<uint64_t>(round) << 32);
+        this->active.store(1);
+        this->unfinished.store(1);
+        this->sent.store(0);
+        this->received.store(0);
+        this->open = false;
+        this->lastValid = false;
+        this->waves = 0;
+        this->censusOpen = false;
+        this->launched.store(false);
+        this->finished.store(false);
+    }
+
+    void activate(int64_t n = 1){
+        this->active.fetch_add(n);
+    }
+
+    void deactivate(int64_t n = 1){
+        if (this->active.fetch_sub(n) == n)
+            this->tryReport();
+    }
+
+    // called before a sweep message is sent
+    void countSent(){
+        this->sent.fetch_add(1);
+    }
+
+    // called when a sweep message arrives, the handler is active until it calls deactivate()
+    void countReceived(){
+        this->active.fetch_add(1);
+        this->received.fetch_add(1);
+    }
+
+    // arcs that have started and not finished yet, see TreeConstructor::countSweeps
+    void countUnfinished(int64_t delta){
+        this->unfinished.fetch_add(delta);
+    }
+
+    // the minima of this locality are launched, before that a census must not count the locality as done
+    void minimaLaunched(){
+        this->launched.store(true);
+    }
+
+    // locality 0: starts the first wave
+    void start(){
+        this->probe(this->firstWave.load());
+    }
+
+    // locality 0: starts the census waves
+    void startCensus(){
+        this->census(this->firstWave.load());
+    }
+
+    // a wave of an earlier round
+    bool isStale(uint64_t wave) const {
+        return wave < this->firstWave.load();
+    }
+
+    void probe(uint64_t wave){
+        std::vector<uint32_t> children;
+        {
+            std::lock_guard<hpx::lcos::local::spinlock> lock(this->waveLock);
+            if (this->isStale(wave))
+                return;
+            this->wave = wave;
+            this->open = true;
+            this->waveSent = 0;
+            this->waveReceived = 0;
+            children = this->children();
+            this->pendingChildren = static_cast<uint32_t>(children.size());
+        }
+        for (uint32_t child : children)
+            this->forwardProbe(child, wave);
+        this->tryReport();
+    }
+
+    // sums of the subtree of a child
+    void report(uint64_t wave, uint64_t sent, uint64_t received){
+        {
+            std::lock_guard<hpx::lcos::local::spinlock> lock(this->waveLock);
+            if (!this->open || wave != this->wave)
+                return;
+            this->waveSent += sent;
+            this->waveReceived += received;
+            --this->pendingChildren;
+        }
+        this->tryReport();
+    }
+
+    void census(uint64_t wave){
+        std::vector<uint32_t> children = this->children();
+        {
+            std::lock_guard<hpx::lcos::local::spinlock> lock(this->waveLock);
+            if (this->isStale(wave) || this->finished.load())
+                return;
+            this->censusWave = wave;
+            this->censusOpen = true;
+            this->censusSum = 0;
+            this->censusWaiting = 0;
+            this->censusPending = static_cast<uint32_t>(children.size());
+        }
+        for (uint32_t child : children)
+            this->forwardCensus(child, wave);
+        this->tryCensusReport();
+    }
+
+    // waiting: localities of the subtree that have not launched their minima yet
+    void censusReport(uint64_t wave, int64_t unfinished, uint32_t waiting){
+        {
+            std::lock_guard<hpx::lcos::local::spinlock> lock(this->waveLock);
+            if (!this->censusOpen || wave != this->censusWave)
+                return;
+            this->censusSum += unfinished;
+            this->censusWaiting += waiting;
+            --this->censusPending;
+        }
+        this->tryCensusReport();
+    }
+
+    // children of this locality in the wave tree
+    std::vector<uint32_t> children() const {
+        std::vector<uint32_t> result;
+        for (uint64_t c = uint64_t(this->index) * FANOUT + 1; c <= uint64_t(this->index) * FANOUT + FANOUT && c < this->numLocalities; ++c)
+            result.push_back(static_cast<uint32_t>(c));
+        return result;
+    }
+
+    uint64_t getWaves() const {
+        return this->waves;
+    }
+
+    // all sweeps of this round have finished, set on every locality; no census or trunk start after that
+    void setFinished(){
+        this->finished.store(true);
+    }
+
+    bool isFinished() const {
+        return this->finished.load();
+    }
+
+private:
+    // defined in TreeConstructor.cpp, they only forward to the owner
+    void forwardProbe(uint32_t locality, uint64_t wave);
+    void forwardReport(uint32_t locality, uint64_t wave, uint64_t sent, uint64_t received);
+    void finish();
+    void forwardCensus(uint32_t locality, uint64_t wave);
+    void forwardCensusReport(uint32_t locality, uint64_t wave, int64_t unfinished, uint32_t waiting);
+    // starts the census wave after a pause of pause microseconds
+    void nextCensus(uint64_t wave, uint32_t pause);
+    void startTrunk(uint64_t wave);
+
+    /*
+     * Answers the open wave if the subtree has answered and this locality is passive.
+     * The counters are read before active: a message counted in received has made the locality active before,
+     * so if active is still zero afterwards the handler of that message has finished, and its own sends are
+     * counted too.
+     */
+    void tryReport(){
+        uint64_t wave;
+        uint64_t waveSent;
+        uint64_t waveReceived;
+        {
+            std::lock_guard<hpx::lcos::local::spinlock> lock(this->waveLock);
+            if (!this->open || this->pendingChildren != 0)
+                return;
+
+            const uint64_t sent = this->sent.load();
+            const uint64_t received = this->received.load();
+            if (this->active.load() != 0)
+                return;
+
+            this->open = false;
+            wave = this->wave;
+            waveSent = this->waveSent + sent;
+            waveReceived = this->waveReceived + received;
+        }
+
+        if (this->index != 0){
+            this->forwardReport(static_cast<uint32_t>((this->index - 1) / FANOUT), wave, waveSent, waveReceived);
+            return;
+        }
+
+        ++this->waves;
+        if (this->lastValid && waveSent == waveReceived && waveSent == this->lastSent && waveReceived == this->lastReceived){
+            this->finished.store(true);
+            this->finish();
+            return;
+        }
+        this->lastValid = true;
+        this->lastSent = waveSent;
+        this->lastReceived = waveReceived;
+        this->probe(wave + 1);
+    }
+
+    void tryCensusReport(){
+        uint64_t wave;
+        int64_t sum;
+        uint32_t waiting;
+        {
+            std::lock_guard<hpx::lcos::local::spinlock> lock(this->waveLock);
+            if (!this->censusOpen || this->censusPending != 0)
+                return;
+            this->censusOpen = false;
+            wave = this->censusWave;
+            sum = this->censusSum + this->unfinished.load();
+            waiting = this->censusWaiting + (this->launched.load() ? 0 : 1);
+        }
+
+        if (this->index != 0)
+            this->forwardCensusReport(static_cast<uint32_t>((this->index - 1) / FANOUT), wave, sum, waiting);
+        else if (this->finished.load())
+            return;
+        else if (waiting == 0 && sum <= 1)
+            this->startTrunk(wave);
+        else if (waiting != 0)
+            this->nextCensus(wave + 1, CENSUS_INTERVAL_US);
+        else
+            this->nextCensus(wave + 1, static_cast<uint32_t>(std::min<int64_t>(CENSUS_MAX_INTERVAL_US, (sum - 1) * CENSUS_INTERVAL_US)));
+    }
+
+    TreeConstructor* owner;
+    uint32_t index = 0;
+    uint32_t numLocalities = 1;
+
+    // running sweeps and message handlers of this locality
+    std::atomic<int64_t> active{1};
+    std::atomic<int64_t> unfinished{1};
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> received{0};
+    // number of the first wave of the current round
+    std::atomic<uint64_t> firstWave{0};
+
+    // state of the current wave, protected by waveLock
+    hpx::lcos::local::spinlock waveLock;
+    uint64_t wave = 0;
+    bool open = false;
+    uint32_t pendingChildren = 0;
+    uint64_t waveSent = 0;
+    uint64_t waveReceived = 0;
+
+    // locality 0 only: sums of the previous wave
+    bool lastValid = false;
+    uint64_t lastSent = 0;
+    uint64_t lastReceived = 0;
+    uint64_t waves = 0;
+    std::atomic<bool> launched{false};
+    std::atomic<bool> finished{false};
+
+    // state of the current census wave, protected by waveLock
+    uint64_t censusWave = 0;
+    bool censusOpen = false;
+    uint32_t censusPending = 0;
+    int64_t censusSum = 0;
+    uint32_t censusWaiting = 0;
+};
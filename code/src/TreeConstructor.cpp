@@ -1,10 +1,14 @@
 #include "TreeConstructor.h"
 #include <boost/algorithm/string.hpp>
+#include <chrono>
 #include <cstdint>
+#include <memory>
+#include <numeric>
 
 #include "DataManager.h"
 #include "Log.h"
 #include "RawManager.h"
+#include "SweepEngine.h"
 #include "Value.h"
 
 HPX_REGISTER_COMPONENT_MODULE();
@@ -16,14 +20,74 @@ HPX_REGISTER_COMPONENT(TreeConstructor_type, TreeConstructor);
 // HPX_REGISTER_ACTION(init_action);
 
 HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::init_action, treeConstructor_init_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::exchangeHalo_action, treeConstructor_exchangeHalo_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::receiveHalo_action, treeConstructor_receiveHalo_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::loadTimestep_action, treeConstructor_loadTimestep_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::dataChanged_action, treeConstructor_dataChanged_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::beginTimestep_action, treeConstructor_beginTimestep_action);
 HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::construct_action, treeConstructor_construct_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::planLayout_action, treeConstructor_planLayout_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::sampleCosts_action, treeConstructor_sampleCosts_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::fingerprint_action, treeConstructor_fingerprint_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::openCache_action, treeConstructor_openCache_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::storeCache_action, treeConstructor_storeCache_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::stats_action, treeConstructor_stats_action);
 HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::startSweep_action, treeConstructor_startSweep_action);
 HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::continueLocalSweep_action, treeConstructor_continueLocalSweep_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::continueSweep_action, treeConstructor_continueSweep_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::acknowledge_action, treeConstructor_acknowledge_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::finishChild_action, treeConstructor_finishChild_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::startPart_action, treeConstructor_startPart_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::probe_action, treeConstructor_probe_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::probeReport_action, treeConstructor_probeReport_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::terminate_action, treeConstructor_terminate_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::census_action, treeConstructor_census_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::censusReport_action, treeConstructor_censusReport_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::startTrunk_action, treeConstructor_startTrunk_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::collectTrunk_action, treeConstructor_collectTrunk_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::buildTrunk_action, treeConstructor_buildTrunk_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::writeShard_action, treeConstructor_writeShard_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::findArcs_action, treeConstructor_findArcs_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::writeVtk_action, treeConstructor_writeVtk_action);
+HPX_REGISTER_ACTION(TreeConstructor_type::wrapped_type::vtkLabels_action, treeConstructor_vtkLabels_action);
 
-void TreeConstructor::init(const std::vector<hpx::id_type>& treeConstructors, const std::string& input, const Options& options){
+/*
+ * Adds the time until it goes out of scope to a busy time counter.
+ */
+class BusyTimer{
+public:
+    explicit BusyTimer(std::atomic<uint64_t>& busy)
+        : busy(busy)
+        , start(std::chrono::steady_clock::now()){}
+
+    ~BusyTimer(){
+        this->busy += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start).count();
+    }
+
+private:
+    std::atomic<uint64_t>& busy;
+    std::chrono::steady_clock::time_point start;
+};
+
+TreeConstructor::~TreeConstructor(){
+    // the engine releases the arc arenas, it only refers to the grid
+    delete this->engine;
+    delete this->writer;
+    delete this->dataManager;
+    delete this->cache;
+}
+
+void TreeConstructor::init(const std::vector<hpx::id_type>& treeConstructors, const std::string& input, const Options& options, const BlockLayout& layout){
 
     this->options = options;
 
+    // the entries of the other components were not all valid, this run computes and stores the result
+    delete this->cache;
+    this->cache = nullptr;
+    this->step = 0;
+    this->blockChanged = true;
+    this->reuse = false;
+
     // Store list of tree constructor components and determine index of this component
     this->treeConstructors = treeConstructors;
     for (uint32_t i = 0; i < this->treeConstructors.size(); ++i) {
@@ -34,261 +98,737 @@ void TreeConstructor::init(const std::vector<hpx::id_type>& treeConstructors, co
     }
 
     /* load data */
-    if(boost::algorithm::ends_with(input, ".mhd")){
-        if(boost::algorithm::ends_with(input, "uint8.mhd")){
-            this->dataManager = new RawManager<char>(input);
+    try {
+        if(boost::algorithm::ends_with(input, ".mhd")){
+            this->dataManager = createRawManager(input);
         }
-        // TODO: 补充其他类型
-    }
 
-    if(this->dataManager){
-        this->dataManager->init(this->index, this->treeConstructors.size());
+        if(this->dataManager){
+            this->dataManager->init(this->index, this->treeConstructors.size(), layout, !this->options.halo, this->options.bricked,
+                                    this->options.scratch, this->options.memoryBudget);
+            // halo: the ranks need the ghost layer, see exchangeHalo()
+            if (this->options.halo){
+                this->haloPending = this->dataManager->countHaloSources();
+                if (this->haloPending == 0)
+                    this->haloReceived.set();
+            } else {
+                this->completeData();
+            }
+        }
+        else{
+            throw std::runtime_error("Unknown file format: " + input);
+        }
+    } catch (const std::exception& e) {
+        // main reports the error and stops, there is no block to construct
+        LogError().tag(std::to_string(this->index)) << e.what();
+        delete this->dataManager;
+        this->dataManager = nullptr;
+        throw;
     }
-    else{
-        LogError() << "Error: unknow file format\n";
-        return ;
+
+    /* open the shard, the parts are written while the sweeps run; cache: into the cache, copied to the output */
+    if (!this->options.output.empty() || !this->options.cache.empty()){
+        const std::string prefix = this->options.cache.empty() ? this->options.stepPrefix(this->options.output, 0) : cachePrefix(this->options.cache, this->cacheKey) + ".tmp";
+        try {
+            this->writer = new ShardWriter(prefix, this->index, this->options.augmentation && !this->options.flat);
+        } catch (const std::exception& e) {
+            LogError().tag(std::to_string(this->index)) << e.what();
+            throw;
+        }
     }
 
     /* init data structure */
+    this->engine = createSweepEngine<uint8_t, int8_t, uint16_t, int16_t, uint32_t, int32_t, float, double>(this, this->dataManager, this->writer, this->options);
+    if (this->engine == nullptr){
+        throw std::runtime_error("Unsupported grid type: " + input);
+    }
     this->numMinima = 0;
-    this->numVertices = this->dataManager->getNumVerticesLocal(true);
-    this->arcMap.init(this->numVertices, nullptr, this->dataManager);
-    this->sweeps.store(0);
-    this->swept.init(this->numVertices, INVALID_VERTEX, this->dataManager);
-    this->UF.init(this->numVertices, INVALID_VERTEX, this->dataManager);
+    this->termination.init(this->index, this->treeConstructors.size());
+}
+
+/*
+ * Every block knows the layout of all blocks, so it sends the parts of the others' ghost layers without being
+ * asked, and knows how many parts it receives. init() has allocated the blocks of all components before.
+ */
+void TreeConstructor::exchangeHalo(){
+    hpx::chrono::high_resolution_timer timer;
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> parts = this->dataManager->collectHalo();
+    uint64_t bytes = 0;
+    for (std::pair<uint32_t, std::vector<uint8_t>>& part : parts){
+        bytes += part.second.size();
+        hpx::apply(TreeConstructor::receiveHalo_action(), this->treeConstructors[part.first], this->index, std::move(part.second));
+    }
+    this->haloReceived.wait();
+    Log().tag(std::to_string(this->index)) << "Halo: " << parts.size() << " parts, " << byteString(bytes) << " sent, " << timer.elapsed() << " s";
+
+    this->completeData();
+}
+
+void TreeConstructor::receiveHalo(uint32_t from, const std::vector<uint8_t>& values){
+    this->dataManager->insertHalo(from, values);
+    if (--this->haloPending == 0)
+        this->haloReceived.set();
+}
+
+void TreeConstructor::completeData(){
+    if (this->options.timesteps > 0){
+        std::vector<uint64_t> hashes = this->dataManager->hashRows();
+        this->changedRows.assign(hashes.size(), 1);
+        uint64_t numChanged = hashes.size();
+        if (this->step > 0){
+            numChanged = 0;
+            for (uint64_t r = 0; r < hashes.size(); ++r){
+                this->changedRows[r] = (hashes[r] != this->rowHashes[r]);
+                numChanged += this->changedRows[r];
+            }
+            Log().tag(std::to_string(this->index)) << "Timestep " << this->step << ": " << numChanged << " of " << hashes.size() << " rows changed";
+        }
+        this->blockChanged = (numChanged > 0);
+        this->rowHashes.swap(hashes);
+    }
+
+    // the ranks of an unchanged block are still valid
+    if (this->options.rankorder && this->blockChanged){
+        hpx::chrono::high_resolution_timer timer;
+        this->dataManager->computeRanks();
+        Log().tag(std::to_string(this->index)) << "Rank order: " << timer.elapsed() << " s";
+    }
+}
+
+/*
+ * The components, the decomposition and all arrays stay, only the values of the block are read again.
+ */
+void TreeConstructor::loadTimestep(const std::string& input, uint32_t step){
+    hpx::chrono::high_resolution_timer timer;
+    this->step = step;
+    this->dataManager->loadTimestep(input, !this->options.halo);
+    Log().tag(std::to_string(this->index)) << "Timestep " << step << ": " << timer.elapsed() << " s";
+
+    if (this->options.halo){
+        this->haloReceived.reset();
+        this->haloPending = this->dataManager->countHaloSources();
+        if (this->haloPending == 0)
+            this->haloReceived.set();
+    } else {
+        this->completeData();
+    }
+}
+
+bool TreeConstructor::dataChanged(){
+    return this->blockChanged;
+}
+
+/*
+ * The arenas, the sweep arrays and the hash tables of the engine keep their memory for the new sweeps.
+ */
+void TreeConstructor::beginTimestep(bool reuse){
+    this->reuse = reuse;
+    this->busyTime = 0;
+    this->termination.restart(this->step);
+    this->done.reset();
+    this->trunkBuilt.reset();
+    if (reuse)
+        return;
+
+    delete this->writer;
+    this->writer = nullptr;
+    if (!this->options.output.empty()){
+        try {
+            this->writer = new ShardWriter(this->options.stepPrefix(this->options.output, this->step), this->index, this->options.augmentation && !this->options.flat);
+        } catch (const std::exception& e) {
+            LogError().tag(std::to_string(this->index)) << e.what();
+        }
+    }
+    this->engine->reset(this->writer);
+    this->arcTable.clear();
 }
 
 /*
  * @return 
  */
 uint64_t TreeConstructor::construct(){
+    if (this->cache != nullptr){
+        Log().tag(std::to_string(this->index)) << "Cache: " << this->blockStats.arcs << " arcs";
+        return this->blockStats.arcs;
+    }
+
+    // timesteps: no block has changed, the tree of the previous timestep is the tree of this one
+    if (this->reuse){
+        Log().tag(std::to_string(this->index)) << "Timestep " << this->step << ": unchanged, " << this->blockStats.arcs << " arcs";
+        this->blockStats.sweeps = 0.0;
+        return this->blockStats.arcs;
+    }
+
     hpx::chrono::high_resolution_timer timer;
-    /* search local minima */
-    std::vector<uint64_t> minimaList = this->dataManager->getLocalMinima();
-    this->numMinima = minimaList.size();
-    LogInfo() << minimaList.size();
-    
-    // TODO: process minimum
-    for(uint64_t m: minimaList){
-        // hpx::apply(this->executor_start_sweeps, TreeConstructor::startSweep_action(), this->get_id(), v, true);
+    /* search local minima; timesteps: an unchanged block keeps those of the previous timestep, a changed one
+       searches again only next to its changed rows */
+    if (this->blockChanged && this->step > 0 && this->options.timesteps > 0)
+        this->minima = this->dataManager->updateLocalMinima(this->minima, this->changedRows);
+    else if (this->blockChanged)
+        this->minima = this->dataManager->getLocalMinima();
+    this->numMinima = this->minima.size();
+    LogInfo() << this->minima.size();
+    this->blockStats.vertices = this->dataManager->getNumVerticesLocal(false);
+    this->blockStats.minima = this->minima.size();
+
+    // Every minimum is a running sweep from the start; saddle sweeps are counted when they are launched.
+    // Minima are marked as swept up front so that a neighboring sweep can not grab a minimum whose own
+    // sweep has not started yet.
+    this->countSweeps(this->numMinima);
+    this->engine->markSwept(this->minima);
+
+    for(uint64_t m: this->minima){
+        hpx::apply(this->executor_start_sweeps, TreeConstructor::startSweep_action(), this->get_id(), m, true);
     }
 
+    // the locality was active since init(), from now on only its sweeps and messages keep it active
+    if (this->index == 0){
+        this->termination.start();
+        if (this->options.trunkskip)
+            this->termination.startCensus();
+    }
+    this->termination.minimaLaunched();
+    this->countSweeps(-1);
+
     if (this->numMinima == 0l)
         this->numMinima = std::numeric_limits<std::int64_t>::max();
 
+    this->done.wait();
     LogInfo() << "termination wait finish!";
+    if (this->index == 0)
+        Log().tag(std::to_string(this->index)) << "Termination waves: " << this->termination.getWaves();
     Log().tag(std::to_string(this->index)) << "num of minima: " << this->numMinima;
+    Log().tag(std::to_string(this->index)) << "Sweeps: " << timer.elapsed() << " s";
+    this->blockStats.sweeps = timer.elapsed();
+
+    // the sweep that was left when the trunk started has stopped, the dangling saddles are chained instead
+    if (this->options.trunkskip){
+        if (this->index == 0)
+            this->assembleTrunk();
+        this->trunkBuilt.wait();
+    }
+    this->engine->reportAllocations(this->index);
 
+    if (this->writer != nullptr){
+        this->arcTable = this->engine->collectArcs();
+        this->blockStats.arcs = this->arcTable.size();
+    } else {
+        this->blockStats.arcs = this->engine->countArcs();
+    }
+    return this->blockStats.arcs;
+}
 
-    // TODO
-    return 0;
+/*
+ * The sample planes are split evenly over the components, each reads its planes from the input; the plan itself
+ * is cheap and made here.
+ */
+BlockLayout TreeConstructor::planLayout(const std::vector<hpx::id_type>& treeConstructors, const std::string& input, const Options& options){
+    hpx::chrono::high_resolution_timer timer;
+
+    std::unique_ptr<DataManager> reader(createRawManager(input));
+    if (!reader)
+        throw std::runtime_error("Unknown input format: " + input);
+    const glm::uvec3 gridSize = reader->getSize();
+    reader.reset();
+
+    const uint32_t numPlanes = numSamples(gridSize.z, options.balance);
+    const uint32_t n = treeConstructors.size();
+    std::vector<hpx::future<std::vector<float>>> sampled;
+    for (uint32_t c = 0; c < n; ++c)
+        sampled.push_back(hpx::async<TreeConstructor::sampleCosts_action>(treeConstructors[c], input, options,
+            static_cast<uint32_t>(uint64_t(c) * numPlanes / n), static_cast<uint32_t>(uint64_t(c + 1) * numPlanes / n)));
+
+    std::vector<float> costs;
+    for (hpx::future<std::vector<float>>& f : sampled){
+        const std::vector<float> planes = f.get();
+        costs.insert(costs.end(), planes.begin(), planes.end());
+    }
+    const double sampleTime = timer.elapsed();
+
+    BlockLayout layout = planBlockLayout(gridSize, options.balance, costs, n);
+    const double maxCost = *std::max_element(layout.costs.begin(), layout.costs.end());
+    const double meanCost = std::accumulate(layout.costs.begin(), layout.costs.end(), 0.0) / n;
+    LogInfo() << "Plan: " << costs.size() << " samples in " << sampleTime << " s, " << timer.elapsed()
+        << " s; estimated max / mean cost " << maxCost / meanCost;
+    return layout;
 }
 
-void TreeConstructor::startSweep(uint64_t v, bool leaf){
-    // Fetch Arc
-    Arc* arc;
-    this->mapLock.lock(); // 加锁是因为 fetchCreateArc 可能会修改 DistVec 的内容
-    fetchCreateArc(arc, v);
-    this->mapLock.unlock();
-
-    this->swept[v] = v;
-    
-    mergeBoundaries(arc); // 处理了 queue 和 boundary
-    // 接着处理 augmentation
-    arc->body->augmentation.inherit(arc->body->inheritedAugmentations); // gathered and merged here because no lock required here
-    arc->body->augmentation.sweep(v); // also add saddle/local minimum to augmentation
-
-    // TODO: if done occured
-
-    arc->body->state = State::active;
-
-    for (int i = 0; (i < 6); i++){
-        // 如果邻居在其他 locality 上，且 no be swept
-        if (this->dataManager->isGhost(this->dataManager->getNeighbor(v, i)) && (this->swept[this->dataManager->getNeighbor(v, i)] == INVALID_VERTEX)){ 
-            // TODO: 此处是否需要加锁?
-            arc->body->remoteCallLock.lock();
-    //Now we can authorize remote sweeps:
-    //Initial Fill of Queue
-            // 那么就向其他 locality 请求执行 continueSweep，结果保存在 remoteCalls 中
-            // arc->body->remoteCalls.push_back(hpx::async<TreeConstructor::continueSweep_action>(this->treeConstructors[this->dataManager->getBlockIndex(this->dataManager->getNeighbor(v, i))], v, this->dataManager->convertToGlobal(this->dataManager->getNeighbor(v,i)), this->dataManager->convertToGlobal(v), false));
-            arc->body->remoteCallLock.unlock();
-        } 
-        // 否则直接将邻居放入 queue 中
-        else {
-            arc->body->queue.push(this->dataManager->getNeighbor(v, i));
-        }
+std::vector<float> TreeConstructor::sampleCosts(const std::string& input, const Options& options, uint32_t zBegin, uint32_t zEnd){
+    std::unique_ptr<DataManager> reader(createRawManager(input));
+    if (!reader)
+        throw std::runtime_error("Unknown input format: " + input);
+    return reader->sampleCosts(options.balance, options.balanceWeight, zBegin, zEnd);
+}
+
+uint64_t TreeConstructor::fingerprint(const std::string& input, uint32_t part, uint32_t numParts){
+    std::unique_ptr<DataManager> reader(createRawManager(input));
+    if (!reader)
+        throw std::runtime_error("Unknown input format: " + input);
+    const uint32_t numPlanes = reader->getSize().z;
+    return reader->hashPlanes(static_cast<uint32_t>(uint64_t(part) * numPlanes / numParts), static_cast<uint32_t>(uint64_t(part + 1) * numPlanes / numParts));
+}
+
+bool TreeConstructor::openCache(const std::vector<hpx::id_type>& treeConstructors, const Options& options, uint64_t key){
+    this->options = options;
+    this->treeConstructors = treeConstructors;
+    this->index = std::find(treeConstructors.begin(), treeConstructors.end(), this->get_id()) - treeConstructors.begin();
+    this->cacheKey = key;
+
+    std::unique_ptr<CacheEntry> entry = CacheEntry::open(options.cache, key, this->index, treeConstructors.size());
+    if (!entry)
+        return false;
+
+    const CacheHeader& header = entry->header();
+    this->blockStats.vertices = header.vertices;
+    this->blockStats.minima = header.minima;
+    this->blockStats.arcs = entry->shard().numArcs;
+    this->blockStats.sweeps = 0.0;
+    this->cache = entry.release();
+    return true;
+}
+
+/*
+ * writeShard() has closed the shard in the cache directory, the labels complete the entry.
+ */
+void TreeConstructor::storeCache(){
+    hpx::chrono::high_resolution_timer timer;
+    const glm::uvec3& gridSize = this->dataManager->getGridSize();
+    const glm::uvec3& offset = this->dataManager->getBlockOffset();
+    const glm::uvec3& size = this->dataManager->getBlockSize();
+    const uint64_t numLabels = uint64_t(size.x) * size.y * size.z;
+
+    CacheHeader header = CacheHeader();
+    header.key = this->cacheKey;
+    header.numBlocks = this->treeConstructors.size();
+    for (uint32_t d = 0; d < 3; ++d){
+        header.gridSize[d] = gridSize[d];
+        header.blockOffset[d] = offset[d];
+        header.blockSize[d] = size[d];
+    }
+    header.minima = this->blockStats.minima;
+
+    try {
+        storeCacheEntry(cachePrefix(this->options.cache, this->cacheKey), this->index, header, numLabels,
+            [this](std::ostream& out){
+                this->streamSegmentation([&out](const uint64_t* labels, uint64_t count){
+                    out.write(reinterpret_cast<const char*>(labels), count * sizeof(uint64_t));
+                });
+            });
+    } catch (const std::exception& e) {
+        LogError().tag(std::to_string(this->index)) << e.what();
+        return;
     }
+    Log().tag(std::to_string(this->index)) << "Cache: stored " << byteString(sizeof(CacheHeader) + numLabels * sizeof(uint64_t))
+        << " labels, " << timer.elapsed() << " s";
+}
 
-    // TODO: peers 在此处起何作用？
-    // arc->body->remoteCallLock.lock();
-    // for (hpx::id_type peer : arc->body->peers){
-    //     if (peer != this->get_id())
-    //         arc->body->remoteCalls.push_back(hpx::async<TreeConstructor::continueSweepPeer_action>(peer, v, arc->body->children));
-    // }
-    // arc->body->remoteCallLock.unlock();
+/*
+ * The labels are computed and written a slab at a time, see SweepEngineBase::segmentation(); the label volume of
+ * the block is never in memory at once.
+ */
+void TreeConstructor::streamSegmentation(const std::function<void(const uint64_t*, uint64_t)>& out){
+    hpx::chrono::high_resolution_timer timer;
+    uint64_t numLabels = 0;
+    this->engine->segmentation(glm::uvec3(0, 0, 0), this->dataManager->getBlockSize(), [&](const uint64_t* labels, uint64_t count){
+        out(labels, count);
+        numLabels += count;
+    });
+    Log().tag(std::to_string(this->index)) << "Segmentation: " << timer.elapsed() << " s, "
+        << byteString(numLabels * sizeof(uint64_t)) << " written";
+}
+
+BlockStats TreeConstructor::stats(){
+    this->blockStats.busy = this->busyTime * 1e-9;
+    return this->blockStats;
+}
 
-    // 正式开始处理本地的 sweep
-    continueLocalSweep(v);
+void TreeConstructor::startSweep(uint64_t v, bool leaf){
+    BusyTimer busy(this->busyTime);
+    this->engine->startSweep(v, leaf);
 }
 
 void TreeConstructor::continueLocalSweep(uint64_t v){
-    uint64_t min;
-    Arc* arc;
-    this->mapLock.lock();
-    fetchCreateArc(arc, v);
-    // arc->body->leaf = true;
-    this->mapLock.unlock();
-
-    /* sweep loop */
-    while(!arc->body->queue.empty()){
-        uint64_t c = arc->body->queue.pop();
-        if(c == INVALID_VERTEX)break;
-
-        if(this->dataManager->isGhost(c)){
-            arc->body->boundary.remove(c);
-            swept[c] = v;
-            
-            uint64_t neighbors[6];
-            uint32_t numNeighbors = this->dataManager->getNeighbors(c, neighbors);
-
-            for (uint64_t i = 0; (i < numNeighbors); i++){
-                if ((!this->dataManager->isGhost(neighbors[i])) && (this->swept[neighbors[i]] == INVALID_VERTEX)){
-                    arc->body->queue.push(neighbors[i]);
-                }
-            }
+    BusyTimer busy(this->busyTime);
+    this->engine->continueLocalSweep(v);
+}
+
+void TreeConstructor::continueSweep(uint64_t arc, uint32_t from, const std::vector<uint64_t>& vertices){
+    BusyTimer busy(this->busyTime);
+    this->termination.countReceived();
+    this->engine->continueSweep(arc, from, vertices);
+    this->termination.deactivate();
+}
+
+void TreeConstructor::acknowledge(uint64_t arc, const std::vector<BoundaryReport>& reports){
+    BusyTimer busy(this->busyTime);
+    this->termination.countReceived();
+    this->engine->acknowledge(arc, reports);
+    this->termination.deactivate();
+}
+
+void TreeConstructor::finishChild(uint64_t saddle, uint64_t child, const std::vector<uint32_t>& parts){
+    BusyTimer busy(this->busyTime);
+    this->termination.countReceived();
+    this->engine->finishChild(saddle, child, parts);
+    this->termination.countUnfinished(-1);
+    this->termination.deactivate();
+}
+
+void TreeConstructor::startPart(uint64_t arc, uint64_t saddleIndex, double saddleValue, const std::vector<uint64_t>& children){
+    BusyTimer busy(this->busyTime);
+    this->termination.countReceived();
+    this->engine->startPart(arc, saddleIndex, saddleValue, children);
+    this->termination.deactivate();
+}
+
+void TreeConstructor::sendContinueSweep(uint32_t locality, uint64_t arc, std::vector<uint64_t>&& vertices){
+    this->termination.countSent();
+    hpx::apply(TreeConstructor::continueSweep_action(), this->treeConstructors[locality], arc, this->index, std::move(vertices));
+}
+
+void TreeConstructor::sendAcknowledge(uint32_t locality, uint64_t arc, std::vector<BoundaryReport>&& reports){
+    this->termination.countSent();
+    hpx::apply(TreeConstructor::acknowledge_action(), this->treeConstructors[locality], arc, std::move(reports));
+}
+
+void TreeConstructor::sendFinishChild(uint32_t locality, uint64_t saddle, uint64_t child, std::vector<uint32_t>&& parts){
+    // child stays unfinished until the saddle's locality has registered it, see TerminationDetector
+    this->termination.countUnfinished(1);
+    this->termination.countSent();
+    hpx::apply(TreeConstructor::finishChild_action(), this->treeConstructors[locality], saddle, child, std::move(parts));
+}
+
+void TreeConstructor::sendStartPart(uint32_t locality, uint64_t arc, uint64_t saddleIndex, double saddleValue, const std::vector<uint64_t>& children){
+    this->termination.countSent();
+    hpx::apply(TreeConstructor::startPart_action(), this->treeConstructors[locality], arc, saddleIndex, saddleValue, children);
+}
+
+void TreeConstructor::launchSaddleSweep(uint64_t saddle){
+    hpx::apply(this->executor_high, TreeConstructor::startSweep_action(), this->get_id(), saddle, false);
+}
+
+void TreeConstructor::countSweeps(int64_t delta){
+    this->termination.countUnfinished(delta);
+    if (delta > 0)
+        this->termination.activate(delta);
+    else
+        this->termination.deactivate(-delta);
+}
+
+void TreeConstructor::probe(uint64_t wave){
+    this->termination.probe(wave);
+}
+
+void TreeConstructor::probeReport(uint64_t wave, uint64_t sent, uint64_t received){
+    this->termination.report(wave, sent, received);
+}
+
+void TreeConstructor::terminate(){
+    this->termination.setFinished();
+    for (uint32_t child : this->termination.children())
+        hpx::apply(TreeConstructor::terminate_action(), this->treeConstructors[child]);
+    this->done.set();
+}
+
+void TreeConstructor::sendProbe(uint32_t locality, uint64_t wave){
+    hpx::apply(TreeConstructor::probe_action(), this->treeConstructors[locality], wave);
+}
+
+void TreeConstructor::sendProbeReport(uint32_t locality, uint64_t wave, uint64_t sent, uint64_t received){
+    hpx::apply(TreeConstructor::probeReport_action(), this->treeConstructors[locality], wave, sent, received);
+}
+
+void TreeConstructor::census(uint64_t wave){
+    this->termination.census(wave);
+}
+
+void TreeConstructor::censusReport(uint64_t wave, int64_t unfinished, uint32_t waiting){
+    this->termination.censusReport(wave, unfinished, waiting);
+}
+
+void TreeConstructor::sendCensus(uint32_t locality, uint64_t wave){
+    hpx::apply(TreeConstructor::census_action(), this->treeConstructors[locality], wave);
+}
+
+void TreeConstructor::sendCensusReport(uint32_t locality, uint64_t wave, int64_t unfinished, uint32_t waiting){
+    hpx::apply(TreeConstructor::censusReport_action(), this->treeConstructors[locality], wave, unfinished, waiting);
+}
+
+void TreeConstructor::startTrunk(uint64_t wave){
+    // a census of the previous timestep, or one that was still under way when the sweeps finished
+    if (this->termination.isStale(wave) || this->termination.isFinished())
+        return;
+    for (uint32_t child : this->termination.children())
+        hpx::apply(TreeConstructor::startTrunk_action(), this->treeConstructors[child], wave);
+    this->engine->startTrunk();
+}
+
+std::vector<TrunkArc> TreeConstructor::collectTrunk(){
+    return this->engine->collectTrunk();
+}
+
+void TreeConstructor::buildTrunk(const std::vector<TrunkArc>& trunk){
+    this->engine->buildTrunk(trunk);
+    this->trunkBuilt.set();
+}
+
+void TreeConstructor::assembleTrunk(){
+    hpx::chrono::high_resolution_timer timer;
+
+    std::vector<hpx::future<std::vector<TrunkArc>>> collected;
+    for (hpx::id_type treeConstructor : this->treeConstructors)
+        collected.push_back(hpx::async<TreeConstructor::collectTrunk_action>(treeConstructor));
+
+    std::vector<TrunkArc> trunk;
+    for (hpx::future<std::vector<TrunkArc>>& c : collected){
+        std::vector<TrunkArc> arcs = c.get();
+        trunk.insert(trunk.end(), std::make_move_iterator(arcs.begin()), std::make_move_iterator(arcs.end()));
+    }
+
+    // the order of the vertices of all blocks, as lessLocal() within one block
+    hpx::sort(hpx::execution::par, trunk.begin(), trunk.end(), [](const TrunkArc& a, const TrunkArc& b){
+        return (a.value < b.value) || (a.value == b.value && a.vertex < b.vertex);
+    });
+
+    std::vector<hpx::future<void>> built;
+    for (hpx::id_type treeConstructor : this->treeConstructors)
+        built.push_back(hpx::async<TreeConstructor::buildTrunk_action>(treeConstructor, trunk));
+    hpx::wait_all(built);
+
+    Log().tag(std::to_string(this->index)) << "Trunk: " << trunk.size() << " arcs, " << timer.elapsed() << " s";
+}
+
+/*
+ * The parents of the arcs are looked up in the arc tables of their localities, which construct() has built on all
+ * localities before. The shard only holds the parts that were not final during the sweeps.
+ */
+ShardInfo TreeConstructor::writeShard(const std::vector<uint64_t>& arcRows){
+    hpx::chrono::high_resolution_timer timer;
+
+    // cache: the stored shard is the output, parents included
+    if (this->cache != nullptr){
+        copyFile(this->cache->shardName, shardFileName(this->options.output, this->index));
+        Log().tag(std::to_string(this->index)) << "Output: copied from the cache, " << timer.elapsed() << " s";
+        return this->cache->shardInfo();
+    }
+
+    // timesteps: the tree has not changed, neither has its shard
+    if (this->reuse){
+        copyFile(shardFileName(this->options.stepPrefix(this->options.output, this->step - 1), this->index),
+            shardFileName(this->options.stepPrefix(this->options.output, this->step), this->index));
+        Log().tag(std::to_string(this->index)) << "Output: copied from timestep " << this->step - 1 << ", " << timer.elapsed() << " s";
+        return this->shardInfo;
+    }
+
+    this->engine->writeParts();
+
+    // by locality: the rows in arcTable of the arcs whose parents started there, and their saddles
+    std::vector<std::vector<uint64_t>> rows(this->treeConstructors.size());
+    std::vector<std::vector<uint64_t>> saddles(this->treeConstructors.size());
+    for (uint64_t i = 0; i < this->arcTable.size(); ++i){
+        if (this->arcTable[i].saddle == INVALID_VERTEX)
             continue;
-        }
+        const uint32_t locality = this->dataManager->getOwnerBlock(this->arcTable[i].saddle);
+        rows[locality].push_back(i);
+        saddles[locality].push_back(this->arcTable[i].saddle);
+    }
 
-        // if can be swept
-        if(this->touch(c, v)){
-            arc->body->boundary.remove(c); // remove from boundary
-            this->swept[c] = v;     // put into our augmentation and mark as swept
-            arc->body->augmentation.sweep(c);
-
-            uint64_t neighbors[6];
-            uint32_t numNeighbors = this->dataManager->getNeighbors(c, neighbors);
-
-            // TODO: 补充 remote call 的部分
-            for (uint64_t i = 0; (i < numNeighbors); i++){
-                if (this->dataManager->isGhost(neighbors[i]) && (this->swept[neighbors[i]] == INVALID_VERTEX)){
-                    // arc->body->remoteCallLock.lock();
-                    // arc->body->remoteCalls.push_back(hpx::async<TreeConstructor::continueSweep_action>(this->treeConstructors[this->dataManager->getBlockIndex(neighbors[i])], v, this->dataManager->convertToGlobal(neighbors[i]), this->dataManager->convertToGlobal(c), false));
-                    // arc->body->remoteCallLock.unlock();
-                } else {
-                    arc->body->queue.push(neighbors[i]);
-                }
-            }
-        }
-        // else can not be swept now
-        else{
-            arc->body->boundary.add(c);
-        }
-    } /* end sweep loop */
-
-    // arc->body->lock.lock();
-    // 正常情况下扫描结束后 queue 为空
-    if (arc->body->queue.empty()){
-        arc->body->state = State::finalizing;
-        // 找到其中的最小值即为 saddle 
-        if (arc->body->boundary.empty()){ // 特殊情况? 还是最后的根节点？
-            min = INVALID_VERTEX;
-        } else {
-            min = arc->body->boundary.min();
-        }
+    std::vector<hpx::future<std::vector<uint64_t>>> found(this->treeConstructors.size());
+    for (uint32_t l = 0; l < this->treeConstructors.size(); ++l){
+        if (!saddles[l].empty())
+            found[l] = hpx::async<TreeConstructor::findArcs_action>(this->treeConstructors[l], saddles[l]);
     }
-    // Q: 此处暂时看不懂
-    // else {
-    //     if (done.occurred()){
-    //         arc->body->lock.unlock();
-    //         awaitRemoteAnswers(arc);
-    //         hpx::apply(this->executor_high, TreeConstructor::startTrunk_action(), this->treeConstructors[0], this->dataManager->getValue(arc->extremum));
-    //         hpx::apply(this->executor_high, TreeConstructor::countSweeps_action(), this->treeConstructors[0], -1l);
-    //         return;
-    //     } else {
-    //         arc->body->lock.unlock();
-    //         hpx::apply(TreeConstructor::continueLocalSweep_action(), this->get_id(), v);
-    //         return;
-    //     }
-    // }
-}
-
-bool TreeConstructor::fetchCreateArc(Arc*& arc, uint64_t v){
-    Arc*& tmparc = this->arcMap[v];
-    if (tmparc == nullptr){
-        tmparc = new Arc(v, this->dataManager, &swept);
-        arc = tmparc;
-        return true;
-    } else {
-        arc = tmparc;
-        return false;
+    for (uint32_t l = 0; l < this->treeConstructors.size(); ++l){
+        if (saddles[l].empty())
+            continue;
+        const std::vector<uint64_t> parents = found[l].get();
+        for (uint64_t i = 0; i < parents.size(); ++i)
+            this->arcTable[rows[l][i]].parent = (parents[i] == INVALID_VERTEX) ? INVALID_VERTEX : arcRows[l] + parents[i];
     }
+
+    const glm::uvec3& size = this->dataManager->getGridSize();
+    const uint32_t gridSize[3] = {size.x, size.y, size.z};
+    ShardInfo info = this->writer->close(this->arcTable, arcRows[this->index], gridSize);
+    if (!this->options.cache.empty() && !this->options.output.empty())
+        copyFile(shardFileName(cachePrefix(this->options.cache, this->cacheKey) + ".tmp", this->index), shardFileName(this->options.output, this->index));
+    Log().tag(std::to_string(this->index)) << "Output: " << info.numArcs << " arcs, " << info.numParts << " parts, "
+        << byteString(info.bytes) << ", " << timer.elapsed() << " s";
+    this->shardInfo = info;
+    return info;
 }
 
-/* 在 RegionGrowth 之前初始化 Arc 的 queue 和 boundary */
-void TreeConstructor::mergeBoundaries(Arc*& arc){
-    for (uint32_t i = 0; i < arc->body->children.size(); ++i){
-        mapLock.lock();
-        Arc* childptr = arcMap[arc->body->children[i]];
-        mapLock.unlock();
-        if (childptr == nullptr)
-            continue;
-        for (uint32_t j = i+1; j < arc->body->children.size(); ++j){
-            mapLock.lock();
-            Arc* child2ptr = arcMap[arc->body->children[j]];
-            mapLock.unlock();
-            if (child2ptr == nullptr)
-                continue;
-            arc->body->queue.push(childptr->body->boundary.intersect(child2ptr->body->boundary));
-        }
+std::vector<uint64_t> TreeConstructor::findArcs(const std::vector<uint64_t>& extrema){
+    std::vector<uint64_t> result(extrema.size());
+    for (uint64_t i = 0; i < extrema.size(); ++i){
+        auto it = std::lower_bound(this->arcTable.begin(), this->arcTable.end(), extrema[i], [](const ArcRecord& a, uint64_t e){ return a.extremum < e; });
+        result[i] = (it != this->arcTable.end() && it->extremum == extrema[i]) ? (it - this->arcTable.begin()) : INVALID_VERTEX;
+    }
+    return result;
+}
 
-        arc->body->boundary.unite(childptr->body->boundary);
+// cache: there is no grid, the entry has the extents, the labels and the arcs
+void TreeConstructor::vtkBlock(glm::uvec3& gridSize, glm::uvec3& offset, glm::uvec3& size){
+    if (this->cache != nullptr){
+        const CacheHeader& header = this->cache->header();
+        gridSize = glm::uvec3(header.gridSize[0], header.gridSize[1], header.gridSize[2]);
+        offset = glm::uvec3(header.blockOffset[0], header.blockOffset[1], header.blockOffset[2]);
+        size = glm::uvec3(header.blockSize[0], header.blockSize[1], header.blockSize[2]);
+    } else {
+        gridSize = this->dataManager->getGridSize();
+        offset = this->dataManager->getBlockOffset();
+        size = this->dataManager->getBlockSize();
     }
 }
 
 /*
- * Sweep reaches vertex and checks if it can be swept by going through *all* its smaller neighbors and check if they *all* have already been swept by us
+ * The piece reaches one point into the blocks above it, so that neighboring pieces share their boundary points and
+ * no cells are missing between them. The labels of those points come from the localities that own them.
  */
-bool TreeConstructor::touch(uint64_t c, uint64_t v){
+VtkPiece TreeConstructor::writeVtk(){
+    hpx::chrono::high_resolution_timer timer;
+
+    glm::uvec3 gridSize, offset, size;
+    this->vtkBlock(gridSize, offset, size);
+    const uint32_t grid[3] = {gridSize.x, gridSize.y, gridSize.z};
+    const uint32_t wholeExtent[6] = {0, gridSize.x - 1, 0, gridSize.y - 1, 0, gridSize.z - 1};
+
+    VtkPiece piece;
+    glm::uvec3 pieceSize;
+    for (uint32_t d = 0; d < 3; ++d){
+        pieceSize[d] = size[d] + ((offset[d] + size[d] < gridSize[d]) ? 1 : 0);
+        piece.extent[2 * d] = offset[d];
+        piece.extent[2 * d + 1] = offset[d] + pieceSize[d] - 1;
+    }
 
-    uint64_t neighbors[6];
-    uint32_t numNeighbors = this->dataManager->getNeighbors(c, neighbors);
+    std::vector<hpx::future<VtkLabels>> sharedFutures;
+    if (pieceSize != size){
+        for (uint32_t l = 0; l < this->treeConstructors.size(); ++l){
+            if (l != this->index)
+                sharedFutures.push_back(hpx::async<TreeConstructor::vtkLabels_action>(this->treeConstructors[l], piece));
+        }
+    }
+    std::vector<VtkLabels> shared;
+    for (hpx::future<VtkLabels>& f : sharedFutures){
+        VtkLabels labels = f.get();
+        if (!labels.labels.empty())
+            shared.push_back(std::move(labels));
+    }
 
-    for (uint64_t& n: neighbors) {
-        if (n != INVALID_VERTEX) {
-            if(this->dataManager->less(n, v)){
-                if(!this->searchUF(this->swept[n], v)){
-                    return false;
+    const std::string prefix = this->options.stepPrefix(this->options.vtk, this->step);
+    const uint64_t numLabels = uint64_t(pieceSize.x) * pieceSize.y * pieceSize.z;
+    writeVtiPiece(vtiPieceName(prefix, this->index), wholeExtent, piece.extent, numLabels, [&](std::ostream& out){
+        // the shared points of row (y, z) of the piece from xBegin on
+        std::vector<uint64_t> row(pieceSize.x);
+        auto writeShared = [&](uint32_t y, uint32_t z, uint32_t xBegin){
+            for (uint32_t x = xBegin; x < pieceSize.x; ++x){
+                row[x - xBegin] = INVALID_VERTEX;
+                for (const VtkLabels& labels : shared){
+                    if (labels.contains(offset.x + x, offset.y + y, offset.z + z))
+                        row[x - xBegin] = labels.at(offset.x + x, offset.y + y, offset.z + z);
+                }
+            }
+            out.write(reinterpret_cast<const char*>(row.data()), (pieceSize.x - xBegin) * sizeof(uint64_t));
+        };
+
+        // the planes of the block, with the shared point after every row and the shared row after every plane
+        const uint64_t planeSize = uint64_t(size.x) * size.y;
+        uint32_t z = 0;
+        auto writePlanes = [&](const uint64_t* labels, uint64_t count){
+            for (uint64_t p = 0; p < count; p += planeSize, ++z){
+                for (uint32_t y = 0; y < size.y; ++y){
+                    out.write(reinterpret_cast<const char*>(labels + p + uint64_t(y) * size.x), size.x * sizeof(uint64_t));
+                    if (pieceSize.x > size.x)
+                        writeShared(y, z, size.x);
                 }
+                if (pieceSize.y > size.y)
+                    writeShared(size.y, z, 0);
             }
+        };
+        if (this->cache != nullptr)
+            writePlanes(this->cache->labels(), planeSize * size.z);
+        else
+            this->streamSegmentation(writePlanes);
+        if (pieceSize.z > size.z){
+            for (uint32_t y = 0; y < pieceSize.y; ++y)
+                writeShared(y, size.z, 0);
         }
+    });
+
+    const std::vector<ArcRecord> arcs = (this->cache != nullptr) ? this->cache->arcs() : this->engine->collectArcs();
+    std::vector<uint64_t> extrema(arcs.size());
+    std::vector<uint64_t> saddles(arcs.size());
+    for (uint64_t i = 0; i < arcs.size(); ++i){
+        extrema[i] = arcs[i].extremum;
+        saddles[i] = arcs[i].saddle;
     }
-    return true;
+    writeVtpPiece(vtpPieceName(prefix, this->index), grid, extrema, saddles);
+    piece.numArcs = arcs.size();
+
+    Log().tag(std::to_string(this->index)) << "VTK pieces: " << timer.elapsed() << " s";
+    return piece;
 }
 
-bool TreeConstructor::searchUF(uint64_t start, uint64_t goal){
-    // goal is actively running sweep
+VtkLabels TreeConstructor::vtkLabels(const VtkPiece& box){
+    glm::uvec3 gridSize, offset, size;
+    this->vtkBlock(gridSize, offset, size);
+
+    VtkLabels result;
+    glm::uvec3 begin, boxSize;
+    for (uint32_t d = 0; d < 3; ++d){
+        const uint32_t low = std::max(box.extent[2 * d], offset[d]);
+        const uint32_t high = std::min(box.extent[2 * d + 1], offset[d] + size[d] - 1);
+        if (low > high)
+            return result;
+        result.extent[2 * d] = low;
+        result.extent[2 * d + 1] = high;
+        begin[d] = low - offset[d];
+        boxSize[d] = high - low + 1;
+    }
 
-    if (start == INVALID_VERTEX)
-        return false;
+    result.labels.reserve(uint64_t(boxSize.x) * boxSize.y * boxSize.z);
+    if (this->cache != nullptr){
+        const uint64_t* labels = this->cache->labels();
+        for (uint32_t z = begin.z; z < begin.z + boxSize.z; ++z){
+            for (uint32_t y = begin.y; y < begin.y + boxSize.y; ++y){
+                const uint64_t* row = labels + (uint64_t(z) * size.y + y) * size.x + begin.x;
+                result.labels.insert(result.labels.end(), row, row + boxSize.x);
+            }
+        }
+    } else {
+        this->engine->segmentation(begin, boxSize, [&result](const uint64_t* labels, uint64_t count){
+            result.labels.insert(result.labels.end(), labels, labels + count);
+        });
+    }
+    return result;
+}
 
-    uint64_t c = start;
-    uint64_t next = this->UF[c];
-    if (c == goal || next == goal)
-        return true;
-    if (next == INVALID_VERTEX)
-        return false;
+void TerminationDetector::forwardProbe(uint32_t locality, uint64_t wave){
+    this->owner->sendProbe(locality, wave);
+}
 
-    // includes path compression
-    while (true) {
-        if (this->UF[next] == goal) {
-            this->UF[c] = this->UF[next];
-            return true;
-        }
+void TerminationDetector::forwardReport(uint32_t locality, uint64_t wave, uint64_t sent, uint64_t received){
+    this->owner->sendProbeReport(locality, wave, sent, received);
+}
 
-        if (this->UF[next] == INVALID_VERTEX)
-            return false;
+void TerminationDetector::finish(){
+    this->owner->terminate();
+}
 
-        this->UF[c] = this->UF[next];
-        next = this->UF[next];
-    }
-}
\ No newline at end of file
+void TerminationDetector::forwardCensus(uint32_t locality, uint64_t wave){
+    this->owner->sendCensus(locality, wave);
+}
+
+void TerminationDetector::forwardCensusReport(uint32_t locality, uint64_t wave, int64_t unfinished, uint32_t waiting){
+    this->owner->sendCensusReport(locality, wave, unfinished, waiting);
+}
+
+void TerminationDetector::nextCensus(uint64_t wave, uint32_t pause){
+    hpx::apply([this, wave, pause](){
+        hpx::this_thread::sleep_for(std::chrono::microseconds(pause));
+        this->census(wave);
+    });
+}
+
+void TerminationDetector::startTrunk(uint64_t wave){
+    this->owner->startTrunk(wave);
+}
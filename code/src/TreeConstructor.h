@@ -1,12 +1,59 @@
 #pragma once
 
-#include "Arc.h"
+#include "BlockLayout.h"
 #include "DataManager.h"
+#include "ResultCache.h"
+#include "Termination.h"
+#include "TreeWriter.h"
+#include "VtkWriter.h"
 #include <hpx/serialization/access.hpp>
+#include <hpx/serialization/string.hpp>
+#include <hpx/serialization/vector.hpp>
+
+class SweepEngineBase;
 
 class Options{
 public:
     bool trunkskip;
+    // precompute vertex ranks so that comparisons are a single integer compare
+    bool rankorder;
+    // store the per-vertex sweep state as 32 bit block-local ids
+    bool compact;
+    // prefix of the binary tree output, see TreeWriter.h; empty if the tree is not written
+    std::string output;
+    // write the augmentation of the arcs along with the arc table
+    bool augmentation;
+    // prefix of the VTK pieces of the segmentation and the arcs, see VtkWriter.h; empty if not written
+    std::string vtk;
+    // keep no augmentation, only the arc of every vertex, rebuilt after the sweeps
+    bool flat;
+    // plan the blocks from every balance-th voxel along each axis, see BlockLayout.h; 0 splits uniformly
+    uint32_t balance;
+    // extra cost of a sample cell around a minimum of the sampled grid, relative to its voxels
+    float balanceWeight;
+    // read only the interior of the blocks, the ghost layers are exchanged between the components
+    bool halo;
+    // store the values in bricks of 8^3 vertices instead of row-major order, see RegularGridManager::localIndex()
+    bool bricked;
+    // directory of the result cache, see ResultCache.h; empty if results are not cached
+    std::string cache;
+    // number of timesteps of the input series, 0 for a single input
+    uint32_t timesteps;
+    // directory of the files of the out of core blocks, see VertexStore.h; empty keeps the blocks in memory
+    std::string scratch;
+    // out of core: bytes of the per-vertex arrays of a block to keep in memory
+    uint64_t memoryBudget;
+
+    // hash of the options that may change the results, all but the output paths
+    uint64_t resultHash() const {
+        const uint32_t flags[8] = {trunkskip, rankorder, compact, augmentation, flat, balance, halo, bricked};
+        return hashValue(balanceWeight, hashValue(flags, CACHE_FORMAT_VERSION));
+    }
+
+    // output prefix of a timestep: prefix_t<step>, or prefix for a single input
+    std::string stepPrefix(const std::string& prefix, uint32_t step) const {
+        return (timesteps > 0) ? prefix + "_t" + std::to_string(step) : prefix;
+    }
 
 private:
     // Serialization support: provide an (empty) implementation for the
@@ -15,67 +62,345 @@ private:
 
     template <typename Archive>
     void serialize(Archive& ar, const unsigned int version){
-        ar & trunkskip; 
+        ar & trunkskip;
+        ar & rankorder;
+        ar & compact;
+        ar & output;
+        ar & augmentation;
+        ar & vtk;
+        ar & flat;
+        ar & balance;
+        ar & balanceWeight;
+        ar & halo;
+        ar & bricked;
+        ar & cache;
+        ar & timesteps;
+        ar & scratch;
+        ar & memoryBudget;
+    }
+
+};
+
+/*
+ * Boundary minimum of the part of an arc on one locality, sent back towards the locality where the arc started.
+ * vertex is the linear grid index of the minimum, INVALID_VERTEX if the boundary is empty. seq orders the reports
+ * of one part, only the latest one counts.
+ */
+class BoundaryReport{
+public:
+    uint32_t locality;
+    uint64_t seq;
+    double value;
+    uint64_t vertex;
+
+private:
+    friend class hpx::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive& ar, const unsigned int version){
+        ar & locality;
+        ar & seq;
+        ar & value;
+        ar & vertex;
     }
+};
 
+/*
+ * An arc without saddle after the sweeps: a dangling saddle or the lowest arc of the trunk. arc is the id of the
+ * extremum on its block, vertex its linear grid index; children are the arcs that ended at a dangling saddle.
+ */
+class TrunkArc{
+public:
+    uint64_t arc;
+    uint64_t vertex;
+    double value;
+    std::vector<uint64_t> children;
+
+private:
+    friend class hpx::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive& ar, const unsigned int version){
+        ar & arc;
+        ar & vertex;
+        ar & value;
+        ar & children;
+    }
+};
+
+/*
+ * Work of a block, to check the balance of the blocks and localities.
+ */
+class BlockStats{
+public:
+    uint64_t vertices;
+    uint64_t minima;
+    uint64_t arcs;
+    // time spent in the sweep actions of the block and until all sweeps had finished
+    double busy;
+    double sweeps;
+
+private:
+    friend class hpx::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive& ar, const unsigned int version){
+        ar & vertices;
+        ar & minima;
+        ar & arcs;
+        ar & busy;
+        ar & sweeps;
+    }
 };
 
 class TreeConstructor : public hpx::components::component_base<TreeConstructor> {
 public:
-    TreeConstructor():dataManager(nullptr), numMinima(0){}
+    TreeConstructor()
+        : executor_start_sweeps(hpx::threads::thread_priority::normal)
+        , executor_high(hpx::threads::thread_priority::high)
+        , dataManager(nullptr)
+        , engine(nullptr)
+        , writer(nullptr)
+        , cache(nullptr)
+        , cacheKey(0)
+        , step(0)
+        , blockChanged(true)
+        , reuse(false)
+        , numMinima(0)
+        , busyTime(0)
+        , haloPending(0)
+        , termination(this){}
 
     TreeConstructor(const TreeConstructor& ) = delete;
     TreeConstructor& operator=(const TreeConstructor& ) = delete;
 
-    // ~TreeConstructor(){}
+    ~TreeConstructor();
 
-    void init(const std::vector<hpx::id_type>& treeConstructors, const std::string& input, const Options& options);
+    // layout: the planned blocks, empty for a uniform split
+    void init(const std::vector<hpx::id_type>& treeConstructors, const std::string& input, const Options& options, const BlockLayout& layout);
     // 每个能够被远程调用的成员函数都必须封装成为 component action
     HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, init);
 
+    // halo: sends the ghost layers of the other blocks and waits for its own, after init() on all components
+    void exchangeHalo();
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, exchangeHalo);
+
+    // halo: the part of the ghost layer of this block that lies in block from
+    void receiveHalo(uint32_t from, const std::vector<uint8_t>& values);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, receiveHalo);
+
+    // timesteps: reads the block of timestep step > 0 from input into the arrays of init(); halo: exchangeHalo()
+    // follows on all components
+    void loadTimestep(const std::string& input, uint32_t step);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, loadTimestep);
+
+    // timesteps: whether the values of the block (with ghost layer) differ from the previous timestep
+    bool dataChanged();
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, dataChanged);
+
+    // timesteps: prepares construct() for the loaded timestep; reuse if no block has changed, the tree of the
+    // previous timestep is kept, else it is cleared for new sweeps
+    void beginTimestep(bool reuse);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, beginTimestep);
+
     uint64_t construct();
     HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, construct);
 
+    // balance: plans the blocks from the sample costs of all components; called before init() on one component
+    BlockLayout planLayout(const std::vector<hpx::id_type>& treeConstructors, const std::string& input, const Options& options);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, planLayout);
+
+    // balance: sample costs of the sample planes [zBegin, zEnd) of the input
+    std::vector<float> sampleCosts(const std::string& input, const Options& options, uint32_t zBegin, uint32_t zEnd);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, sampleCosts);
+
+    // cache: hash of the part-th of numParts ranges of planes of the input, the caller combines the hashes of all
+    // parts into the key
+    uint64_t fingerprint(const std::string& input, uint32_t part, uint32_t numParts);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, fingerprint);
+
+    // cache: maps the entry of this component, before init(); only if it is valid on all components init() is
+    // skipped and construct() returns the stored result
+    bool openCache(const std::vector<hpx::id_type>& treeConstructors, const Options& options, uint64_t key);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, openCache);
+
+    // cache: stores the result of this component, after writeShard()
+    void storeCache();
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, storeCache);
+
+    // after construct()
+    BlockStats stats();
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, stats);
+
     void startSweep(uint64_t v, bool leaf);
     HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, startSweep);
 
     void continueLocalSweep(uint64_t v);
     HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, continueLocalSweep);
 
-    bool fetchCreateArc(Arc*& arc, uint64_t v);
-    void mergeBoundaries(Arc*& arc);
+    // vertices (linear grid indices) swept by arc on locality from that lie in the ghost layer of this block
+    void continueSweep(uint64_t arc, uint32_t from, const std::vector<uint64_t>& vertices);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, continueSweep);
+
+    void acknowledge(uint64_t arc, const std::vector<BoundaryReport>& reports);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, acknowledge);
+
+    // child has finished with the saddle, a vertex of this block; parts are the localities it swept on
+    void finishChild(uint64_t saddle, uint64_t child, const std::vector<uint32_t>& parts);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, finishChild);
+
+    // the saddle sweep of arc has started, its children hand their parts on this locality over to it
+    void startPart(uint64_t arc, uint64_t saddleIndex, double saddleValue, const std::vector<uint64_t>& children);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, startPart);
+
+    // senders of the actions above, used by the sweep engine
+    void sendContinueSweep(uint32_t locality, uint64_t arc, std::vector<uint64_t>&& vertices);
+    void sendAcknowledge(uint32_t locality, uint64_t arc, std::vector<BoundaryReport>&& reports);
+    void sendFinishChild(uint32_t locality, uint64_t saddle, uint64_t child, std::vector<uint32_t>&& parts);
+    void sendStartPart(uint32_t locality, uint64_t arc, uint64_t saddleIndex, double saddleValue, const std::vector<uint64_t>& children);
+
+    // termination waves, see TerminationDetector
+    void probe(uint64_t wave);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, probe);
+
+    void probeReport(uint64_t wave, uint64_t sent, uint64_t received);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, probeReport);
+
+    // all sweeps have finished, passed down the wave tree
+    void terminate();
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, terminate);
 
-    bool touch(uint64_t c, uint64_t v);
-    bool searchUF(uint64_t start, uint64_t goal);
+    void sendProbe(uint32_t locality, uint64_t wave);
+    void sendProbeReport(uint32_t locality, uint64_t wave, uint64_t sent, uint64_t received);
+
+    // trunk skip: census waves count the unfinished arcs, see TerminationDetector
+    void census(uint64_t wave);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, census);
+
+    void censusReport(uint64_t wave, int64_t unfinished, uint32_t waiting);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, censusReport);
+
+    void sendCensus(uint32_t locality, uint64_t wave);
+    void sendCensusReport(uint32_t locality, uint64_t wave, int64_t unfinished, uint32_t waiting);
+
+    // at most one sweep is left: it is the trunk and stops, passed down the wave tree; wave is the census that found it
+    void startTrunk(uint64_t wave);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, startTrunk);
+
+    // the arcs of this locality that have no saddle after the sweeps
+    std::vector<TrunkArc> collectTrunk();
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, collectTrunk);
+
+    // trunk: the arcs without saddle of all localities in ascending order
+    void buildTrunk(const std::vector<TrunkArc>& trunk);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, buildTrunk);
+
+    // output: closes the shard of this locality; arcRows are the global rows of the first arc of every locality
+    ShardInfo writeShard(const std::vector<uint64_t>& arcRows);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, writeShard);
+
+    // output: rows of the arcs with the given extrema in the arc table of this locality
+    std::vector<uint64_t> findArcs(const std::vector<uint64_t>& extrema);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, findArcs);
+
+    // writes the VTK pieces of this locality, the index is written by the caller
+    VtkPiece writeVtk();
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, writeVtk);
+
+    // writeVtk() of another locality: the labels of the points of the piece extent box that lie in this block
+    VtkLabels vtkLabels(const VtkPiece& box);
+    HPX_DEFINE_COMPONENT_ACTION(TreeConstructor, vtkLabels);
+
+    // launches the sweep of a saddle whose lower neighborhood has been swept completely
+    void launchSaddleSweep(uint64_t saddle);
+    void countSweeps(int64_t delta);
 
 private:
+    // locality 0: chains the arcs without saddle of all localities into the trunk
+    void assembleTrunk();
+    // after the values of the block and its ghost layer are complete: timesteps: compares the block with the
+    // previous timestep; rank order: computes the ranks if the block has changed
+    void completeData();
+    // cache, vtk: the arc of every vertex of the block, streamed to out as by SweepEngineBase::segmentation()
+    void streamSegmentation(const std::function<void(const uint64_t*, uint64_t)>& out);
+    // vtk: the grid and the block without ghost layer, from the grid or the cache entry
+    void vtkBlock(glm::uvec3& gridSize, glm::uvec3& offset, glm::uvec3& size);
+
     uint32_t index;
     Options options;
     std::vector<hpx::id_type> treeConstructors;
 
+    // leaf sweeps are launched on executor_start_sweeps, saddle sweeps on executor_high
+    // so that the arcs closer to the root (the critical path) are preferred
+    hpx::execution::parallel_executor executor_start_sweeps;
+    hpx::execution::parallel_executor executor_high;
+
     DataManager* dataManager;
+    // the sweeps of this locality, typed on the grid of dataManager
+    SweepEngineBase* engine;
+    // the shard of this locality, nullptr if the tree is not written
+    ShardWriter* writer;
+    // cache: the entry that replaces the grid and the sweeps, nullptr if there is none or init() was called
+    CacheEntry* cache;
+    uint64_t cacheKey;
+    // timesteps: the loaded timestep, the hashes of the rows of its block, which of them and whether any differ from
+    // the previous timestep
+    uint32_t step;
+    std::vector<uint64_t> rowHashes;
+    std::vector<uint8_t> changedRows;
+    bool blockChanged;
+    // timesteps: no block has changed, construct() and writeShard() return the previous results
+    bool reuse;
+    // the local minima of the block, kept for the next timestep and updated in its changed rows
+    std::vector<uint64_t> minima;
+    // output: the closed shard, for a timestep that reuses it
+    ShardInfo shardInfo;
+    // output: the arcs that started on this locality sorted by extremum, built by construct()
+    std::vector<ArcRecord> arcTable;
     int64_t numMinima;
-    // the number of vertices (with ghost) in this locality
-    uint64_t numVertices; 
-
-   
-
-    // the lock of arcMap
-    hpx::lcos::local::mutex mapLock;
-
-    //
-    std::atomic<int64_t> sweeps;
-    // Map for each vertex to ID of arc extremum
-    DistVec<uint64_t> swept; // what vertex has been swept by which saddle/local minimum
-    // Map for starting minima(or saddle) to Arc pointer
-    DistVec<Arc*> arcMap;
-
-    // Union-find-structure containing child-parent relations
-    DistVec<uint64_t> UF;
+    // nanoseconds spent in the sweep actions, see BusyTimer
+    std::atomic<uint64_t> busyTime;
+    BlockStats blockStats;
 
+    // counts the sweeps and messages of this locality, runs the termination waves
+    TerminationDetector termination;
+    // set when the sweeps of all localities have finished
+    hpx::lcos::local::event done;
+    // trunk skip: set when the trunk has been built on this locality
+    hpx::lcos::local::event trunkBuilt;
+    // halo: parts of the ghost layer still to be received, haloReceived is set when there are none
+    std::atomic<uint32_t> haloPending;
+    hpx::lcos::local::event haloReceived;
 };
 
 HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::init_action, treeConstructor_init_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::exchangeHalo_action, treeConstructor_exchangeHalo_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::receiveHalo_action, treeConstructor_receiveHalo_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::loadTimestep_action, treeConstructor_loadTimestep_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::dataChanged_action, treeConstructor_dataChanged_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::beginTimestep_action, treeConstructor_beginTimestep_action);
 HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::construct_action, treeConstructor_construct_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::planLayout_action, treeConstructor_planLayout_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::sampleCosts_action, treeConstructor_sampleCosts_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::fingerprint_action, treeConstructor_fingerprint_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::openCache_action, treeConstructor_openCache_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::storeCache_action, treeConstructor_storeCache_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::stats_action, treeConstructor_stats_action);
 HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::startSweep_action, treeConstructor_startSweep_action);
-HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::continueLocalSweep_action, treeConstructor_continueLocalSweep_action);
\ No newline at end of file
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::continueLocalSweep_action, treeConstructor_continueLocalSweep_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::continueSweep_action, treeConstructor_continueSweep_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::acknowledge_action, treeConstructor_acknowledge_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::finishChild_action, treeConstructor_finishChild_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::startPart_action, treeConstructor_startPart_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::probe_action, treeConstructor_probe_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::probeReport_action, treeConstructor_probeReport_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::terminate_action, treeConstructor_terminate_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::census_action, treeConstructor_census_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::censusReport_action, treeConstructor_censusReport_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::startTrunk_action, treeConstructor_startTrunk_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::collectTrunk_action, treeConstructor_collectTrunk_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::buildTrunk_action, treeConstructor_buildTrunk_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::writeShard_action, treeConstructor_writeShard_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::findArcs_action, treeConstructor_findArcs_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::writeVtk_action, treeConstructor_writeVtk_action);
+HPX_REGISTER_ACTION_DECLARATION(TreeConstructor::vtkLabels_action, treeConstructor_vtkLabels_action);
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <hpx/hpx.hpp>
+#include <hpx/serialization/access.hpp>
+
+/*
+ * Binary merge tree output, one shard per locality plus an index. All integers are little endian, vertices are
+ * linear grid indices. Files:
+ *
+ *   <prefix>.mti            IndexHeader, then per locality arcRow, numArcs, numParts, numVertices and bytes
+ *                           of its shard (uint64_t each)
+ *   <prefix>.<locality>.mts ShardHeader, the encoded augmentation parts, padding to 8 bytes, the PartRecord
+ *                           table sorted by arc, the ArcRecord table sorted by extremum
+ *
+ * The arcs of a shard are those that started on its locality; the arc table of all shards is one table of
+ * numArcs rows, shard l holding the rows from arcRow on. An arc that swept on several localities has one
+ * augmentation part in every shard it swept in. The tables are fixed-size records, so a reader that maps the
+ * files can binary search an arc and decode only its parts, see decodeVertices().
+ *
+ * A part is encoded as runs of consecutive vertices in ascending order: for every run the gap to the end of the
+ * previous run (to 0 for the first) and the length minus one, both as LEB128 varints.
+ */
+
+const uint32_t TREE_FORMAT_VERSION = 1;
+// ShardHeader::flags and IndexHeader::flags: the shards hold the augmentation
+const uint32_t TREE_FLAG_AUGMENTATION = 1;
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numShards;
+    uint32_t gridSize[3];
+    uint32_t flags;
+    uint64_t numArcs;
+};
+
+struct ShardHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t locality;
+    uint32_t gridSize[3];
+    uint32_t flags;
+    // global row of the first arc of this shard
+    uint64_t arcRow;
+    uint64_t numArcs;
+    // file offset of the ArcRecord table
+    uint64_t arcTable;
+    uint64_t numParts;
+    // file offset of the PartRecord table
+    uint64_t partTable;
+};
+
+// parent is the global row of the arc that starts at saddle; saddle and parent are INVALID_VERTEX for the root
+struct ArcRecord {
+    uint64_t extremum;
+    uint64_t saddle;
+    uint64_t parent;
+};
+
+// the vertices of arc (its extremum) swept on the locality of the shard; offset is a file offset
+struct PartRecord {
+    uint64_t arc;
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t count;
+};
+
+static_assert(sizeof(IndexHeader) == 40, "IndexHeader must not be padded");
+static_assert(sizeof(ShardHeader) == 72, "ShardHeader must not be padded");
+static_assert(sizeof(ArcRecord) == 24 && sizeof(PartRecord) == 32, "records must not be padded");
+
+/*
+ * Summary of a shard, returned to the locality that writes the index.
+ */
+class ShardInfo{
+public:
+    uint64_t arcRow = 0;
+    uint64_t numArcs = 0;
+    uint64_t numParts = 0;
+    uint64_t numVertices = 0;
+    uint64_t bytes = 0;
+    uint32_t gridSize[3] = {0, 0, 0};
+    uint32_t flags = 0;
+
+private:
+    friend class hpx::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive& ar, const unsigned int version){
+        ar & arcRow;
+        ar & numArcs;
+        ar & numParts;
+        ar & numVertices;
+        ar & bytes;
+        ar & gridSize[0] & gridSize[1] & gridSize[2];
+        ar & flags;
+    }
+};
+
+inline std::string shardFileName(const std::string& prefix, uint32_t locality){
+    return prefix + "." + std::to_string(locality) + ".mts";
+}
+
+inline std::string indexFileName(const std::string& prefix){
+    return prefix + ".mti";
+}
+
+inline void putVarint(std::vector<uint8_t>& out, uint64_t x){
+    while (x >= 0x80){
+        out.push_back(static_cast<uint8_t>(x) | 0x80);
+        x >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(x));
+}
+
+inline uint64_t getVarint(const uint8_t*& in){
+    uint64_t x = 0;
+    for (uint32_t shift = 0; ; shift += 7){
+        const uint8_t b = *in++;
+        x |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return x;
+    }
+}
+
+// vertices must be sorted ascending and unique
+inline std::vector<uint8_t> encodeVertices(const std::vector<uint64_t>& vertices){
+    std::vector<uint8_t> out;
+    out.reserve(vertices.size() / 4 + 16);
+    uint64_t end = 0;
+    for (size_t i = 0; i < vertices.size();){
+        size_t j = i + 1;
+        while (j < vertices.size() && vertices[j] == vertices[j - 1] + 1)
+            ++j;
+        putVarint(out, vertices[i] - end);
+        putVarint(out, j - i - 1);
+        end = vertices[j - 1] + 1;
+        i = j;
+    }
+    return out;
+}
+
+// appends the count vertices of an encoded part to out
+inline void decodeVertices(const uint8_t* in, uint64_t count, std::vector<uint64_t>& out){
+    uint64_t end = 0;
+    while (count > 0){
+        const uint64_t first = end + getVarint(in);
+        const uint64_t length = getVarint(in) + 1;
+        for (uint64_t v = first; v < first + length; ++v)
+            out.push_back(v);
+        end = first + length;
+        count -= length;
+    }
+}
+
+/**
+ * @brief Streams the shard of one locality. Parts are appended while the sweeps run, as soon as the augmentation
+ * of a part is final; they are encoded by the calling task and only the file write is serialized. close() writes
+ * the tables and the header.
+ */
+class ShardWriter {
+public:
+    ShardWriter(const std::string& prefix, uint32_t locality, bool augmentation)
+        : locality(locality)
+        , augmentation(augmentation){
+        this->file.open(shardFileName(prefix, locality), std::ios::binary | std::ios::trunc);
+        if (!this->file)
+            throw std::runtime_error("Can not open " + shardFileName(prefix, locality));
+
+        // the header is written again by close()
+        ShardHeader header = ShardHeader();
+        this->file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        this->offset = sizeof(header);
+    }
+
+    ShardWriter(const ShardWriter& ) = delete;
+    ShardWriter& operator=(const ShardWriter& ) = delete;
+
+    bool writesAugmentation() const {
+        return this->augmentation;
+    }
+
+    // vertices: linear grid indices in any order, swept by the arc with extremum arc on this locality
+    void writePart(uint64_t arc, std::vector<uint64_t>&& vertices){
+        if (!this->augmentation || vertices.empty())
+            return;
+
+        std::sort(vertices.begin(), vertices.end());
+        const std::vector<uint8_t> encoded = encodeVertices(vertices);
+
+        std::lock_guard<hpx::lcos::local::mutex> lock(this->fileLock);
+        this->parts.push_back(PartRecord{arc, this->offset, encoded.size(), vertices.size()});
+        this->file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+        this->offset += encoded.size();
+        this->numVertices += vertices.size();
+    }
+
+    // arcs: sorted by extremum, parents resolved to global rows
+    ShardInfo close(const std::vector<ArcRecord>& arcs, uint64_t arcRow, const uint32_t gridSize[3]){
+        std::lock_guard<hpx::lcos::local::mutex> lock(this->fileLock);
+
+        std::sort(this->parts.begin(), this->parts.end(), [](const PartRecord& a, const PartRecord& b){ return a.arc < b.arc; });
+
+        // the tables start 8 byte aligned so that a mapped file can be read in place
+        const uint64_t padding = (8 - this->offset % 8) % 8;
+        const char zeros[8] = {0};
+        this->file.write(zeros, padding);
+        this->offset += padding;
+
+        ShardHeader header;
+        std::memcpy(header.magic, "MTSHARD", 8);
+        header.version = TREE_FORMAT_VERSION;
+        header.locality = this->locality;
+        std::copy(gridSize, gridSize + 3, header.gridSize);
+        header.flags = this->augmentation ? TREE_FLAG_AUGMENTATION : 0;
+        header.arcRow = arcRow;
+        header.numArcs = arcs.size();
+        header.numParts = this->parts.size();
+        header.partTable = this->offset;
+        header.arcTable = header.partTable + this->parts.size() * sizeof(PartRecord);
+
+        this->file.write(reinterpret_cast<const char*>(this->parts.data()), this->parts.size() * sizeof(PartRecord));
+        this->file.write(reinterpret_cast<const char*>(arcs.data()), arcs.size() * sizeof(ArcRecord));
+        this->file.seekp(0);
+        this->file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        this->file.close();
+        if (!this->file)
+            throw std::runtime_error("Writing the shard of locality " + std::to_string(this->locality) + " failed");
+
+        ShardInfo info;
+        info.arcRow = arcRow;
+        info.numArcs = arcs.size();
+        info.numParts = this->parts.size();
+        info.numVertices = this->numVertices;
+        info.bytes = header.arcTable + arcs.size() * sizeof(ArcRecord);
+        std::copy(gridSize, gridSize + 3, info.gridSize);
+        info.flags = header.flags;
+        return info;
+    }
+
+private:
+    uint32_t locality;
+    bool augmentation;
+
+    // protects the members below
+    hpx::lcos::local::mutex fileLock;
+    std::ofstream file;
+    uint64_t offset = 0;
+    uint64_t numVertices = 0;
+    std::vector<PartRecord> parts;
+};
+
+// shards: the summaries of all localities in locality order
+inline void writeIndex(const std::string& prefix, const std::vector<ShardInfo>& shards){
+    IndexHeader header;
+    std::memcpy(header.magic, "MTINDEX", 8);
+    header.version = TREE_FORMAT_VERSION;
+    header.numShards = static_cast<uint32_t>(shards.size());
+    std::copy(shards[0].gridSize, shards[0].gridSize + 3, header.gridSize);
+    header.flags = shards[0].flags;
+    header.numArcs = 0;
+    for (const ShardInfo& shard : shards)
+        header.numArcs += shard.numArcs;
+
+    std::ofstream file(indexFileName(prefix), std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const ShardInfo& shard : shards){
+        const uint64_t entry[5] = {shard.arcRow, shard.numArcs, shard.numParts, shard.numVertices, shard.bytes};
+        file.write(reinterpret_cast<const char*>(entry), sizeof(entry));
+    }
+    if (!file)
+        throw std::runtime_error("Can not write " + indexFileName(prefix));
+}
@@ -26,7 +26,8 @@ public:
     }
 
     friend std::ostream & operator<< (std::ostream &out, Value const &t){
-        out << "(" << t.value << "," << t.vertex << ")";
+        // unary plus prints 8-bit values as numbers instead of characters
+        out << "(" << +t.value << "," << t.vertex << ")";
         return out;
     }
 
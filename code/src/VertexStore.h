@@ -0,0 +1,253 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <hpx/hpx.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Memory of the per-vertex arrays of a block (values, mask, ranks, swept, UF), which are all indexed by the
+ * local vertex index.
+ *
+ * In core the arrays are plain heap memory. Out of core they are mapped from one scratch file, so a block may be
+ * larger than the memory of its node: the kernel writes evicted pages back to the file and reads them again on
+ * the next access. The local vertex indices are split into groups of GROUP_SIZE (64 bricks of 8^3 vertices in the
+ * bricked layout), and the pages of a group are loaded and evicted together in all arrays. The sweeps touch() the
+ * group they work in and prefetch() the groups next to their frontier; once more groups are resident than the
+ * budget allows, the least recently used quarter is evicted. Passes over the whole block (reading the input,
+ * ranks, init of the arrays) stream through the file and are followed by evictAll().
+ * The accounting is approximate, a group that is evicted while a sweep works in it is simply faulted in again.
+ */
+class VertexStore {
+public:
+    static const uint64_t GROUP_SHIFT = 15;
+    static const uint64_t GROUP_SIZE = 1ull << GROUP_SHIFT;
+
+    // in core
+    explicit VertexStore(uint64_t numVertices) : numVertices(numVertices){}
+
+    // out of core: the arrays live in a file in dir, and about budget bytes of them in memory
+    VertexStore(uint64_t numVertices, const std::string& dir, uint64_t budget, uint32_t block)
+        : numVertices(numVertices)
+        , budget(budget)
+        , numGroups((numVertices + GROUP_SIZE - 1) >> GROUP_SHIFT)
+        , lastUse(new std::atomic<uint64_t>[numGroups])
+        , resident(new std::atomic<uint8_t>[numGroups]){
+        for (uint64_t g = 0; g < this->numGroups; ++g){
+            this->lastUse[g].store(0, std::memory_order_relaxed);
+            this->resident[g].store(0, std::memory_order_relaxed);
+        }
+
+        // the file is unlinked right away, it goes with the process
+        const std::string name = dir + "/block" + std::to_string(block) + "." + std::to_string(getpid()) + ".vtx";
+        this->file = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (this->file < 0)
+            throw std::runtime_error("Cannot create " + name + ": " + std::strerror(errno));
+        unlink(name.c_str());
+    }
+
+    VertexStore(const VertexStore&) = delete;
+    VertexStore& operator=(const VertexStore&) = delete;
+
+    ~VertexStore(){
+        for (const Region& region : this->regions){
+            if (this->outOfCore())
+                munmap(region.data, region.bytes);
+            else
+                ::operator delete(region.data);
+        }
+        if (this->file >= 0)
+            close(this->file);
+    }
+
+    bool outOfCore() const {
+        return this->file >= 0;
+    }
+
+    // uninitialized memory for one T per vertex, valid as long as the store; zeroed out of core
+    template <typename T>
+    T* allocate(){
+        const uint64_t bytes = pageAlign(this->numVertices * sizeof(T));
+        void* data;
+        uint64_t offset = 0;
+        if (this->outOfCore()){
+            offset = this->fileSize;
+            if (ftruncate(this->file, offset + bytes) != 0)
+                throw std::runtime_error(std::string("Cannot grow the out of core file: ") + std::strerror(errno));
+            data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, this->file, offset);
+            if (data == MAP_FAILED)
+                throw std::runtime_error(std::string("Cannot map the out of core file: ") + std::strerror(errno));
+            this->fileSize = offset + bytes;
+        } else {
+            data = ::operator new(bytes);
+        }
+
+        std::lock_guard<hpx::lcos::local::spinlock> lock(this->lock);
+        this->regions.push_back(Region{data, bytes, sizeof(T), offset});
+        this->groupBytes += GROUP_SIZE * sizeof(T);
+        this->maxResident = std::max<uint64_t>(4, this->budget / this->groupBytes);
+        return static_cast<T*>(data);
+    }
+
+    // the group of local vertex index v is in use
+    void touch(uint64_t v){
+        const uint64_t g = v >> GROUP_SHIFT;
+        this->lastUse[g].store(this->clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+        this->load(g);
+    }
+
+    // the group of local vertex index v will be needed soon
+    void prefetch(uint64_t v){
+        const uint64_t g = v >> GROUP_SHIFT;
+        if (this->resident[g].load(std::memory_order_relaxed) == 0){
+            this->lastUse[g].store(this->clock.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            this->load(g);
+        }
+    }
+
+    // writes back and drops all groups, after a pass over the whole block
+    void evictAll(){
+        if (!this->outOfCore())
+            return;
+        std::lock_guard<hpx::lcos::local::spinlock> lock(this->evictLock);
+        for (uint64_t g = 0; g < this->numGroups; ++g)
+            this->resident[g].store(0, std::memory_order_relaxed);
+        this->numResident.store(0);
+        for (const Region& region : this->regions)
+            this->release(region, 0, region.bytes);
+    }
+
+    uint64_t getFileSize() const {
+        return this->fileSize;
+    }
+
+    // groups loaded and evicted by the sweeps
+    uint64_t getLoads() const {
+        return this->loads.load();
+    }
+
+    uint64_t getEvictions() const {
+        return this->evictions.load();
+    }
+
+private:
+    struct Region {
+        void* data;
+        uint64_t bytes;
+        uint64_t elementSize;
+        // out of core: where the region is in the file
+        uint64_t offset;
+    };
+
+    static uint64_t pageAlign(uint64_t bytes){
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        return std::max<uint64_t>(page, (bytes + page - 1) / page * page);
+    }
+
+    // calls f(region, begin, bytes) with the pages of group g in every array; a page shared with the next group
+    // goes with both
+    template <typename F>
+    void forPages(uint64_t g, F f){
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        for (const Region& region : this->regions){
+            const uint64_t begin = (g << GROUP_SHIFT) * region.elementSize / page * page;
+            const uint64_t end = std::min(region.bytes, pageAlign(((g + 1) << GROUP_SHIFT) * region.elementSize));
+            if (begin < end)
+                f(region, begin, end - begin);
+        }
+    }
+
+    /*
+     * Writes back and frees the pages [begin, begin + bytes) of region. MADV_PAGEOUT does both. Without it (before
+     * Linux 5.4, or EINVAL) MADV_DONTNEED alone only unmaps the pages of the shared mapping, the dirty ones stay in
+     * the page cache: they are written back with msync() first, then dropped from the mapping and the page cache.
+     */
+    void release(const Region& region, uint64_t begin, uint64_t bytes){
+        char* data = static_cast<char*>(region.data) + begin;
+#ifdef MADV_PAGEOUT
+        if (this->pageOut.load(std::memory_order_relaxed)){
+            if (madvise(data, bytes, MADV_PAGEOUT) == 0)
+                return;
+            this->pageOut.store(false, std::memory_order_relaxed);
+        }
+#endif
+        msync(data, bytes, MS_SYNC);
+        madvise(data, bytes, MADV_DONTNEED);
+        posix_fadvise(this->file, region.offset + begin, bytes, POSIX_FADV_DONTNEED);
+    }
+
+    void load(uint64_t g){
+        if (this->resident[g].load(std::memory_order_relaxed) != 0 || this->resident[g].exchange(1) != 0)
+            return;
+        ++this->loads;
+        this->forPages(g, [](const Region& region, uint64_t begin, uint64_t bytes){
+            madvise(static_cast<char*>(region.data) + begin, bytes, MADV_WILLNEED);
+        });
+        if (this->numResident.fetch_add(1) + 1 > this->maxResident)
+            this->evict();
+    }
+
+    // evicts the least recently used groups down to 3/4 of the budget; a sweep that finds another one evicting goes on
+    void evict(){
+        std::unique_lock<hpx::lcos::local::spinlock> lock(this->evictLock, std::try_to_lock);
+        if (!lock.owns_lock())
+            return;
+
+        std::vector<std::pair<uint64_t, uint64_t>> groups;
+        for (uint64_t g = 0; g < this->numGroups; ++g){
+            if (this->resident[g].load(std::memory_order_relaxed) != 0)
+                groups.emplace_back(this->lastUse[g].load(std::memory_order_relaxed), g);
+        }
+        const uint64_t keep = this->maxResident * 3 / 4;
+        if (groups.size() <= keep)
+            return;
+
+        const uint64_t count = groups.size() - keep;
+        std::nth_element(groups.begin(), groups.begin() + count, groups.end());
+        for (uint64_t i = 0; i < count; ++i){
+            this->resident[groups[i].second].store(0, std::memory_order_relaxed);
+            this->forPages(groups[i].second, [this](const Region& region, uint64_t begin, uint64_t bytes){
+                this->release(region, begin, bytes);
+            });
+        }
+        this->numResident.fetch_sub(count);
+        this->evictions += count;
+    }
+
+    const uint64_t numVertices;
+    const uint64_t budget = 0;
+    const uint64_t numGroups = 0;
+
+    // out of core: the scratch file, -1 in core
+    int file = -1;
+    uint64_t fileSize = 0;
+    hpx::lcos::local::spinlock lock;
+    std::vector<Region> regions;
+    // bytes of one group in all arrays, and the number of groups that fit in the budget
+    uint64_t groupBytes = 0;
+    uint64_t maxResident = 0;
+
+    // per group: the clock of its last touch() and whether it is resident
+    std::unique_ptr<std::atomic<uint64_t>[]> lastUse;
+    std::unique_ptr<std::atomic<uint8_t>[]> resident;
+    std::atomic<uint64_t> clock{1};
+    std::atomic<uint64_t> numResident{0};
+    hpx::lcos::local::spinlock evictLock;
+    std::atomic<uint64_t> loads{0};
+    std::atomic<uint64_t> evictions{0};
+    // MADV_PAGEOUT works on this kernel, see release()
+    std::atomic<bool> pageOut{true};
+};
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <hpx/serialization/access.hpp>
+#include <hpx/serialization/vector.hpp>
+
+#include "DataManager.h"
+
+/*
+ * VTK XML output of the segmentation (ImageData) and of the arcs (PolyData), one piece per locality. The pieces
+ * store their arrays as raw appended binary, each array a UInt64 byte count followed by the data; the .pvti and
+ * .pvtp files written by locality 0 only list the pieces. The ImageData pieces share a point layer with their
+ * upper neighbors as VTK expects, else the cells between two blocks would be missing.
+ */
+
+/*
+ * Point extent of a piece, inclusive as in VTK, and the number of arcs in its PolyData piece.
+ */
+class VtkPiece{
+public:
+    uint32_t extent[6] = {0, 0, 0, 0, 0, 0};
+    uint64_t numArcs = 0;
+
+private:
+    friend class hpx::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive& ar, const unsigned int version){
+        for (uint32_t& e : extent)
+            ar & e;
+        ar & numArcs;
+    }
+};
+
+/*
+ * Labels of the points of a box (inclusive extent) in the block of one locality, x fastest; the points that a piece
+ * shares with a neighbor. No labels if the box does not meet the block.
+ */
+class VtkLabels{
+public:
+    uint32_t extent[6] = {0, 0, 0, 0, 0, 0};
+    std::vector<uint64_t> labels;
+
+    bool contains(uint32_t x, uint32_t y, uint32_t z) const {
+        return !this->labels.empty() && x >= this->extent[0] && x <= this->extent[1] && y >= this->extent[2]
+            && y <= this->extent[3] && z >= this->extent[4] && z <= this->extent[5];
+    }
+
+    uint64_t at(uint32_t x, uint32_t y, uint32_t z) const {
+        const uint64_t sizeX = this->extent[1] - this->extent[0] + 1;
+        const uint64_t sizeY = this->extent[3] - this->extent[2] + 1;
+        return this->labels[((z - this->extent[4]) * sizeY + (y - this->extent[2])) * sizeX + (x - this->extent[0])];
+    }
+
+private:
+    friend class hpx::serialization::access;
+
+    template <typename Archive>
+    void serialize(Archive& ar, const unsigned int version){
+        for (uint32_t& e : extent)
+            ar & e;
+        ar & labels;
+    }
+};
+
+inline std::string vtiPieceName(const std::string& prefix, uint32_t locality){
+    return prefix + "_" + std::to_string(locality) + ".vti";
+}
+
+inline std::string vtpPieceName(const std::string& prefix, uint32_t locality){
+    return prefix + "_" + std::to_string(locality) + ".vtp";
+}
+
+/**
+ * @brief Collects the appended arrays of a piece: DataArray tags refer to them by their offset.
+ */
+class VtkAppendedData {
+public:
+    // adds the array and returns the DataArray tag of it, attributes are the type and name attributes
+    template <typename T>
+    std::string add(const std::string& attributes, const std::vector<T>& data){
+        return this->add(attributes, data.data(), data.size());
+    }
+
+    template <typename T>
+    std::string add(const std::string& attributes, const T* data, uint64_t count){
+        std::ostringstream tag;
+        tag << "<DataArray " << attributes << " format=\"appended\" offset=\"" << this->offset << "\"/>";
+        this->arrays.push_back(std::make_pair(static_cast<const void*>(data), count * sizeof(T)));
+        this->offset += sizeof(uint64_t) + count * sizeof(T);
+        return tag.str();
+    }
+
+    void write(std::ostream& out) const {
+        out << "  <AppendedData encoding=\"raw\">\n   _";
+        for (const std::pair<const void*, uint64_t>& array : this->arrays){
+            const uint64_t bytes = array.second;
+            out.write(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+            out.write(static_cast<const char*>(array.first), bytes);
+        }
+        out << "\n  </AppendedData>\n";
+    }
+
+private:
+    // the data must stay alive until write()
+    std::vector<std::pair<const void*, uint64_t>> arrays;
+    uint64_t offset = 0;
+};
+
+inline std::string vtkExtent(const uint32_t extent[6]){
+    std::ostringstream s;
+    s << extent[0] << " " << extent[1] << " " << extent[2] << " " << extent[3] << " " << extent[4] << " " << extent[5];
+    return s.str();
+}
+
+inline void openVtkFile(std::ofstream& file, const std::string& name, const std::string& type){
+    file.open(name, std::ios::binary | std::ios::trunc);
+    if (!file)
+        throw std::runtime_error("Can not open " + name);
+    file << "<?xml version=\"1.0\"?>\n"
+         << "<VTKFile type=\"" << type << "\" version=\"1.0\" byte_order=\"LittleEndian\" header_type=\"UInt64\">\n";
+}
+
+inline void closeVtkFile(std::ofstream& file, const std::string& name){
+    file << "</VTKFile>\n";
+    file.close();
+    if (!file)
+        throw std::runtime_error("Can not write " + name);
+}
+
+/*
+ * writeLabels(out) writes the arc of every point of extent, x fastest, numLabels raw uint64_t; the labels are
+ * streamed into the appended data, so they need not be in memory at once.
+ */
+template <typename WriteLabels>
+inline void writeVtiPiece(const std::string& name, const uint32_t wholeExtent[6], const uint32_t extent[6], uint64_t numLabels, WriteLabels writeLabels){
+    std::ofstream file;
+    openVtkFile(file, name, "ImageData");
+    file << " <ImageData WholeExtent=\"" << vtkExtent(wholeExtent) << "\" Origin=\"0 0 0\" Spacing=\"1 1 1\">\n"
+         << "  <Piece Extent=\"" << vtkExtent(extent) << "\">\n"
+         << "   <PointData Scalars=\"arc\">\n    <DataArray type=\"UInt64\" Name=\"arc\" format=\"appended\" offset=\"0\"/>\n   </PointData>\n"
+         << "   <CellData/>\n"
+         << "  </Piece>\n"
+         << " </ImageData>\n";
+
+    // the only appended array, as written by VtkAppendedData
+    const uint64_t bytes = numLabels * sizeof(uint64_t);
+    file << "  <AppendedData encoding=\"raw\">\n   _";
+    file.write(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+    writeLabels(file);
+    file << "\n  </AppendedData>\n";
+    closeVtkFile(file, name);
+}
+
+/*
+ * One line per arc with saddle from its extremum to the saddle. extrema and saddles are linear grid indices,
+ * INVALID_VERTEX for the saddle of the root; the root only gets its point.
+ */
+inline void writeVtpPiece(const std::string& name, const uint32_t gridSize[3], const std::vector<uint64_t>& extrema, const std::vector<uint64_t>& saddles){
+    std::vector<float> points;
+    std::vector<uint64_t> vertices;
+    std::vector<int64_t> connectivity;
+    std::vector<int64_t> offsets;
+    std::vector<uint64_t> arcs;
+
+    auto addPoint = [&](uint64_t g){
+        points.push_back(static_cast<float>(g % gridSize[0]));
+        points.push_back(static_cast<float>((g / gridSize[0]) % gridSize[1]));
+        points.push_back(static_cast<float>(g / (static_cast<uint64_t>(gridSize[0]) * gridSize[1])));
+        vertices.push_back(g);
+        return static_cast<int64_t>(vertices.size() - 1);
+    };
+    for (uint64_t i = 0; i < extrema.size(); ++i){
+        const int64_t extremum = addPoint(extrema[i]);
+        if (saddles[i] == INVALID_VERTEX)
+            continue;
+        connectivity.push_back(extremum);
+        connectivity.push_back(addPoint(saddles[i]));
+        offsets.push_back(connectivity.size());
+        arcs.push_back(extrema[i]);
+    }
+
+    VtkAppendedData data;
+    const std::string vertexArray = data.add("type=\"UInt64\" Name=\"vertex\"", vertices);
+    const std::string arcArray = data.add("type=\"UInt64\" Name=\"arc\"", arcs);
+    const std::string pointArray = data.add("type=\"Float32\" NumberOfComponents=\"3\"", points);
+    const std::string connectivityArray = data.add("type=\"Int64\" Name=\"connectivity\"", connectivity);
+    const std::string offsetArray = data.add("type=\"Int64\" Name=\"offsets\"", offsets);
+
+    std::ofstream file;
+    openVtkFile(file, name, "PolyData");
+    file << " <PolyData>\n"
+         << "  <Piece NumberOfPoints=\"" << vertices.size() << "\" NumberOfVerts=\"0\" NumberOfLines=\"" << arcs.size()
+         << "\" NumberOfStrips=\"0\" NumberOfPolys=\"0\">\n"
+         << "   <PointData Scalars=\"vertex\">\n    " << vertexArray << "\n   </PointData>\n"
+         << "   <CellData Scalars=\"arc\">\n    " << arcArray << "\n   </CellData>\n"
+         << "   <Points>\n    " << pointArray << "\n   </Points>\n"
+         << "   <Lines>\n    " << connectivityArray << "\n    " << offsetArray << "\n   </Lines>\n"
+         << "  </Piece>\n"
+         << " </PolyData>\n";
+    data.write(file);
+    closeVtkFile(file, name);
+}
+
+// pieces: of all localities in locality order, they cover the grid; the piece files are referred to relative to the index
+inline void writeVtkIndex(const std::string& prefix, const std::vector<VtkPiece>& pieces){
+    const std::string base = prefix.substr(prefix.find_last_of('/') + 1);
+    uint32_t wholeExtent[6] = {0, 0, 0, 0, 0, 0};
+    for (const VtkPiece& piece : pieces){
+        for (uint32_t d = 0; d < 3; ++d)
+            wholeExtent[2 * d + 1] = std::max(wholeExtent[2 * d + 1], piece.extent[2 * d + 1]);
+    }
+
+    std::ofstream pvti;
+    openVtkFile(pvti, prefix + ".pvti", "PImageData");
+    pvti << " <PImageData WholeExtent=\"" << vtkExtent(wholeExtent) << "\" GhostLevel=\"0\" Origin=\"0 0 0\" Spacing=\"1 1 1\">\n"
+         << "  <PPointData Scalars=\"arc\">\n   <PDataArray type=\"UInt64\" Name=\"arc\"/>\n  </PPointData>\n";
+    for (uint32_t l = 0; l < pieces.size(); ++l)
+        pvti << "  <Piece Extent=\"" << vtkExtent(pieces[l].extent) << "\" Source=\"" << vtiPieceName(base, l) << "\"/>\n";
+    pvti << " </PImageData>\n";
+    closeVtkFile(pvti, prefix + ".pvti");
+
+    std::ofstream pvtp;
+    openVtkFile(pvtp, prefix + ".pvtp", "PPolyData");
+    pvtp << " <PPolyData GhostLevel=\"0\">\n"
+         << "  <PPointData Scalars=\"vertex\">\n   <PDataArray type=\"UInt64\" Name=\"vertex\"/>\n  </PPointData>\n"
+         << "  <PCellData Scalars=\"arc\">\n   <PDataArray type=\"UInt64\" Name=\"arc\"/>\n  </PCellData>\n"
+         << "  <PPoints>\n   <PDataArray type=\"Float32\" NumberOfComponents=\"3\"/>\n  </PPoints>\n";
+    for (uint32_t l = 0; l < pieces.size(); ++l)
+        pvtp << "  <Piece Source=\"" << vtpPieceName(base, l) << "\"/>\n";
+    pvtp << " </PPolyData>\n";
+    closeVtkFile(pvtp, prefix + ".pvtp");
+}
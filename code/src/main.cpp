@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include <hpx/futures/future_fwd.hpp>
 #include <hpx/hpx.hpp>
 #include <hpx/hpx_init.hpp>
@@ -20,8 +22,27 @@ int hpx_main(hpx::program_options::variables_map& vm){
     if(vm.count("no-trunkskip")){
         options.trunkskip = false;
     }
+    options.rankorder = vm.count("rank-order") > 0;
+    options.compact = vm.count("compact") > 0;
+    if (vm.count("output"))
+        options.output = vm["output"].as<std::string>();
+    options.augmentation = vm.count("no-augmentation") == 0;
+    if (vm.count("vtk"))
+        options.vtk = vm["vtk"].as<std::string>();
+    options.flat = vm.count("flat-augmentation") > 0;
+    options.balance = vm.count("balance") ? vm["balance"].as<uint32_t>() : 0;
+    options.balanceWeight = vm["balance-weight"].as<float>();
+    options.halo = vm.count("halo-exchange") > 0;
+    options.bricked = vm.count("bricked") > 0;
+    if (vm.count("cache"))
+        options.cache = vm["cache"].as<std::string>();
+    if (vm.count("out-of-core"))
+        options.scratch = vm["out-of-core"].as<std::string>();
+    options.memoryBudget = static_cast<uint64_t>(vm["memory-budget"].as<uint32_t>()) << 20;
 
     std::string input;
+    // timesteps: the inputs of the series, one per line of the list; the first is the input
+    std::vector<std::string> timesteps;
     try {
         if (vm.count("hpx:positional")) {
             std::vector<std::string> positionals = vm["hpx:positional"].as<std::vector<std::string>>();
@@ -29,6 +50,22 @@ int hpx_main(hpx::program_options::variables_map& vm){
             if (positionals.size() >= 1)
                 input = positionals.back();
         }
+        if (vm.count("timesteps")) {
+            const std::string list = vm["timesteps"].as<std::string>();
+            std::ifstream in(list);
+            if (!in)
+                throw std::runtime_error("Can not open " + list);
+            std::string line;
+            while (std::getline(in, line)) {
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                if (!line.empty())
+                    timesteps.push_back(line);
+            }
+            if (timesteps.empty())
+                throw std::runtime_error("No timesteps in " + list);
+            input = timesteps.front();
+        }
         if (input.empty())
             throw std::runtime_error("No input specified");
 
@@ -40,39 +77,249 @@ int hpx_main(hpx::program_options::variables_map& vm){
         std::cout << "Check --h for details." << std::endl;
         return hpx::finalize();
     }
+    options.timesteps = timesteps.size();
+    if (!timesteps.empty() && !options.cache.empty()){
+        std::cout << "--timesteps can not be combined with --cache" << std::endl;
+        return hpx::finalize();
+    }
 
     std::vector<hpx::id_type> localities = hpx::find_all_localities();
 
+    // one block per component; several components on a locality share its thread pool
+    uint32_t numBlocks = localities.size();
+    if (vm.count("blocks"))
+        numBlocks = vm["blocks"].as<uint32_t>();
+    if (numBlocks < localities.size() || numBlocks > MAX_BLOCKS){
+        std::cout << "--blocks must be between the number of localities (" << localities.size() << ") and " << MAX_BLOCKS << std::endl;
+        return hpx::finalize();
+    }
+
     /* initialize components */
     hpx::chrono::high_resolution_timer timer;
 
+    // consecutive blocks go to the same locality, they are neighbors (along x, or in the planned k-d tree) and exchange
+    // most of their messages locally
+    std::vector<hpx::future<hpx::id_type>> componentFutures;
+    for (uint32_t b = 0; b < numBlocks; ++b){
+        componentFutures.push_back(hpx::new_<TreeConstructor>(localities[uint64_t(b) * localities.size() / numBlocks]));
+    }
     std::vector<hpx::id_type> treeConstructors;
-    for(hpx::id_type locality: localities){
-        treeConstructors.push_back(hpx::new_<TreeConstructor>(locality).get());
+    for (hpx::future<hpx::id_type>& f : componentFutures){
+        treeConstructors.push_back(f.get());
+    }
+    LogInfo() << "Blocks: " << numBlocks << " on " << localities.size() << " localities";
+
+    /* plan the blocks */
+    BlockLayout layout;
+    if (options.balance > 0 && numBlocks > 1){
+        timer.restart();
+        try {
+            layout = hpx::async<TreeConstructor::planLayout_action>(treeConstructors[0], treeConstructors, input, options).get();
+        } catch (const std::exception& e) {
+            std::cout << "Planning error: " << e.what() << std::endl;
+            return hpx::finalize();
+        }
+        LogInfo() << "Plan: " << timer.elapsed() << " s";
+    }
+
+    /* cache: the key of the input, the decomposition and the options; with a valid entry on every component the
+       result is taken from the cache and init and the sweeps are skipped */
+    bool cached = false;
+    if (!options.cache.empty()){
+        timer.restart();
+        std::vector<hpx::future<uint64_t>> fingerprintFutures;
+        for (uint32_t b = 0; b < numBlocks; ++b){
+            fingerprintFutures.push_back(hpx::async<TreeConstructor::fingerprint_action>(treeConstructors[b], input, b, numBlocks));
+        }
+        uint64_t key = hashValue(numBlocks, options.resultHash());
+        key = hashValues(layout.offsets, hashValues(layout.sizes, key));
+        try {
+            for (hpx::future<uint64_t>& f : fingerprintFutures){
+                key = hashValue(f.get(), key);
+            }
+        } catch (const std::exception& e) {
+            std::cout << "Cache error: " << e.what() << std::endl;
+            return hpx::finalize();
+        }
+
+        std::vector<hpx::future<bool>> cacheFutures;
+        for (hpx::id_type treeConstructor : treeConstructors){
+            cacheFutures.push_back(hpx::async<TreeConstructor::openCache_action>(treeConstructor, treeConstructors, options, key));
+        }
+        uint32_t hits = 0;
+        for (hpx::future<bool>& f : cacheFutures){
+            hits += f.get() ? 1 : 0;
+        }
+        cached = (hits == numBlocks);
+        LogInfo() << "Cache: " << cachePrefix(options.cache, key) << ", " << hits << " of " << numBlocks << " entries valid, "
+                  << timer.elapsed() << " s";
     }
 
     /* init */
-    timer.restart();
-    std::vector<hpx::shared_future<void>> initFutures;
-    for(hpx::id_type treeConstructor: treeConstructors){
-        initFutures.push_back(hpx::async<TreeConstructor::init_action>(treeConstructor, treeConstructors, input, options));
+    if (!cached){
+        timer.restart();
+        std::vector<hpx::shared_future<void>> initFutures;
+        for(hpx::id_type treeConstructor: treeConstructors){
+            initFutures.push_back(hpx::async<TreeConstructor::init_action>(treeConstructor, treeConstructors, input, options, layout));
+        }
+        hpx::lcos::wait_all(initFutures);
+        try {
+            for (hpx::shared_future<void>& f : initFutures){
+                f.get();
+            }
+        } catch (const std::exception& e) {
+            std::cout << "Initialization error: " << e.what() << std::endl;
+            return hpx::finalize();
+        }
+        LogInfo() << "Initialization: " << timer.elapsed() << " s"; 
     }
-    hpx::lcos::wait_all(initFutures);
-    LogInfo() << "Initialization: " << timer.elapsed() << " s"; 
-
-    /* Construction */
-    timer.restart();
-    std::vector<hpx::shared_future<uint64_t>> constructFutures;
-    for (hpx::id_type treeConstructor : treeConstructors){
-        constructFutures.push_back(hpx::async<TreeConstructor::construct_action>(treeConstructor));
+
+    const uint32_t numSteps = std::max<uint32_t>(1, options.timesteps);
+    for (uint32_t step = 0; step < numSteps; ++step){
+
+        /* timesteps: the components, the blocks and their arrays are kept, only the values are read again */
+        if (step > 0){
+            timer.restart();
+            std::vector<hpx::future<void>> loadFutures;
+            for (hpx::id_type treeConstructor : treeConstructors){
+                loadFutures.push_back(hpx::async<TreeConstructor::loadTimestep_action>(treeConstructor, timesteps[step], step));
+            }
+            try {
+                for (hpx::future<void>& f : loadFutures){
+                    f.get();
+                }
+            } catch (const std::exception& e) {
+                std::cout << "Timestep error: " << e.what() << std::endl;
+                return hpx::finalize();
+            }
+            LogInfo() << "Timestep " << step << ": " << timesteps[step] << ", read in " << timer.elapsed() << " s";
+        }
+
+        /* halo: all blocks are allocated, the ghost layers can be exchanged */
+        if (options.halo && !cached){
+            timer.restart();
+            std::vector<hpx::future<void>> haloFutures;
+            for (hpx::id_type treeConstructor : treeConstructors){
+                haloFutures.push_back(hpx::async<TreeConstructor::exchangeHalo_action>(treeConstructor));
+            }
+            hpx::wait_all(haloFutures);
+            LogInfo() << "Halo exchange: " << timer.elapsed() << " s";
+        }
+
+        /* timesteps: the tree of the previous timestep stands if no block has changed, else all arcs are swept
+           again; an unchanged block keeps its minima and ranks, a changed one the minima away from its changed rows */
+        if (step > 0){
+            std::vector<hpx::future<bool>> changedFutures;
+            for (hpx::id_type treeConstructor : treeConstructors){
+                changedFutures.push_back(hpx::async<TreeConstructor::dataChanged_action>(treeConstructor));
+            }
+            uint32_t changed = 0;
+            for (hpx::future<bool>& f : changedFutures){
+                changed += f.get() ? 1 : 0;
+            }
+            std::vector<hpx::future<void>> beginFutures;
+            for (hpx::id_type treeConstructor : treeConstructors){
+                beginFutures.push_back(hpx::async<TreeConstructor::beginTimestep_action>(treeConstructor, changed == 0));
+            }
+            hpx::wait_all(beginFutures);
+            LogInfo() << "Timestep " << step << ": " << changed << " of " << numBlocks << " blocks changed";
+        }
+
+        /* Construction */
+        timer.restart();
+        std::vector<hpx::shared_future<uint64_t>> constructFutures;
+        for (hpx::id_type treeConstructor : treeConstructors){
+            constructFutures.push_back(hpx::async<TreeConstructor::construct_action>(treeConstructor));
+        }
+        hpx::lcos::wait_all(constructFutures);
+
+        uint64_t finalArcCount = 0ul;
+        for (hpx::shared_future<uint64_t> c : constructFutures){
+            finalArcCount += c.get();
+        }
+        LogInfo() << "Construction: " << timer.elapsed() << " s; Total Arcs: " << finalArcCount;
+
+        /* Balance: busy time of every block and of the blocks of every locality */
+        {
+            std::vector<hpx::future<BlockStats>> statsFutures;
+            for (hpx::id_type treeConstructor : treeConstructors){
+                statsFutures.push_back(hpx::async<TreeConstructor::stats_action>(treeConstructor));
+            }
+            std::vector<double> localityBusy(localities.size(), 0.0);
+            double maxBlockBusy = 0.0;
+            double totalBusy = 0.0;
+            for (uint32_t b = 0; b < numBlocks; ++b){
+                const BlockStats stats = statsFutures[b].get();
+                const uint32_t l = uint64_t(b) * localities.size() / numBlocks;
+                LogInfo() << "Block " << b << " (locality " << l << "): busy " << stats.busy << " s, sweeps " << stats.sweeps << " s, "
+                          << stats.vertices << " vertices, " << stats.minima << " minima, " << stats.arcs << " arcs"
+                          << (layout.empty() ? std::string() : ", estimated cost " + std::to_string(layout.costs[b]));
+                localityBusy[l] += stats.busy;
+                maxBlockBusy = std::max(maxBlockBusy, stats.busy);
+                totalBusy += stats.busy;
+            }
+            for (uint32_t l = 0; l < localities.size(); ++l){
+                LogInfo() << "Locality " << l << ": busy " << localityBusy[l] << " s";
+            }
+            if (totalBusy > 0.0){
+                LogInfo() << "Balance (max / mean busy): blocks " << maxBlockBusy * numBlocks / totalBusy << ", localities "
+                          << *std::max_element(localityBusy.begin(), localityBusy.end()) * localities.size() / totalBusy;
+            }
+        }
+
+        /* Output: every locality closes its shard, the index ties them together; cache: the shards of a new entry are
+           closed without output as well */
+        if (!options.output.empty() || (!options.cache.empty() && !cached)){
+            timer.restart();
+            std::vector<uint64_t> arcRows;
+            uint64_t row = 0;
+            for (hpx::shared_future<uint64_t> c : constructFutures){
+                arcRows.push_back(row);
+                row += c.get();
+            }
+
+            std::vector<hpx::future<ShardInfo>> shardFutures;
+            for (hpx::id_type treeConstructor : treeConstructors){
+                shardFutures.push_back(hpx::async<TreeConstructor::writeShard_action>(treeConstructor, arcRows));
+            }
+            std::vector<ShardInfo> shards;
+            for (hpx::future<ShardInfo>& f : shardFutures){
+                shards.push_back(f.get());
+            }
+            if (!options.output.empty()){
+                const std::string prefix = options.stepPrefix(options.output, step);
+                writeIndex(prefix, shards);
+                LogInfo() << "Output: " << timer.elapsed() << " s; " << indexFileName(prefix);
+            }
+        }
+
+        /* VTK: every locality writes its pieces, only the index is written here */
+        if (!options.vtk.empty()){
+            timer.restart();
+            std::vector<hpx::future<VtkPiece>> pieceFutures;
+            for (hpx::id_type treeConstructor : treeConstructors){
+                pieceFutures.push_back(hpx::async<TreeConstructor::writeVtk_action>(treeConstructor));
+            }
+            std::vector<VtkPiece> pieces;
+            for (hpx::future<VtkPiece>& f : pieceFutures){
+                pieces.push_back(f.get());
+            }
+            const std::string prefix = options.stepPrefix(options.vtk, step);
+            writeVtkIndex(prefix, pieces);
+            LogInfo() << "VTK: " << timer.elapsed() << " s; " << prefix << ".pvti, " << prefix << ".pvtp";
+        }
     }
-    hpx::lcos::wait_all(constructFutures);
 
-    uint64_t finalArcCount = 0ul;
-    for (hpx::shared_future<uint64_t> c : constructFutures){
-        finalArcCount += c.get();
+    /* cache: the entries are complete once all shards are closed */
+    if (!options.cache.empty() && !cached){
+        timer.restart();
+        std::vector<hpx::future<void>> storeFutures;
+        for (hpx::id_type treeConstructor : treeConstructors){
+            storeFutures.push_back(hpx::async<TreeConstructor::storeCache_action>(treeConstructor));
+        }
+        hpx::wait_all(storeFutures);
+        LogInfo() << "Cache: stored in " << timer.elapsed() << " s";
     }
-    LogInfo() << "Construction: " << timer.elapsed() << " s; Total Arcs: " << finalArcCount;
 
     return hpx::finalize();
 }
@@ -82,7 +329,22 @@ int main(int argc, char* argv[]){
     hpx::program_options::options_description descriptions("simple_ct [options] input");
 
     descriptions.add_options()
-            ("no-trunkskip", "Perform explicit trunk computation instead of collecting dangling saddles");
+            ("blocks", hpx::program_options::value<uint32_t>(), "Number of blocks, one component each, at least the number of localities (default) and at most 1023")
+            ("balance", hpx::program_options::value<uint32_t>(), "Plan non-uniform blocks of about equal estimated cost from every n-th voxel along each axis")
+            ("balance-weight", hpx::program_options::value<float>()->default_value(4.0f), "Extra cost of a sample around a minimum of the sampled grid, relative to its voxels")
+            ("halo-exchange", "Read only the interior of every block and exchange the ghost layers between the components")
+            ("bricked", "Store the values of every block in bricks of 8x8x8 vertices for cache locality of the neighbors")
+            ("timesteps", hpx::program_options::value<std::string>(), "File listing the inputs of a time series, one .mhd per line; every timestep is constructed on the components of the first, with outputs <prefix>_t<step>; the tree is reused if no value changed, the minima only where none changed nearby")
+            ("cache", hpx::program_options::value<std::string>(), "Directory of cached results: reuse the result of an earlier run on the same input, blocks and options, or store this one")
+            ("out-of-core", hpx::program_options::value<std::string>(), "Keep the values and per-vertex sweep state of every block in a scratch file in this directory, for blocks larger than memory; best with --bricked and --flat-augmentation")
+            ("memory-budget", hpx::program_options::value<uint32_t>()->default_value(1024), "Out of core: MB of the per-vertex arrays of every block to keep in memory")
+            ("no-trunkskip", "Perform explicit trunk computation instead of collecting dangling saddles")
+            ("rank-order", "Precompute the rank of every vertex and compare ranks instead of values")
+            ("compact", "Store the per-vertex sweep state as 32 bit block-local ids")
+            ("output", hpx::program_options::value<std::string>(), "Write the merge tree as binary shards <prefix>.<locality>.mts and an index <prefix>.mti")
+            ("no-augmentation", "Only write the arc table, without the vertices of the arcs")
+            ("vtk", hpx::program_options::value<std::string>(), "Write the segmentation and the arcs as VTK pieces per locality, indexed by <prefix>.pvti and <prefix>.pvtp")
+            ("flat-augmentation", "Keep no sorted vertex lists per arc, only the arc of every vertex (no augmentation in --output)");
 
     // HPX config
     std::vector<std::string> const cfg = {
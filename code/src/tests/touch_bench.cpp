@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <hpx/hpx.hpp>
+#include <hpx/hpx_init.hpp>
+
+#include <hpx/program_options/options_description.hpp>
+#include <hpx/timing/high_resolution_timer.hpp>
+
+#include "Log.h"
+#include "RawManager.h"
+#include "SweepEngine.h"
+
+std::ofstream Log::outfile;
+hpx::lcos::local::mutex Log::outlock;
+
+/*
+ * Throughput of SweepEngine::touch(), the innermost check of the sweeps, on one block of an input.
+ * swept and UF are filled as the sweeps leave them: every vertex swept by its arc, every arc linked to its saddle
+ * (sequential union-find in the order of less()). Then every vertex is touched by the root arc in parallel, which
+ * searches UF from all its smaller neighbors. The first pass also halves the paths, the later ones find them short.
+ */
+template <typename Grid, typename Id>
+struct TouchBenchmark {
+    static void run(Grid* grid, bool flat, uint32_t passes){
+        SweepEngine<Grid, Id> engine(nullptr, grid, nullptr, flat);
+        const uint64_t numVertices = grid->getLocalIndexSize();
+        const uint64_t block = grid->getBlockIndex();
+
+        hpx::chrono::high_resolution_timer timer;
+        std::vector<uint64_t> order;
+        for (uint64_t i = 0; i < numVertices; ++i){
+            if (!grid->isGhost(i | block))
+                order.push_back(i | block);
+        }
+        hpx::sort(hpx::execution::par, order.begin(), order.end(), [grid](uint64_t a, uint64_t b){
+            return grid->lessLocal(a, b);
+        });
+
+        // components of the vertices swept so far, by local index; top is the arc of a component
+        std::vector<uint64_t> component(numVertices, INVALID_VERTEX);
+        std::vector<uint64_t> top(numVertices, INVALID_VERTEX);
+        auto find = [&component](uint64_t i){
+            while (component[i] != i){
+                component[i] = component[component[i]];
+                i = component[i];
+            }
+            return i;
+        };
+
+        uint64_t numArcs = 0;
+        uint64_t root = INVALID_VERTEX;
+        for (uint64_t v : order){
+            const uint64_t i = v & VERTEX_INDEX_MASK;
+            uint64_t neighbors[6];
+            const uint32_t numNeighbors = grid->getNeighbors(v, neighbors);
+            uint64_t roots[6];
+            uint32_t numRoots = 0;
+            for (uint32_t k = 0; k < numNeighbors; ++k){
+                const uint64_t n = neighbors[k];
+                if (n == INVALID_VERTEX || component[n & VERTEX_INDEX_MASK] == INVALID_VERTEX)
+                    continue;
+                const uint64_t r = find(n & VERTEX_INDEX_MASK);
+                if (std::find(roots, roots + numRoots, r) == roots + numRoots)
+                    roots[numRoots++] = r;
+            }
+
+            component[i] = i;
+            if (numRoots == 1){
+                component[i] = roots[0];
+                engine.swept.store(v, top[roots[0]]);
+                continue;
+            }
+            // a minimum or a saddle starts an arc, the arcs below a saddle are linked to it
+            for (uint32_t k = 0; k < numRoots; ++k){
+                engine.UF.store(top[roots[k]], v);
+                component[roots[k]] = i;
+            }
+            top[i] = v;
+            engine.swept.store(v, v);
+            root = v;
+            ++numArcs;
+        }
+        std::cout << "Vertices: " << order.size() << ", arcs: " << numArcs << ", setup: " << timer.elapsed() << " s" << std::endl;
+
+        for (uint32_t pass = 0; pass < passes; ++pass){
+            std::atomic<uint64_t> failed{0};
+            timer.restart();
+            hpx::for_loop(hpx::execution::par, static_cast<uint64_t>(0), static_cast<uint64_t>(order.size()), [&](uint64_t k){
+                if (!engine.touch(order[k], root))
+                    ++failed;
+            });
+            const double elapsed = timer.elapsed();
+            std::cout << "Pass " << pass << ": " << elapsed << " s, " << order.size() / elapsed / 1e6 << " M touch/s";
+            if (failed.load() != 0)
+                std::cout << ", " << failed.load() << " failed";
+            std::cout << std::endl;
+        }
+    }
+};
+
+template <typename T, typename... Ts>
+bool runFor(DataManager* data, bool compact, bool flat, uint32_t passes){
+    if (RegularGridManager<T>* grid = dynamic_cast<RegularGridManager<T>*>(data)){
+        if (compact)
+            TouchBenchmark<RegularGridManager<T>, uint32_t>::run(grid, flat, passes);
+        else
+            TouchBenchmark<RegularGridManager<T>, uint64_t>::run(grid, flat, passes);
+        return true;
+    }
+    if constexpr (sizeof...(Ts) > 0)
+        return runFor<Ts...>(data, compact, flat, passes);
+    return false;
+}
+
+int hpx_main(hpx::program_options::variables_map& vm){
+    std::string input;
+    if (vm.count("input")){
+        input = vm["input"].as<std::string>();
+    } else {
+        // random 8 bit volume
+        const uint32_t size = vm["size"].as<uint32_t>();
+        input = "touch_bench_random.mhd";
+        std::ofstream header(input);
+        header << "NDims = 3\nDimSize = " << size << " " << size << " " << size << "\nElementType = MET_UCHAR\nElementDataFile = touch_bench_random.raw\n";
+        std::vector<uint8_t> values(static_cast<uint64_t>(size) * size * size);
+        std::mt19937 random(1);
+        for (uint8_t& value : values)
+            value = static_cast<uint8_t>(random());
+        std::ofstream("touch_bench_random.raw", std::ios::binary).write(reinterpret_cast<const char*>(values.data()), values.size());
+    }
+
+    DataManager* data = createRawManager(input);
+    if (data == nullptr){
+        std::cout << "Can not read " << input << std::endl;
+        return hpx::finalize();
+    }
+    data->init(0, 1, BlockLayout(), true, vm.count("bricked") > 0, std::string(), 0);
+    if (vm.count("rank-order"))
+        data->computeRanks();
+
+    runFor<int8_t, uint8_t, int16_t, uint16_t, int32_t, uint32_t, float, double>(data, vm.count("compact") > 0, true, vm["passes"].as<uint32_t>());
+    delete data;
+    return hpx::finalize();
+}
+
+int main(int argc, char* argv[]){
+    hpx::program_options::options_description descriptions("touch_bench [options]");
+    descriptions.add_options()
+            ("input", hpx::program_options::value<std::string>(), "MetaImage input, one block; a random 8 bit volume if not given")
+            ("size", hpx::program_options::value<uint32_t>()->default_value(128), "Edge length of the random volume")
+            ("passes", hpx::program_options::value<uint32_t>()->default_value(3), "Touches of every vertex")
+            ("bricked", "Store the values in bricks of 8x8x8 vertices")
+            ("rank-order", "Compare precomputed ranks")
+            ("compact", "32 bit swept and UF");
+
+    hpx::init_params params;
+    params.desc_cmdline = descriptions;
+    return hpx::init(argc, argv, params);
+}
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <hpx/hpx.hpp>
+#include <hpx/hpx_init.hpp>
+
+#include <hpx/program_options/options_description.hpp>
+
+#include "DistVec.h"
+#include "Log.h"
+
+std::ofstream Log::outfile;
+hpx::lcos::local::mutex Log::outlock;
+
+/*
+ * Stress test of the union-find of the sweeps (VertexVec::reaches): many HPX tasks link arcs to their saddles and
+ * search ancestors at the same time, the answers are checked against a sequential forest.
+ *
+ * The forest is built in levels like the sweeps build it: every level merges groups of the current roots under a
+ * new saddle. While a level is linked, searches towards the roots before the level may miss the new links, but an
+ * arc they find must be an ancestor. After the level they must find exactly the ancestors. A quarter of the arcs
+ * has ids of another block, so the remote table and the foreign codes are exercised as well.
+ */
+namespace {
+
+const uint64_t BLOCK = 1ull << BLOCK_INDEX_SHIFT;
+const uint64_t OTHER_BLOCK = 2ull << BLOCK_INDEX_SHIFT;
+
+struct Forest {
+    // arc ids, parent index of every arc (-1 for roots) and the merges of every level (child, parent)
+    std::vector<uint64_t> ids;
+    std::vector<int64_t> parent;
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> levels;
+    // roots and number of arcs after every level, level 0 are the leaves
+    std::vector<std::vector<uint64_t>> roots;
+    std::vector<uint64_t> created;
+    // ancestor test by entry and exit times of a depth-first traversal of the final forest
+    std::vector<uint64_t> enter;
+    std::vector<uint64_t> exit;
+
+    bool isAncestor(uint64_t a, uint64_t b) const {
+        return this->enter[a] <= this->enter[b] && this->exit[b] <= this->exit[a];
+    }
+
+    // root of a once the merges of the levels before level are linked
+    uint64_t root(uint64_t a, uint64_t level) const {
+        while (this->parent[a] >= 0 && static_cast<uint64_t>(this->parent[a]) < this->created[level])
+            a = this->parent[a];
+        return a;
+    }
+};
+
+// numLeaves arcs, merged in groups of 2 to 4 until about numTrees roots are left
+Forest buildForest(uint64_t numLeaves, uint64_t numTrees, uint64_t numVertices, std::mt19937_64& random){
+    Forest forest;
+    std::vector<uint64_t> localIds(numVertices);
+    for (uint64_t i = 0; i < numVertices; ++i)
+        localIds[i] = i | BLOCK;
+    std::shuffle(localIds.begin(), localIds.end(), random);
+    uint64_t nextLocal = 0;
+    uint64_t nextForeign = 0;
+    auto newArc = [&](){
+        forest.ids.push_back((random() % 4 == 0) ? (nextForeign++ | OTHER_BLOCK) : localIds[nextLocal++]);
+        forest.parent.push_back(-1);
+        return forest.ids.size() - 1;
+    };
+
+    std::vector<uint64_t> roots;
+    for (uint64_t i = 0; i < numLeaves; ++i)
+        roots.push_back(newArc());
+    forest.roots.push_back(roots);
+    forest.created.push_back(forest.ids.size());
+    while (roots.size() > numTrees){
+        std::shuffle(roots.begin(), roots.end(), random);
+        std::vector<std::pair<uint64_t, uint64_t>> merges;
+        std::vector<uint64_t> next;
+        uint64_t i = 0;
+        // half of the roots stay as they are for this level
+        for (; i < roots.size() / 2; ++i)
+            next.push_back(roots[i]);
+        while (i < roots.size()){
+            const uint64_t count = std::min<uint64_t>(2 + random() % 3, roots.size() - i);
+            if (count == 1){
+                next.push_back(roots[i++]);
+                continue;
+            }
+            const uint64_t saddle = newArc();
+            for (uint64_t c = 0; c < count; ++c, ++i){
+                forest.parent[roots[i]] = static_cast<int64_t>(saddle);
+                merges.emplace_back(roots[i], saddle);
+            }
+            next.push_back(saddle);
+        }
+        roots.swap(next);
+        forest.levels.push_back(merges);
+        forest.roots.push_back(roots);
+        forest.created.push_back(forest.ids.size());
+    }
+
+    // entry and exit times, iteratively
+    const uint64_t n = forest.ids.size();
+    std::vector<std::vector<uint64_t>> children(n);
+    for (uint64_t a = 0; a < n; ++a){
+        if (forest.parent[a] >= 0)
+            children[forest.parent[a]].push_back(a);
+    }
+    forest.enter.assign(n, 0);
+    forest.exit.assign(n, 0);
+    uint64_t time = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> stack;
+    for (uint64_t r : roots){
+        stack.emplace_back(r, 0);
+        forest.enter[r] = time++;
+        while (!stack.empty()){
+            std::pair<uint64_t, uint64_t>& top = stack.back();
+            if (top.second < children[top.first].size()){
+                const uint64_t c = children[top.first][top.second++];
+                forest.enter[c] = time++;
+                stack.emplace_back(c, 0);
+            } else {
+                forest.exit[top.first] = time++;
+                stack.pop_back();
+            }
+        }
+    }
+    return forest;
+}
+
+}
+
+int hpx_main(hpx::program_options::variables_map& vm){
+    const uint64_t numVertices = vm["vertices"].as<uint64_t>();
+    const uint64_t numLeaves = numVertices / 4;
+    const uint64_t numTasks = 4 * hpx::get_num_worker_threads();
+    const uint64_t queriesPerTask = vm["queries"].as<uint64_t>();
+    std::mt19937_64 random(vm["seed"].as<uint64_t>());
+
+    const Forest forest = buildForest(numLeaves, 16, numVertices, random);
+    const uint64_t numArcs = forest.ids.size();
+    std::cout << "Arcs: " << numArcs << ", levels: " << forest.levels.size() << ", tasks: " << numTasks << std::endl;
+
+    VertexVec<uint32_t> UF;
+    UF.init(numVertices, BLOCK);
+
+    std::atomic<uint64_t> wrong{0};
+    std::atomic<uint64_t> found{0};
+    for (uint64_t level = 0; level < forest.levels.size(); ++level){
+        const std::vector<std::pair<uint64_t, uint64_t>>& merges = forest.levels[level];
+        const std::vector<uint64_t>& before = forest.roots[level];
+        const std::vector<uint64_t>& after = forest.roots[level + 1];
+
+        // links and searches at the same time: a search may miss a link, but what it finds must be an ancestor
+        const uint64_t linkSeed = random();
+        hpx::for_loop(hpx::execution::par, static_cast<uint64_t>(0), numTasks, [&](uint64_t task){
+            std::mt19937_64 taskRandom(linkSeed + task);
+            for (uint64_t m = task; m < merges.size(); m += numTasks){
+                UF.store(forest.ids[merges[m].first], forest.ids[merges[m].second]);
+                for (uint64_t q = 0; q < 4; ++q){
+                    const uint64_t a = taskRandom() % numArcs;
+                    const uint64_t r = before[taskRandom() % before.size()];
+                    if (UF.reaches(forest.ids[a], forest.ids[r]) && !forest.isAncestor(r, a))
+                        ++wrong;
+                }
+            }
+        });
+
+        // all links of the level are in: the searches towards the current roots are exact
+        const uint64_t searchSeed = random();
+        hpx::for_loop(hpx::execution::par, static_cast<uint64_t>(0), numTasks, [&](uint64_t task){
+            std::mt19937_64 taskRandom(searchSeed + task);
+            const uint64_t queries = queriesPerTask / forest.levels.size() + 1;
+            for (uint64_t q = 0; q < queries; ++q){
+                // arcs that are linked already; half of the searches towards their root, the others towards any root
+                const uint64_t a = taskRandom() % forest.created[level + 1];
+                const uint64_t r = (q % 2 == 0) ? forest.root(a, level + 1) : after[taskRandom() % after.size()];
+                const bool result = UF.reaches(forest.ids[a], forest.ids[r]);
+                const bool expected = forest.isAncestor(r, a);
+                if (result)
+                    ++found;
+                if (result != expected)
+                    ++wrong;
+            }
+        });
+    }
+
+    // every arc, towards every final root: path halving must have kept all paths
+    hpx::for_loop(hpx::execution::par, static_cast<uint64_t>(0), numArcs, [&](uint64_t a){
+        uint64_t reached = 0;
+        for (uint64_t r : forest.roots.back()){
+            if (UF.reaches(forest.ids[a], forest.ids[r])){
+                ++reached;
+                if (!forest.isAncestor(r, a))
+                    ++wrong;
+            }
+        }
+        if (reached != 1)
+            ++wrong;
+    });
+
+    std::cout << "Searches found: " << found.load() << ", wrong: " << wrong.load() << std::endl;
+    hpx::finalize();
+    return wrong.load() == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]){
+    hpx::program_options::options_description descriptions("uf_stress [options]");
+    descriptions.add_options()
+            ("vertices", hpx::program_options::value<uint64_t>()->default_value(1 << 20), "Vertices of the block, a quarter of them are leaf arcs")
+            ("queries", hpx::program_options::value<uint64_t>()->default_value(1 << 18), "Exact searches per task")
+            ("seed", hpx::program_options::value<uint64_t>()->default_value(1), "Seed of the forest and the searches");
+
+    hpx::init_params params;
+    params.desc_cmdline = descriptions;
+    return hpx::init(argc, argv, params);
+}
@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Row-major against bricked layout (--bricked) on one locality: cache and dTLB misses with perf stat, of the whole
+# construction and of touch_bench (the innermost check of the sweeps), also as a table in $REPORT
+
+APP_PATH=build/simple_ct
+BENCH_PATH=build/touch_bench
+APP_OPTIONS=data/bonsai_256x256x256_uint8.mhd
+THREADS=10
+EVENTS=cache-misses,dTLB-load-misses
+REPORT=results/bricked.md
+
+export LD_LIBRARY_PATH=$HOME/lib:$LD_LIBRARY_PATH
+
+# count of an event in the CSV output of perf stat -x,, summed over the core types of hybrid CPUs
+count() {
+    awk -F, -v event=$1 'index($3, event) > 0 && $1 ~ /^[0-9]+$/ { sum += $1; found = 1 } END { if (found) print sum }'
+}
+
+# text after the last log line "<name>: "
+field() {
+    sed -n "s/.*$1: //p" | tail -n 1
+}
+
+mkdir -p results
+echo "| layout | program | cache-misses | dTLB-load-misses | time |" > $REPORT
+echo "|---|---|---:|---:|---:|" >> $REPORT
+
+for LAYOUT in row-major bricked; do
+    echo "layout: $LAYOUT"
+    FLAGS=""
+    if [ $LAYOUT = bricked ]; then
+        FLAGS="--bricked"
+    fi
+
+    OUTPUT=$(srun -p debug -N 1 -n 1 -c $THREADS perf stat -x, -e $EVENTS $APP_PATH $APP_OPTIONS $FLAGS --hpx:threads=$THREADS 2>&1)
+    echo "$OUTPUT" | grep -E "Sweeps|Construction|cache-misses|dTLB-load-misses"
+    echo "| $LAYOUT | simple_ct | $(echo "$OUTPUT" | count cache-misses) | $(echo "$OUTPUT" | count dTLB-load-misses)" \
+         "| sweeps $(echo "$OUTPUT" | field Sweeps) |" >> $REPORT
+
+    OUTPUT=$(srun -p debug -N 1 -n 1 -c $THREADS perf stat -x, -e $EVENTS $BENCH_PATH --input $APP_OPTIONS --passes 3 $FLAGS --hpx:threads=$THREADS 2>&1)
+    echo "$OUTPUT" | grep -E "Pass|cache-misses|dTLB-load-misses"
+    echo "| $LAYOUT | touch_bench | $(echo "$OUTPUT" | count cache-misses) | $(echo "$OUTPUT" | count dTLB-load-misses)" \
+         "| $(echo "$OUTPUT" | grep "^Pass" | tail -n 1) |" >> $REPORT
+done
+
+cat $REPORT
@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Full against flat augmentation on one locality: sweep and segmentation time, augmentation and arena bytes and
+# peak memory, also as a table in $REPORT. Both write the segmentation as VTK, so both log "Segmentation:".
+
+APP_PATH=build/simple_ct
+APP_OPTIONS=data/bonsai_256x256x256_uint8.mhd
+THREADS=10
+REPORT=results/flat.md
+
+export LD_LIBRARY_PATH=$HOME/lib:$LD_LIBRARY_PATH
+
+# text after the first log line "<name>: "
+field() {
+    sed -n "s/.*$1: //p" | head -n 1
+}
+
+mkdir -p results
+echo "| mode | sweeps | construction | augmentation | arc bodies | boundary nodes | segmentation | peak RSS |" > $REPORT
+echo "|---|---:|---:|---:|---:|---:|---:|---:|" >> $REPORT
+
+for MODE in full flat; do
+    echo "augmentation: $MODE"
+    FLAGS="--vtk results/vtk_$MODE"
+    if [ $MODE = flat ]; then
+        FLAGS="$FLAGS --flat-augmentation"
+    fi
+    OUTPUT=$(srun -p debug -N 1 -n 1 -c $THREADS /usr/bin/time -f "Peak RSS: %M kB" $APP_PATH $APP_OPTIONS $FLAGS --hpx:threads=$THREADS 2>&1)
+    echo "$OUTPUT" | grep -E "Sweeps|Construction|Augmentation|Arc bodies|Boundary nodes|Segmentation|Peak RSS"
+
+    echo "| $MODE | $(echo "$OUTPUT" | field Sweeps) | $(echo "$OUTPUT" | field Construction | cut -d ';' -f 1)" \
+         "| $(echo "$OUTPUT" | field Augmentation) | $(echo "$OUTPUT" | field "Arc bodies")" \
+         "| $(echo "$OUTPUT" | field "Boundary nodes") | $(echo "$OUTPUT" | field Segmentation)" \
+         "| $(echo "$OUTPUT" | field "Peak RSS") |" >> $REPORT
+done
+
+cat $REPORT
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Thread scaling of a single locality: construction time for 1..10 worker threads, also as a table in $REPORT
+
+APP_PATH=build/simple_ct
+APP_OPTIONS=data/bonsai_256x256x256_uint8.mhd
+REPORT=results/scaling.md
+
+export LD_LIBRARY_PATH=$HOME/lib:$LD_LIBRARY_PATH
+
+# seconds of the first log line "<name>: <seconds> s"
+seconds() {
+    sed -n "s/.*$1: \([0-9.e+-]*\) s.*/\1/p" | head -n 1
+}
+
+mkdir -p results
+echo "| threads | initialization [s] | sweeps [s] | construction [s] | speedup |" > $REPORT
+echo "|---:|---:|---:|---:|---:|" >> $REPORT
+
+for THREADS in 1 2 3 4 5 6 7 8 9 10; do
+    echo "threads: $THREADS"
+    OUTPUT=$(srun -p debug -N 1 -n 1 -c 10 $APP_PATH $APP_OPTIONS --hpx:threads=$THREADS)
+    echo "$OUTPUT" | grep -E "Initialization|Sweeps|Construction"
+
+    INIT=$(echo "$OUTPUT" | seconds Initialization)
+    SWEEPS=$(echo "$OUTPUT" | seconds Sweeps)
+    CONSTRUCTION=$(echo "$OUTPUT" | seconds Construction)
+    if [ $THREADS -eq 1 ]; then
+        BASE=$CONSTRUCTION
+    fi
+    SPEEDUP=$(awk -v base=$BASE -v t=$CONSTRUCTION 'BEGIN { if (t > 0) printf "%.2f", base / t }')
+    echo "| $THREADS | $INIT | $SWEEPS | $CONSTRUCTION | $SPEEDUP |" >> $REPORT
+done
+
+cat $REPORT